@@ -0,0 +1,327 @@
+/******************************** admission.c *********************************
+ Description:
+  Connection accounting and admission control. Counts the connections being
+  relayed (in total, per client IP and per host) in memory shared by every
+  process and thread of the proxy and turns new ones away once a limit from
+  the conf file is reached. See admission.h for the conf file options.
+
+  Client IPs and hosts are hashed into a fixed number of counters rather than
+  kept in a table. Two which share a counter share its limit, so a collision
+  can only turn a client away early, never let one past its limit.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+#include "error_codes.h"
+#include "defaults.h"
+
+// Counters shared between the processes, see admission_init()
+struct admission_counts {
+  int max_connections, max_per_ip, max_per_host;
+  int pause;
+
+  int total;
+  int ip_counts[ADMISSION_SLOTS];
+  int host_counts[ADMISSION_SLOTS];
+
+  unsigned long admitted, rejected;
+};
+
+struct admission_counts *admission = NULL;
+
+char overloaded_response[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n\r\n";
+
+
+/**************************** Prototypes ********************************/
+unsigned int admission_hash(unsigned char *data, int length, int lower_case);
+int counter_take(int *counter, int limit);
+void counter_give(int *counter);
+
+void test_admit_client(void);
+void test_admit_host(void);
+/***********************************************************************/
+
+
+/* Sets up the shared counters and reads the limits from the conf file. Must
+ * be called before any workers are forked.
+ * Return -1 on error, 1 on success */
+int admission_init(struct config_sect *config_options)
+{
+  if(admission == NULL){
+    admission = mmap(NULL, sizeof(struct admission_counts),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                     -1, 0);
+    if(admission == MAP_FAILED){
+      printf("ERROR mapping connection counters: %s\n", strerror(errno));
+      admission = NULL;
+      return -1;
+    }
+  }
+
+  admission -> max_connections =
+    extractIntOption(config_options, "max_connections", 0);
+  admission -> max_per_ip = extractIntOption(config_options, "max_per_ip", 0);
+  admission -> max_per_host =
+    extractIntOption(config_options, "max_per_host", 0);
+
+  char *overload = config_get_value(config_options, "default", "overload", 0);
+  admission -> pause = (overload != NULL && strcmp(overload, "pause") == 0);
+  return 1;
+} // End admission_init
+
+
+
+void admission_ticket_init(struct admission_ticket *ticket)
+{
+  ticket -> counted = 0;
+  ticket -> ip_slot = -1;
+  ticket -> host_slot = -1;
+} // End admission_ticket_init
+
+
+
+/* Counts a newly accepted client against the total and its IP.
+ * Return 1 if the client is admitted
+ *        SERVICE_UNAVAILABLE if a limit is reached, nothing is counted */
+int admit_client(int client_sock, struct admission_ticket *ticket)
+{
+  if(admission == NULL) return 1;
+
+  if(counter_take(&(admission -> total), admission -> max_connections) < 0){
+    __atomic_fetch_add(&(admission -> rejected), 1, __ATOMIC_RELAXED);
+    return SERVICE_UNAVAILABLE;
+  }
+  ticket -> counted = 1;
+
+  // Clients which are not on IP (tests use AF_UNIX) have no per IP limit
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  unsigned int slot;
+
+  if(getpeername(client_sock, (struct sockaddr *) &addr, &addr_len) == 0){
+    if(addr.ss_family == AF_INET){
+      struct sockaddr_in *addr4 = (struct sockaddr_in *) &addr;
+      slot = admission_hash((unsigned char *) &(addr4 -> sin_addr),
+                            sizeof(addr4 -> sin_addr), 0);
+      ticket -> ip_slot = slot;
+    }
+    else if(addr.ss_family == AF_INET6){
+      struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &addr;
+      slot = admission_hash((unsigned char *) &(addr6 -> sin6_addr),
+                            sizeof(addr6 -> sin6_addr), 0);
+      ticket -> ip_slot = slot;
+    }
+  }
+
+  if(ticket -> ip_slot >= 0 &&
+     counter_take(&(admission -> ip_counts[ticket -> ip_slot]),
+                  admission -> max_per_ip) < 0)
+    {
+      ticket -> ip_slot = -1;
+      admission_release(ticket);
+      __atomic_fetch_add(&(admission -> rejected), 1, __ATOMIC_RELAXED);
+      return SERVICE_UNAVAILABLE;
+    }
+
+  __atomic_fetch_add(&(admission -> admitted), 1, __ATOMIC_RELAXED);
+  return 1;
+} // End admit_client
+
+
+
+/* Counts a client's connection against the host it asked for.
+ * Return 1 if admitted
+ *        SERVICE_UNAVAILABLE if the host is at its limit */
+int admit_host(char *host, struct admission_ticket *ticket)
+{
+  if(admission == NULL || ticket -> host_slot >= 0) return 1;
+
+  int slot = admission_hash((unsigned char *) host, strlen(host), 1);
+  if(counter_take(&(admission -> host_counts[slot]),
+                  admission -> max_per_host) < 0)
+    {
+      __atomic_fetch_add(&(admission -> rejected), 1, __ATOMIC_RELAXED);
+      return SERVICE_UNAVAILABLE;
+    }
+
+  ticket -> host_slot = slot;
+  return 1;
+} // End admit_host
+
+
+
+// Gives back whatever the ticket was counted against
+void admission_release(struct admission_ticket *ticket)
+{
+  if(admission == NULL) return;
+
+  if(ticket -> host_slot >= 0){
+    counter_give(&(admission -> host_counts[ticket -> host_slot]));
+  }
+  if(ticket -> ip_slot >= 0){
+    counter_give(&(admission -> ip_counts[ticket -> ip_slot]));
+  }
+  if(ticket -> counted) counter_give(&(admission -> total));
+
+  admission_ticket_init(ticket);
+} // End admission_release
+
+
+
+/* Returns 1 if overload = pause and max_connections is reached, the caller
+ * should stop accepting until it is not */
+int admission_paused(void)
+{
+  if(admission == NULL || !admission -> pause ||
+     admission -> max_connections <= 0)
+    return 0;
+
+  return __atomic_load_n(&(admission -> total), __ATOMIC_RELAXED) >=
+    admission -> max_connections;
+} // End admission_paused
+
+
+
+/* Sends a 503 to a client being turned away. Does not block and does not
+ * close the socket. */
+void send_overloaded(int client_sock)
+{
+  // Best effort, a client which can not take it straight away misses out
+  send(client_sock, overloaded_response, sizeof(overloaded_response) - 1,
+       MSG_DONTWAIT | MSG_NOSIGNAL);
+} // End send_overloaded
+
+
+
+// Prints the counters
+void admission_print_stats(void)
+{
+  if(admission == NULL) return;
+
+  printf("connections: %d open, %lu admitted, %lu turned away\n",
+         __atomic_load_n(&(admission -> total), __ATOMIC_RELAXED),
+         __atomic_load_n(&(admission -> admitted), __ATOMIC_RELAXED),
+         __atomic_load_n(&(admission -> rejected), __ATOMIC_RELAXED));
+  fflush(stdout);
+} // End admission_print_stats
+
+
+
+// FNV-1a hash of data, reduced to a counter slot
+unsigned int admission_hash(unsigned char *data, int length, int lower_case)
+{
+  unsigned int hash = 2166136261u;
+  int i;
+
+  for(i = 0; i < length; i++){
+    hash ^= lower_case ? tolower(data[i]) : data[i];
+    hash *= 16777619u;
+  }
+  return hash % ADMISSION_SLOTS;
+} // End admission_hash
+
+
+
+/* Adds one to counter unless that takes it over limit (limit <= 0 is
+ * unlimited).
+ * Return -1 if over the limit, 1 if taken */
+int counter_take(int *counter, int limit)
+{
+  int count = __atomic_add_fetch(counter, 1, __ATOMIC_ACQ_REL);
+  if(limit > 0 && count > limit){
+    __atomic_sub_fetch(counter, 1, __ATOMIC_ACQ_REL);
+    return -1;
+  }
+  return 1;
+} // End counter_take
+
+
+
+void counter_give(int *counter)
+{
+  __atomic_sub_fetch(counter, 1, __ATOMIC_ACQ_REL);
+} // End counter_give
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void admission_tests(void){
+
+  printf("\n\n*** Test admit_client ***\n");
+  test_admit_client();
+
+  printf("\n\n*** Test admit_host ***\n");
+  test_admit_host();
+}
+
+void test_admit_client(void){
+  struct admission_ticket tickets[3];
+  int sockets[2], i, ok = 1;
+
+  admission_init(NULL);
+  admission -> max_connections = 2;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+
+  for(i = 0; i < 3; i++) admission_ticket_init(&tickets[i]);
+
+  if(admit_client(sockets[0], &tickets[0]) != 1) ok = 0;
+  if(admit_client(sockets[0], &tickets[1]) != 1) ok = 0;
+  if(admit_client(sockets[0], &tickets[2]) != SERVICE_UNAVAILABLE) ok = 0;
+  if(tickets[2].counted) ok = 0;
+
+  // Room for one more once one is given back
+  admission_release(&tickets[0]);
+  if(admit_client(sockets[0], &tickets[2]) != 1) ok = 0;
+
+  admission_release(&tickets[1]);
+  admission_release(&tickets[2]);
+  if(admission -> total != 0) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+
+  admission -> max_connections = 0;
+  close(sockets[0]);
+  close(sockets[1]);
+}
+
+void test_admit_host(void){
+  struct admission_ticket first, second;
+  int ok = 1;
+
+  admission_init(NULL);
+  admission -> max_per_host = 1;
+  admission_ticket_init(&first);
+  admission_ticket_init(&second);
+
+  if(admit_host("www.example.com", &first) != 1) ok = 0;
+  // Host names are not case sensitive
+  if(admit_host("WWW.Example.com", &second) != SERVICE_UNAVAILABLE) ok = 0;
+
+  admission_release(&first);
+  if(admit_host("WWW.Example.com", &second) != 1) ok = 0;
+  admission_release(&second);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+
+  admission -> max_per_host = 0;
+}
@@ -0,0 +1,68 @@
+/******************************** admission.h *********************************
+ Description:
+  Connection accounting and admission control. Counts the connections being
+  relayed (in total, per client IP and per host) in memory shared by every
+  process and thread of the proxy and turns new ones away once a limit from
+  the conf file is reached:
+
+   max_connections = n   # connections relayed at once
+   max_per_ip = n        # connections from one client IP
+   max_per_host = n      # connections to one host
+   overload = pause      # stop accepting while max_connections is reached
+                         # (default 503: accept and answer 503)
+
+  Any limit left out (or 0) is unlimited. Clients over the per IP or per host
+  limits are always answered with a 503.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "config.h"
+
+/* What a connection has been counted against, so it can be given back.
+ * Must be set up with admission_ticket_init(). */
+struct admission_ticket {
+  int counted;   // counted in the total
+  int ip_slot;   // -1 if not counted against a client IP
+  int host_slot; // -1 if not counted against a host
+};
+
+
+/* Sets up the shared counters and reads the limits from the conf file. Must
+ * be called before any workers are forked.
+ * Return -1 on error, 1 on success */
+int admission_init(struct config_sect *config_options);
+
+void admission_ticket_init(struct admission_ticket *ticket);
+
+/* Counts a newly accepted client against the total and its IP.
+ * Return 1 if the client is admitted
+ *        SERVICE_UNAVAILABLE if a limit is reached, nothing is counted */
+int admit_client(int client_sock, struct admission_ticket *ticket);
+
+/* Counts a client's connection against the host it asked for.
+ * Return 1 if admitted
+ *        SERVICE_UNAVAILABLE if the host is at its limit */
+int admit_host(char *host, struct admission_ticket *ticket);
+
+// Gives back whatever the ticket was counted against
+void admission_release(struct admission_ticket *ticket);
+
+/* Returns 1 if overload = pause and max_connections is reached, the caller
+ * should stop accepting until it is not */
+int admission_paused(void);
+
+/* Sends a 503 to a client being turned away. Does not block and does not
+ * close the socket. */
+void send_overloaded(int client_sock);
+
+// Prints the counters
+void admission_print_stats(void);
+
+void admission_tests(void);
+
+#endif
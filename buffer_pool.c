@@ -0,0 +1,245 @@
+/******************************** buffer_pool.c *******************************
+ Description:
+  Pool of relay buffers for one worker. See buffer_pool.h.
+
+  Each slab is cut into buffers of one size class when it is mapped. Free
+  buffers are kept on a list per class threaded through the buffers
+  themselves, so taking and giving back a buffer is a push or a pop. Slabs
+  are only given back to the kernel when the pool is destroyed.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+
+struct buffer_slab {
+  void *memory;
+  struct buffer_slab *next;
+};
+
+int use_hugepages = 0;
+
+
+/**************************** Prototypes ********************************/
+int buffer_class(int size);
+int map_slab(struct buffer_pool *pool, int class);
+
+void test_buffer_reuse(void);
+void test_buffer_classes(void);
+/***********************************************************************/
+
+
+/* Backs slabs mapped from now on with hugepages (use = 1): reserved ones if
+ * there are any, otherwise transparent hugepages. Set from the conf file at
+ * start up. */
+void buffer_pool_hugepages(int use)
+{
+  use_hugepages = use;
+} // End buffer_pool_hugepages
+
+
+
+void buffer_pool_init(struct buffer_pool *pool)
+{
+  memset(pool, 0, sizeof(struct buffer_pool));
+} // End buffer_pool_init
+
+
+
+// Unmaps every slab. No buffer from the pool may be used afterwards
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+  while(pool -> slabs != NULL){
+    struct buffer_slab *slab = pool -> slabs;
+    pool -> slabs = slab -> next;
+    buffer_unmap(slab -> memory, BUF_SLAB_SIZE);
+    free(slab);
+  }
+  buffer_pool_init(pool);
+} // End buffer_pool_destroy
+
+
+
+/* Takes a buffer which holds at least size bytes, or BUF_CLASS_MAX if size
+ * is bigger. The contents are whatever the last user left.
+ * Return the buffer or NULL if out of memory */
+char *buffer_get(struct buffer_pool *pool, int size)
+{
+  int class = buffer_class(size);
+
+  if(pool -> free[class] == NULL && map_slab(pool, class) < 0) return NULL;
+
+  char *buffer = pool -> free[class];
+  memcpy(&(pool -> free[class]), buffer, sizeof(char *));
+  return buffer;
+} // End buffer_get
+
+
+
+// Gives back a buffer taken with buffer_get() for the same size
+void buffer_put(struct buffer_pool *pool, char *buffer, int size)
+{
+  if(buffer == NULL) return;
+
+  int class = buffer_class(size);
+  memcpy(buffer, &(pool -> free[class]), sizeof(char *));
+  pool -> free[class] = buffer;
+} // End buffer_put
+
+
+
+// Bytes a buffer taken with buffer_get() for size can hold
+int buffer_size(int size)
+{
+  return BUF_CLASS_MIN << buffer_class(size);
+} // End buffer_size
+
+
+
+/* Maps length bytes (rounded up to the slab size) for buffers, with
+ * hugepages if they are turned on. Freed with buffer_unmap().
+ * Return the memory or NULL on error */
+void *buffer_map(size_t length)
+{
+  void *memory;
+  length = (length + BUF_SLAB_SIZE - 1) / BUF_SLAB_SIZE * BUF_SLAB_SIZE;
+
+  if(use_hugepages){
+    memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(memory != MAP_FAILED) return memory;
+  }
+
+  memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(memory == MAP_FAILED){
+    printf("ERROR mapping relay buffers: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  // No hugepages reserved, ask for transparent ones instead
+  if(use_hugepages) madvise(memory, length, MADV_HUGEPAGE);
+  return memory;
+} // End buffer_map
+
+
+
+void buffer_unmap(void *memory, size_t length)
+{
+  if(memory == NULL) return;
+  length = (length + BUF_SLAB_SIZE - 1) / BUF_SLAB_SIZE * BUF_SLAB_SIZE;
+  munmap(memory, length);
+} // End buffer_unmap
+
+
+
+// Size class which holds size bytes, the biggest if none does
+int buffer_class(int size)
+{
+  int class = 0;
+  while(class < BUF_NUM_CLASSES - 1 && (BUF_CLASS_MIN << class) < size){
+    class++;
+  }
+  return class;
+} // End buffer_class
+
+
+
+/* Maps a slab and puts its buffers on the free list of class.
+ * Return -1 on error, 1 on success */
+int map_slab(struct buffer_pool *pool, int class)
+{
+  struct buffer_slab *slab = malloc(sizeof(struct buffer_slab));
+  if(slab == NULL) return -1;
+
+  slab -> memory = buffer_map(BUF_SLAB_SIZE);
+  if(slab -> memory == NULL){
+    free(slab);
+    return -1;
+  }
+  slab -> next = pool -> slabs;
+  pool -> slabs = slab;
+  pool -> slabs_mapped++;
+
+  // Pushed from the end so buffers are handed out in address order
+  int size = BUF_CLASS_MIN << class;
+  int i;
+  for(i = BUF_SLAB_SIZE / size - 1; i >= 0; i--){
+    buffer_put(pool, (char *) slab -> memory + (size_t) i * size, size);
+  }
+  return 1;
+} // End map_slab
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void buffer_pool_tests(void){
+
+  printf("\n\n*** Test buffer reuse ***\n");
+  test_buffer_reuse();
+
+  printf("\n\n*** Test buffer size classes ***\n");
+  test_buffer_classes();
+}
+
+void test_buffer_reuse(void){
+  struct buffer_pool pool;
+  int ok = 1;
+
+  buffer_pool_init(&pool);
+
+  char *first = buffer_get(&pool, 100);
+  char *second = buffer_get(&pool, 100);
+  if(first == NULL || second == NULL || first == second) ok = 0;
+  else {
+    strcpy(first + 64, "left over");
+    buffer_put(&pool, first, 100);
+
+    // The same buffer comes back, not zeroed (the start held the free list)
+    char *again = buffer_get(&pool, 100);
+    if(again != first || strcmp(again + 64, "left over") != 0) ok = 0;
+  }
+  if(pool.slabs_mapped != 1) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+
+  buffer_pool_destroy(&pool);
+}
+
+void test_buffer_classes(void){
+  struct buffer_pool pool;
+  int ok = 1, i;
+
+  buffer_pool_init(&pool);
+
+  if(buffer_size(1) != BUF_CLASS_MIN) ok = 0;
+  if(buffer_size(BUF_CLASS_MIN + 1) != 2 * BUF_CLASS_MIN) ok = 0;
+  if(buffer_size(10 * BUF_CLASS_MAX) != BUF_CLASS_MAX) ok = 0;
+
+  // A whole slab of the biggest class, then one more needs another slab
+  char *buffers[BUF_SLAB_SIZE / BUF_CLASS_MAX + 1];
+  for(i = 0; i < BUF_SLAB_SIZE / BUF_CLASS_MAX + 1; i++){
+    buffers[i] = buffer_get(&pool, BUF_CLASS_MAX);
+    if(buffers[i] == NULL) ok = 0;
+    else memset(buffers[i], i, BUF_CLASS_MAX); // must not overlap
+  }
+  if(pool.slabs_mapped != 2) ok = 0;
+  for(i = 0; i < BUF_SLAB_SIZE / BUF_CLASS_MAX + 1; i++){
+    if(buffers[i] != NULL && buffers[i][BUF_CLASS_MAX - 1] != (char) i) ok = 0;
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+
+  buffer_pool_destroy(&pool);
+}
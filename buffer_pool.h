@@ -0,0 +1,68 @@
+/******************************** buffer_pool.h *******************************
+ Description:
+  Pool of relay buffers for one worker (a process or a thread, the pool is
+  not locked). Buffers come in a few size classes and are carved out of
+  slabs mapped from the kernel, optionally backed by hugepages. A buffer
+  given back goes on its class's free list and is handed out again as is,
+  it is never zeroed. Connections take a buffer while they have data to
+  move and give it back as soon as it is sent, so idle ones hold none.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+// Size classes are BUF_CLASS_MIN, twice that ... up to BUF_CLASS_MAX
+#define BUF_CLASS_MIN 8192
+#define BUF_CLASS_MAX 65536
+#define BUF_NUM_CLASSES 4
+
+// Buffers are carved from slabs of this size, one hugepage
+#define BUF_SLAB_SIZE (2 * 1024 * 1024)
+
+struct buffer_slab;
+
+struct buffer_pool {
+  char *free[BUF_NUM_CLASSES]; // first free buffer of each class, each
+                               // holds a pointer to the next
+  struct buffer_slab *slabs;   // every slab mapped, freed with the pool
+
+  unsigned long slabs_mapped; // counter
+};
+
+
+/* Backs slabs mapped from now on with hugepages (use = 1): reserved ones if
+ * there are any, otherwise transparent hugepages. Set from the conf file at
+ * start up. */
+void buffer_pool_hugepages(int use);
+
+void buffer_pool_init(struct buffer_pool *pool);
+
+// Unmaps every slab. No buffer from the pool may be used afterwards
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+/* Takes a buffer which holds at least size bytes, or BUF_CLASS_MAX if size
+ * is bigger. The contents are whatever the last user left.
+ * Return the buffer or NULL if out of memory */
+char *buffer_get(struct buffer_pool *pool, int size);
+
+// Gives back a buffer taken with buffer_get() for the same size
+void buffer_put(struct buffer_pool *pool, char *buffer, int size);
+
+// Bytes a buffer taken with buffer_get() for size can hold
+int buffer_size(int size);
+
+/* Maps length bytes (rounded up to the slab size) for buffers, with
+ * hugepages if they are turned on. Freed with buffer_unmap().
+ * Return the memory or NULL on error */
+void *buffer_map(size_t length);
+
+void buffer_unmap(void *memory, size_t length);
+
+void buffer_pool_tests(void);
+
+#endif
@@ -0,0 +1,273 @@
+/********************************* chunked.c **********************************
+ Description:
+  Tracks where a chunked body ends as it streams through. See chunked.h.
+
+  Only the size lines, the CRLFs around the data and the trailer are looked
+  at a byte at a time, the data of each chunk is stepped over in one go. The
+  encoding is followed strictly: a bare LF, a size line without digits or a
+  size which does not fit is an error rather than a guess, as a proxy which
+  frames a body differently from the server can be used to smuggle a request
+  past it.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "chunked.h"
+
+// Shortest end of a body after a chunk's data: CRLF then "0\r\n\r\n"
+#define CHUNK_MIN_TAIL 7
+
+
+/**************************** Prototypes ********************************/
+int hex_value(char c);
+long after_size_line(struct chunk_tracker *chunks);
+
+void test_chunk_whole(void);
+void test_chunk_pieces(void);
+void test_chunk_errors(void);
+/***********************************************************************/
+
+
+// Starts following a new chunked body
+void chunk_start(struct chunk_tracker *chunks)
+{
+  chunks -> state = CHUNK_SIZE;
+  chunks -> size = 0;
+  chunks -> digits = 0;
+  chunks -> data_left = 0;
+} // End chunk_start
+
+
+
+/* Follows the next len bytes of the body at data. Stops at the end of the
+ * body, anything after it is not looked at.
+ * Return how many of the bytes belong to the body, CHUNK_ERROR if they do not
+ * follow the chunked encoding */
+long chunk_frame(struct chunk_tracker *chunks, const char *data, long len)
+{
+  long i = 0;
+
+  while(i < len && chunks -> state != CHUNK_DONE){
+    char c = data[i];
+
+    switch(chunks -> state){
+    case CHUNK_SIZE:
+      if(hex_value(c) >= 0){
+        if(chunks -> size > (LONG_MAX - CHUNK_MIN_TAIL - 16) / 16){
+          return CHUNK_ERROR;
+        }
+        chunks -> size = chunks -> size * 16 + hex_value(c);
+        chunks -> digits++;
+      }
+      else if(chunks -> digits == 0) return CHUNK_ERROR;
+      else if(c == ';' || c == ' ' || c == '\t') chunks -> state = CHUNK_EXT;
+      else if(c == '\r') chunks -> state = CHUNK_SIZE_LF;
+      else return CHUNK_ERROR;
+      break;
+
+    case CHUNK_EXT:
+      if(c == '\r') chunks -> state = CHUNK_SIZE_LF;
+      else if(c == '\n') return CHUNK_ERROR;
+      break;
+
+    case CHUNK_SIZE_LF:
+      if(c != '\n') return CHUNK_ERROR;
+      if(chunks -> size == 0) chunks -> state = CHUNK_TRAILER;
+      else {
+        chunks -> state = CHUNK_DATA;
+        chunks -> data_left = chunks -> size;
+      }
+      break;
+
+    case CHUNK_DATA: {
+      // Step over as much of the data as there is
+      long skip = len - i;
+      if(skip > chunks -> data_left) skip = chunks -> data_left;
+      chunks -> data_left -= skip;
+      i += skip;
+      if(chunks -> data_left == 0) chunks -> state = CHUNK_DATA_CR;
+      continue;
+    }
+
+    case CHUNK_DATA_CR:
+      if(c != '\r') return CHUNK_ERROR;
+      chunks -> state = CHUNK_DATA_LF;
+      break;
+
+    case CHUNK_DATA_LF:
+      if(c != '\n') return CHUNK_ERROR;
+      chunks -> state = CHUNK_SIZE;
+      chunks -> size = 0;
+      chunks -> digits = 0;
+      break;
+
+    case CHUNK_TRAILER:
+      if(c == '\r') chunks -> state = CHUNK_END_LF;
+      else if(c == '\n') return CHUNK_ERROR;
+      else chunks -> state = CHUNK_TRAILER_LINE;
+      break;
+
+    case CHUNK_TRAILER_LINE:
+      if(c == '\r') chunks -> state = CHUNK_TRAILER_LF;
+      else if(c == '\n') return CHUNK_ERROR;
+      break;
+
+    case CHUNK_TRAILER_LF:
+      if(c != '\n') return CHUNK_ERROR;
+      chunks -> state = CHUNK_TRAILER;
+      break;
+
+    case CHUNK_END_LF:
+      if(c != '\n') return CHUNK_ERROR;
+      chunks -> state = CHUNK_DONE;
+      break;
+
+    default:
+      return CHUNK_ERROR; // not following a chunked body
+    }
+    i++;
+  }
+  return i;
+} // End chunk_frame
+
+
+
+// Return the least number of bytes the body still has, 0 once it has ended
+long chunk_remaining(struct chunk_tracker *chunks)
+{
+  switch(chunks -> state){
+  case CHUNK_SIZE:
+    // At least a digit, or the CRLF once there is one
+    if(chunks -> digits == 0) return 1 + 2 + 2;
+    return 2 + after_size_line(chunks);
+  case CHUNK_EXT:
+    return 2 + after_size_line(chunks);
+  case CHUNK_SIZE_LF:
+    return 1 + after_size_line(chunks);
+  case CHUNK_DATA:
+    return chunks -> data_left + CHUNK_MIN_TAIL;
+  case CHUNK_DATA_CR:
+    return CHUNK_MIN_TAIL;
+  case CHUNK_DATA_LF:
+    return CHUNK_MIN_TAIL - 1;
+  case CHUNK_TRAILER:
+    return 2;
+  case CHUNK_TRAILER_LINE:
+    return 2 + 2;
+  case CHUNK_TRAILER_LF:
+    return 1 + 2;
+  case CHUNK_END_LF:
+    return 1;
+  default:
+    return 0;
+  }
+} // End chunk_remaining
+
+
+
+// Least the body has after the size line of the chunk being read
+long after_size_line(struct chunk_tracker *chunks)
+{
+  if(chunks -> size == 0) return 2; // the last chunk, then the empty line
+  return chunks -> size + CHUNK_MIN_TAIL;
+} // End after_size_line
+
+
+
+// Return the value of a hex digit, -1 if c is not one
+int hex_value(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+} // End hex_value
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void chunked_tests(void){
+
+  printf("\n\n*** Test framing a whole chunked body ***\n");
+  test_chunk_whole();
+
+  printf("\n\n*** Test framing a chunked body read in pieces ***\n");
+  test_chunk_pieces();
+
+  printf("\n\n*** Test malformed chunked bodies ***\n");
+  test_chunk_errors();
+}
+
+char chunked_body[] = "5\r\nhello\r\n1A;ext=\"a b\"\r\n"
+  "abcdefghijklmnopqrstuvwxyz\r\n000\r\nTrailer: x\r\n\r\n";
+
+// Stops at the end of the body when the next request follows it
+void test_chunk_whole(void){
+  struct chunk_tracker chunks;
+  char stream[256];
+  int body_len = sizeof(chunked_body) - 1;
+
+  snprintf(stream, sizeof(stream), "%sGET / HTTP/1.1\r\n", chunked_body);
+  chunk_start(&chunks);
+  long framed = chunk_frame(&chunks, stream, strlen(stream));
+
+  if(framed == body_len && chunk_remaining(&chunks) == 0 &&
+     chunk_frame(&chunks, stream + framed, 10) == 0)
+    printf("PASSED TEST\n");
+  else printf("FAILED TEST framed %ld of %d\n", framed, body_len);
+}
+
+/* Read a byte at a time and in pieces of every size up to what remains, the
+ * body ends in the same place, and what remains is never more than is left */
+void test_chunk_pieces(void){
+  struct chunk_tracker chunks;
+  int body_len = sizeof(chunked_body) - 1;
+  int piece, ok = 1;
+
+  for(piece = 1; piece <= body_len && ok; piece++){
+    long done = 0;
+    chunk_start(&chunks);
+    while(chunk_remaining(&chunks) > 0 && ok){
+      long want = chunk_remaining(&chunks);
+      if(want > body_len - done) ok = 0;
+      if(want > piece) want = piece;
+      if(chunk_frame(&chunks, chunked_body + done, want) != want) ok = 0;
+      done += want;
+    }
+    if(done != body_len) ok = 0;
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST in pieces of %d\n", piece - 1);
+}
+
+void test_chunk_errors(void){
+  char *bad[] = {
+    "\r\n",                       // no size
+    "5\nhello\r\n0\r\n\r\n",      // bare LF
+    "5\r\nhelloX\r\n",            // data longer than its size
+    "g\r\n",                      // not hex
+    "ffffffffffffffffff\r\n",     // too big
+    "0\r\nTrailer\n\r\n"
+  };
+  struct chunk_tracker chunks;
+  int i, ok = 1;
+
+  for(i = 0; i < sizeof(bad) / sizeof(bad[0]); i++){
+    chunk_start(&chunks);
+    if(chunk_frame(&chunks, bad[i], strlen(bad[i])) != CHUNK_ERROR){
+      printf("Accepted %d\n", i);
+      ok = 0;
+    }
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
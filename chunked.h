@@ -0,0 +1,63 @@
+/********************************* chunked.h **********************************
+ Description:
+  Follows a body sent with "Transfer-Encoding: chunked" (http spec 3.6.1) as
+  it streams through, to find where it ends without holding on to it. The
+  bytes are not changed, only the chunk sizes are read so the chunk data can
+  be skipped over whole:
+
+   1a;name=value\r\n      chunk size in hex, extensions are ignored
+   ...26 bytes...\r\n
+   0\r\n                  the last chunk
+   Trailer: x\r\n         optional trailer fields
+   \r\n
+
+  chunk_remaining() gives the least the body can still have, so a read of no
+  more than that never takes in anything after it (e.g. a pipelined request).
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#define CHUNK_ERROR -1
+
+// Where a tracker is in the body
+enum chunk_state {
+  CHUNK_OFF = 0,      // the body is not chunked
+  CHUNK_SIZE,         // in the hex size of a chunk
+  CHUNK_EXT,          // in the extensions after the size
+  CHUNK_SIZE_LF,      // at the LF after the size line
+  CHUNK_DATA,         // in the data of a chunk
+  CHUNK_DATA_CR,      // at the CRLF after the data
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,      // at the start of a line after the last chunk
+  CHUNK_TRAILER_LINE, // in a trailer field
+  CHUNK_TRAILER_LF,
+  CHUNK_END_LF,       // at the LF of the empty line which ends the body
+  CHUNK_DONE
+};
+
+struct chunk_tracker {
+  enum chunk_state state;
+  long size;          // of the chunk whose size line is being read
+  int digits;         // of the size read so far
+  long data_left;     // of the chunk whose data is being skipped
+};
+
+// Starts following a new chunked body
+void chunk_start(struct chunk_tracker *chunks);
+
+/* Follows the next len bytes of the body at data. Stops at the end of the
+ * body, anything after it is not looked at.
+ * Return how many of the bytes belong to the body, CHUNK_ERROR if they do not
+ * follow the chunked encoding */
+long chunk_frame(struct chunk_tracker *chunks, const char *data, long len);
+
+// Return the least number of bytes the body still has, 0 once it has ended
+long chunk_remaining(struct chunk_tracker *chunks);
+
+void chunked_tests(void);
+
+#endif
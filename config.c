@@ -17,12 +17,13 @@
 #include <string.h>
 #include <sys/types.h>
 #include "config.h"
+#include "domain_trie.h"
 
 #define MAX_CONF_LEN 256
 #include <string.h>
 
 // Parses the command line args
-char * parseArgs(int argc, char * argv[], int *rate_limiting){
+char * parseArgs(int argc, char * argv[], int *rate_limiting, char **engine){
     int i;
     char * fileName = NULL;
     for(i = 0; i < argc; i++){
@@ -33,6 +34,9 @@ char * parseArgs(int argc, char * argv[], int *rate_limiting){
         if(strcmp(argv[i], "-rl")==0){
             *rate_limiting = 1;
         }
+        if(strcmp(argv[i], "-e")==0 && argv[i+1] != NULL){
+            *engine = argv[i+1];
+        }
     }
 //    return NULL;
     return fileName;
@@ -78,6 +82,16 @@ int extractDebugLevel(struct config_sect *config_options){
     return -1;
 } // End extractDebugLevel
 
+// Finds a numeric option in the default section of the conf file.
+// Returns def_value if the option is not given
+int extractIntOption(struct config_sect *config_options, char *token, int def_value){
+    char *value = config_get_value(config_options, "default", token, 0);
+    if(value == NULL){
+        return def_value;
+    }
+    return atoi(value);
+} // End extractIntOption
+
 /*
  * allocate a new [section] structure
  */
@@ -89,6 +103,7 @@ struct config_sect *config_new_section (char *name)
 	if (new_sect) {
 		new_sect->name = strdup (name);
 		new_sect->tokens = NULL;
+		new_sect->domains = NULL;
 		new_sect->next = NULL;
 	}
 	return (new_sect);
@@ -166,6 +181,11 @@ struct config_sect *config_load (char *filename)
 		}
 	}
 	fclose(fp);
+
+	/* compile every section for config_match_domain () */
+	for (cur_sect = sects; cur_sect; cur_sect = cur_sect->next) {
+		cur_sect->domains = domain_trie_build (cur_sect->tokens);
+	}
 	return sects;
 } /* config_load () */
 
@@ -186,6 +206,29 @@ char *config_get_value (struct config_sect *sects, char *section, char *token, i
 	return (NULL);
 } /* config_get_value () */
 
+/*
+ * find the token of section which is the longest domain rule matching host,
+ * see domain_trie.h. The cost depends on the labels in host, not the rules
+ */
+struct config_token *config_match_domain (struct config_sect *sects, char *section, char *host)
+{
+	struct config_token *best = NULL;
+	int best_labels = 0;
+
+	while (sects) {
+		if (sects->domains && strcmp (section, sects->name) == 0) {
+			int labels;
+			struct config_token *match = domain_trie_match (sects->domains, host, &labels);
+			if (match && labels > best_labels) {
+				best = match;
+				best_labels = labels;
+			}
+		}
+		sects = sects->next;
+	}
+	return (best);
+} /* config_match_domain () */
+
 void config_dump (struct config_sect *sects)
 {
 	while (sects) {
@@ -211,6 +254,7 @@ void config_destroy (struct config_sect *sects)
 			free (memset (token, 0, sizeof (struct config_token)));
 			token = next_token;
 		}
+		domain_trie_free (sects->domains);
 		free (memset (sects->name, 0, strlen (sects->name)));
 		free (memset (sects, 0, sizeof (struct config_sect)));
 		sects = next;
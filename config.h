@@ -19,18 +19,23 @@ struct config_token {
 	struct config_token *next;
 };
 
+struct domain_trie;
+
 struct config_sect {
 	char *name;
 	struct config_token *tokens;
+	struct domain_trie *domains;	/* tokens compiled as domain rules */
 	struct config_sect *next;
 };
 
 struct config_sect *config_load (char *filename);
 char *config_get_value (struct config_sect *sect, char *section, char *token, int icase);
+struct config_token *config_match_domain (struct config_sect *sects, char *section, char *host);
 void config_dump (struct config_sect *sects);
 void config_destroy (struct config_sect *sects);
 
-char * parseArgs(int argc, char * argv[], int *rate_limiting);
+char * parseArgs(int argc, char * argv[], int *rate_limiting, char **engine);
 char * extractListPort(struct config_sect *config_options);
 int extractDebugLevel(struct config_sect *config_options);
+int extractIntOption(struct config_sect *config_options, char *token, int def_value);
 #endif
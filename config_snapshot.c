@@ -0,0 +1,143 @@
+/****************************** config_snapshot.c ******************************
+ Description:
+  Reference counted snapshots of the conf file so it can be reloaded on
+  SIGHUP without disturbing connections in progress. See config_snapshot.h.
+
+  Taking a reference has to read the current pointer and count the reference
+  as one step, otherwise a reload could free the snapshot in between. A mutex
+  covers just that (and the swap), it is taken once per connection and never
+  on the relay path.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "config_snapshot.h"
+#include "admission.h"
+
+struct config_snapshot *current_snapshot = NULL;
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *config_filename = NULL;
+volatile sig_atomic_t reload_pending = 0;
+
+
+/**************************** Prototypes ********************************/
+struct config_snapshot *config_snapshot_new(struct config_sect *config_options);
+void reload_signal(int sig);
+/***********************************************************************/
+
+
+/* Makes config_options, loaded from filename, the current snapshot and
+ * installs the SIGHUP handler. filename may be NULL if there is no conf file,
+ * SIGHUP then does nothing.
+ * Return -1 on error, 1 on success */
+int config_snapshot_init(char *filename, struct config_sect *config_options)
+{
+  current_snapshot = config_snapshot_new(config_options);
+  if(current_snapshot == NULL) return -1;
+  config_filename = filename;
+
+  // Not SA_RESTART so the accept loops wake up to do the reload
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = reload_signal;
+  sigaction(SIGHUP, &action, NULL);
+  return 1;
+} // End config_snapshot_init
+
+
+
+/* Takes a reference to the current snapshot. Must be given back with
+ * config_snapshot_put(). */
+struct config_snapshot *config_snapshot_get(void)
+{
+  pthread_mutex_lock(&snapshot_lock);
+  struct config_snapshot *snapshot = current_snapshot;
+  snapshot -> refs++;
+  pthread_mutex_unlock(&snapshot_lock);
+  return snapshot;
+} // End config_snapshot_get
+
+
+
+// Gives back a reference, freeing the snapshot if it was the last one
+void config_snapshot_put(struct config_snapshot *snapshot)
+{
+  if(snapshot == NULL) return;
+
+  pthread_mutex_lock(&snapshot_lock);
+  int refs = --(snapshot -> refs);
+  pthread_mutex_unlock(&snapshot_lock);
+
+  if(refs == 0){
+    config_destroy(snapshot -> config_options);
+    free(snapshot);
+  }
+} // End config_snapshot_put
+
+
+
+/* Reloads the conf file if a SIGHUP has arrived since the last call. Called
+ * from every accept loop; with several threads only one of them reloads.
+ * The old snapshot stays in use if the file can not be loaded.
+ * Return 1 if a new snapshot was made current, 0 otherwise */
+int config_reload_check(void)
+{
+  if(!reload_pending) return 0;
+  if(!__atomic_exchange_n(&reload_pending, 0, __ATOMIC_ACQ_REL)) return 0;
+  if(config_filename == NULL) return 0;
+
+  struct config_sect *config_options = config_load(config_filename);
+  if(config_options == NULL){
+    printf("ERROR reloading %s, keeping the old config\n", config_filename);
+    return 0;
+  }
+
+  struct config_snapshot *snapshot = config_snapshot_new(config_options);
+  if(snapshot == NULL){
+    config_destroy(config_options);
+    return 0;
+  }
+
+  pthread_mutex_lock(&snapshot_lock);
+  struct config_snapshot *old = current_snapshot;
+  current_snapshot = snapshot;
+  pthread_mutex_unlock(&snapshot_lock);
+
+  // Connections still using the old snapshot hold their own references
+  config_snapshot_put(old);
+
+  admission_init(config_options);
+  printf("Reloaded %s\n", config_filename);
+  fflush(stdout);
+  return 1;
+} // End config_reload_check
+
+
+
+// Returns a snapshot holding the one reference of being current
+struct config_snapshot *config_snapshot_new(struct config_sect *config_options)
+{
+  struct config_snapshot *snapshot = malloc(sizeof(struct config_snapshot));
+  if(snapshot == NULL){
+    printf("ERROR out of memory for config\n");
+    return NULL;
+  }
+  snapshot -> config_options = config_options;
+  snapshot -> refs = 1;
+  return snapshot;
+} // End config_snapshot_new
+
+
+
+void reload_signal(int sig)
+{
+  reload_pending = 1;
+} // End reload_signal
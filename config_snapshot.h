@@ -0,0 +1,48 @@
+/****************************** config_snapshot.h ******************************
+ Description:
+  Reference counted snapshots of the conf file so it can be reloaded on
+  SIGHUP without disturbing connections in progress. A reload loads the file
+  into a new snapshot and swaps it in as the current one. New connections
+  take a reference to the current snapshot and keep it until they close, so
+  they finish on the rules they started with. A snapshot is freed when the
+  last reference to it is given back.
+
+  The listening port and the engine options (workers, cpu_steering,
+  io_backend) are only read at start up.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef CONFIG_SNAPSHOT_H
+#define CONFIG_SNAPSHOT_H
+
+#include "config.h"
+
+// Never changed once it has been made current
+struct config_snapshot {
+  struct config_sect *config_options; // NULL when running without a conf file
+  int refs;
+};
+
+
+/* Makes config_options, loaded from filename, the current snapshot and
+ * installs the SIGHUP handler. filename may be NULL if there is no conf file,
+ * SIGHUP then does nothing.
+ * Return -1 on error, 1 on success */
+int config_snapshot_init(char *filename, struct config_sect *config_options);
+
+/* Takes a reference to the current snapshot. Must be given back with
+ * config_snapshot_put(). */
+struct config_snapshot *config_snapshot_get(void);
+
+// Gives back a reference, freeing the snapshot if it was the last one
+void config_snapshot_put(struct config_snapshot *snapshot);
+
+/* Reloads the conf file if a SIGHUP has arrived since the last call. Called
+ * from every accept loop; with several threads only one of them reloads.
+ * The old snapshot stays in use if the file can not be loaded.
+ * Return 1 if a new snapshot was made current, 0 otherwise */
+int config_reload_check(void);
+
+#endif
@@ -19,6 +19,7 @@
 //The maximum number of digits in the content length
 #define MAX_CONTENT_LENGTH_DIGITS 10 
 #define MAX_URL_SIZE 500 // maximum url length
+#define MAX_PORT_SIZE 8  // port of a CONNECT, digits and the terminator
 
 // Wait time before it will cancel the read operation
 #define READ_TIMEOUT_SEC 120
@@ -27,19 +28,61 @@
 // Default ratelimit
 #define RATE_LIMIT 5
 
+// Burst of a [rates] entry which gives none: this many ms of its rate
+#define RATE_BURST_MS 100
+
+/* A throttled flow waits until it can send this much (one full segment), or
+ * its whole burst if that is smaller, rather than waking every ms */
+#define RATE_MIN_SEND 1460
+
+/* A rate limited client socket holds at most this many ms of its rate unsent
+ * (TCP_NOTSENT_LOWAT, at least RATE_MIN_SEND) and this many ms unsent and in
+ * flight together (SO_SNDBUF), unless its [rates] entry says otherwise */
+#define RATE_QUEUE_MS 20
+#define RATE_SNDBUF_MS 250
+
 #define SERVER_PORT "80" // Default port to send to
 #define DEF_LIS_PORT "8080" // Default listening port
 
-#define MAX_QUEUE 20 // Max queue in accepting connections
+#define MAX_QUEUE 1024 // Max queue in accepting connections
+
+#define DEF_ENGINE "fork" // Relay engine used when -e is not given
+
+#define HANDOFF_QUEUE_SIZE 1024 // Accepted connections waiting per acceptor worker
 
 //The amount read in before being relayed onto sender when no rate limiting applies
 #define RELAY_BUF_SIZE 8096
 
+// Most moved by one splice() (also the size of the pipe spliced through)
+#define RELAY_SPLICE_SIZE 65536
+
+/* Requests sent to a server whose responses can be followed at once (a
+ * multiple of 8). Pipelining more stops the responses being followed. */
+#define RESPONSES_IN_FLIGHT 1024
+
+/* Buffers MSG_ZEROCOPY sends to a client rotate through. A buffer is only
+ * waited on when it comes round again, so this many sends can be waiting to
+ * be acknowledged. */
+#define ZEROCOPY_BUFS 4
+
+
+
+
 
 
 
 
 
 
+// Counters client IPs and hosts are hashed into for admission control
+#define ADMISSION_SLOTS 4096
+// How often a paused accept loop checks whether it can accept again
+#define ADMISSION_POLL_MS 10
 
+// Budgets [shared_rates] rules are hashed into
+#define SHARED_BUDGET_SLOTS 1024
 
+// Bytes a client of weight 1 gets per turn of a contended shared budget
+#define FAIR_QUANTUM 4096
+// Largest weight a [client_weights] entry can give
+#define FAIR_MAX_WEIGHT 64
@@ -0,0 +1,337 @@
+/******************************** domain_trie.c *******************************
+ Description:
+  Domain rules compiled into a trie of labels, last label first. See
+  domain_trie.h.
+
+  The children of every node are kept in one open addressed hash table keyed
+  by the parent node and the label, so stepping from a label to the one
+  before it is a single probe however many rules share the parent (com has
+  tens of thousands of children in a big rule set). Matching a host costs one
+  probe per label of the host and does not depend on the number of rules.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "domain_trie.h"
+#include "config.h"
+
+#define TRIE_MIN_SLOTS 16
+
+
+/**************************** Prototypes ********************************/
+unsigned int label_hash(char *label, int label_len, int parent);
+int find_child(struct domain_trie *trie, int parent, char *label,
+               int label_len, unsigned int hash);
+int add_child(struct domain_trie *trie, int parent, char *label,
+              int label_len);
+int grow_slots(struct domain_trie *trie);
+int previous_label(char *name, int end, int *start);
+
+void test_trie_match(void);
+void test_trie_many_rules(void);
+/***********************************************************************/
+
+
+/* Compiles the tokens of a config section into a trie. The tokens must
+ * outlive it. If two rules are the same the first one is kept.
+ * Return the trie or NULL if out of memory */
+struct domain_trie *domain_trie_build(struct config_token *tokens)
+{
+  struct domain_trie *trie = calloc(1, sizeof(struct domain_trie));
+  if(trie == NULL) return NULL;
+
+  // The root
+  trie -> max_nodes = TRIE_MIN_SLOTS / 2;
+  trie -> nodes = malloc(trie -> max_nodes * sizeof(struct domain_node));
+  if(trie -> nodes == NULL || grow_slots(trie) < 0){
+    domain_trie_free(trie);
+    return NULL;
+  }
+  trie -> nodes[0] = (struct domain_node) {.parent = -1};
+  trie -> num_nodes = 1;
+
+  for(; tokens != NULL; tokens = tokens -> next){
+    char *rule = tokens -> token;
+    if(rule[0] == '*' && rule[1] == '.') rule += 2;
+    else if(rule[0] == '.') rule++;
+
+    int end = strlen(rule), start, node = 0;
+    if(end > 0 && rule[end - 1] == '.') end--;
+    if(end == 0) continue;
+
+    while(previous_label(rule, end, &start)){
+      int len = end - start;
+      int child = find_child(trie, node, rule + start, len,
+                             label_hash(rule + start, len, node));
+      if(child < 0) child = add_child(trie, node, rule + start, len);
+      if(child < 0){
+        printf("ERROR out of memory for domain rules\n");
+        domain_trie_free(trie);
+        return NULL;
+      }
+      node = child;
+      end = start - 1;
+    }
+    // Stopped early at an empty label (a..b), the rule can never match
+    if(end >= 0) continue;
+    if(trie -> nodes[node].entry == NULL) trie -> nodes[node].entry = tokens;
+  }
+  return trie;
+} // End domain_trie_build
+
+
+
+/* Finds the longest rule matching host. labels (if not NULL) is set to the
+ * number of labels in it.
+ * Return the rule's token or NULL if none match */
+struct config_token *domain_trie_match(struct domain_trie *trie, char *host,
+                                       int *labels)
+{
+  struct config_token *best = NULL;
+  int end = strlen(host), start, node = 0, depth = 0;
+
+  if(labels != NULL) *labels = 0;
+  if(end > 0 && host[end - 1] == '.') end--;
+
+  while(previous_label(host, end, &start)){
+    int len = end - start;
+    node = find_child(trie, node, host + start, len,
+                      label_hash(host + start, len, node));
+    if(node < 0) break;
+
+    depth++;
+    if(trie -> nodes[node].entry != NULL){
+      best = trie -> nodes[node].entry;
+      if(labels != NULL) *labels = depth;
+    }
+    end = start - 1;
+  }
+  return best;
+} // End domain_trie_match
+
+
+
+void domain_trie_free(struct domain_trie *trie)
+{
+  if(trie == NULL) return;
+  free(trie -> nodes);
+  free(trie -> slots);
+  free(trie);
+} // End domain_trie_free
+
+
+
+/* Finds the label which ends at name[end] (exclusive). start is set to its
+ * first character.
+ * Return 1 if there is a label there, 0 at the start of the name or at an
+ * empty label */
+int previous_label(char *name, int end, int *start)
+{
+  if(end <= 0) return 0;
+
+  int i = end;
+  while(i > 0 && name[i - 1] != '.') i--;
+  *start = i;
+  return i < end;
+} // End previous_label
+
+
+
+// FNV-1a hash of the label (not case sensitive) under parent
+unsigned int label_hash(char *label, int label_len, int parent)
+{
+  unsigned int hash = 2166136261u ^ (unsigned int) parent;
+  int i;
+
+  hash *= 16777619u;
+  for(i = 0; i < label_len; i++){
+    hash ^= tolower((unsigned char) label[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+} // End label_hash
+
+
+
+// Return the index of the child of parent for label, -1 if it has none
+int find_child(struct domain_trie *trie, int parent, char *label,
+               int label_len, unsigned int hash)
+{
+  unsigned int mask = trie -> num_slots - 1;
+  unsigned int slot = hash & mask;
+
+  while(trie -> slots[slot] >= 0){
+    struct domain_node *node = &(trie -> nodes[trie -> slots[slot]]);
+    if(node -> hash == hash && node -> parent == parent &&
+       node -> label_len == label_len &&
+       strncasecmp(node -> label, label, label_len) == 0)
+      return trie -> slots[slot];
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+} // End find_child
+
+
+
+/* Adds a child of parent for label, which it must not have yet.
+ * Return the index of the child or -1 if out of memory */
+int add_child(struct domain_trie *trie, int parent, char *label,
+              int label_len)
+{
+  if(trie -> num_nodes == trie -> max_nodes){
+    struct domain_node *nodes = realloc(trie -> nodes, 2 * trie -> max_nodes *
+                                        sizeof(struct domain_node));
+    if(nodes == NULL) return -1;
+    trie -> nodes = nodes;
+    trie -> max_nodes *= 2;
+  }
+  if(2 * (trie -> num_nodes + 1) > trie -> num_slots && grow_slots(trie) < 0){
+    return -1;
+  }
+
+  int index = trie -> num_nodes++;
+  struct domain_node *node = &(trie -> nodes[index]);
+  *node = (struct domain_node) {.label = label, .label_len = label_len,
+                                .parent = parent,
+                                .hash = label_hash(label, label_len, parent)};
+
+  unsigned int mask = trie -> num_slots - 1;
+  unsigned int slot = node -> hash & mask;
+  while(trie -> slots[slot] >= 0) slot = (slot + 1) & mask;
+  trie -> slots[slot] = index;
+  return index;
+} // End add_child
+
+
+
+/* Doubles the hash table (or makes the first one) and puts every node but
+ * the root back in it.
+ * Return -1 if out of memory, 1 on success */
+int grow_slots(struct domain_trie *trie)
+{
+  int num_slots = (trie -> num_slots > 0) ? 2 * trie -> num_slots :
+    TRIE_MIN_SLOTS;
+  int *slots = malloc(num_slots * sizeof(int));
+  if(slots == NULL) return -1;
+  memset(slots, -1, num_slots * sizeof(int));
+
+  unsigned int mask = num_slots - 1;
+  int i;
+  for(i = 1; i < trie -> num_nodes; i++){
+    unsigned int slot = trie -> nodes[i].hash & mask;
+    while(slots[slot] >= 0) slot = (slot + 1) & mask;
+    slots[slot] = i;
+  }
+  free(trie -> slots);
+  trie -> slots = slots;
+  trie -> num_slots = num_slots;
+  return 1;
+} // End grow_slots
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void domain_trie_tests(void){
+
+  printf("\n\n*** Test domain rule matching ***\n");
+  test_trie_match();
+
+  printf("\n\n*** Test matching against many domain rules ***\n");
+  test_trie_many_rules();
+}
+
+void test_trie_match(void){
+  struct config_token rules[] = {
+    {.token = "edu.au"}, {.token = "anu.edu.au"}, {.token = "com"},
+    {.token = "*.example.org"}, {.token = "EXAMPLE.net"}, {.token = "edu.au"},
+    {.token = "a..org"}
+  };
+  int i, labels, ok = 1;
+
+  for(i = 0; i < 6; i++) rules[i].next = &(rules[i + 1]);
+  rules[6].next = NULL;
+
+  struct domain_trie *trie = domain_trie_build(rules);
+  if(trie == NULL){
+    printf("FAILED TEST\n");
+    return;
+  }
+
+  struct {char *host; struct config_token *rule; int labels;} cases[] = {
+    {"edu.au", &(rules[0]), 2},
+    {"www.edu.au", &(rules[0]), 2},
+    {"cs.anu.edu.au", &(rules[1]), 3},  // longest wins, not the first
+    {"notedu.au.evil.com", &(rules[2]), 1},
+    {"notedu.au", NULL, 0},
+    {"au", NULL, 0},
+    {"www.example.org", &(rules[3]), 2},
+    {"example.org", &(rules[3]), 2},
+    {"Www.Example.NET.", &(rules[4]), 2},
+    {"example.net..", NULL, 0},
+    {"a..org", NULL, 0},
+    {"www.org", NULL, 0},
+    {"", NULL, 0}
+  };
+
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+    struct config_token *rule = domain_trie_match(trie, cases[i].host,
+                                                  &labels);
+    if(rule != cases[i].rule || labels != cases[i].labels){
+      printf("%s matched %s\n", cases[i].host,
+             (rule == NULL) ? "nothing" : rule -> token);
+      ok = 0;
+    }
+  }
+  domain_trie_free(trie);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+// 50000 rules under com, each found by a host under it
+void test_trie_many_rules(void){
+  int num_rules = 50000, i, ok = 1;
+  struct config_token *rules = calloc(num_rules, sizeof(struct config_token));
+  char *names = malloc(num_rules * 32);
+  if(rules == NULL || names == NULL){
+    printf("FAILED TEST\n");
+    return;
+  }
+
+  for(i = 0; i < num_rules; i++){
+    snprintf(names + i * 32, 32, "site%d.com", i);
+    rules[i].token = names + i * 32;
+    rules[i].next = (i + 1 < num_rules) ? &(rules[i + 1]) : NULL;
+  }
+
+  clock_t start = clock();
+  struct domain_trie *trie = domain_trie_build(rules);
+  clock_t built = clock();
+  if(trie == NULL) ok = 0;
+
+  for(i = 0; ok && i < num_rules; i++){
+    char host[64];
+    snprintf(host, sizeof(host), "www.site%d.com", i);
+    if(domain_trie_match(trie, host, NULL) != &(rules[i])) ok = 0;
+  }
+  if(ok && domain_trie_match(trie, "www.site50000.com", NULL) != NULL) ok = 0;
+  printf("Built %d rules in %ldms, matched them all in %ldms\n", num_rules,
+         (long) ((built - start) * 1000 / CLOCKS_PER_SEC),
+         (long) ((clock() - built) * 1000 / CLOCKS_PER_SEC));
+
+  domain_trie_free(trie);
+  free(rules);
+  free(names);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
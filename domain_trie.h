@@ -0,0 +1,51 @@
+/******************************** domain_trie.h *******************************
+ Description:
+  Domain rules (such as the [rates] entries) compiled into a trie of their
+  labels, last label first, so a host is matched against any number of rules
+  in one walk along its own labels. A rule matches a host which is the rule
+  itself or ends in "." followed by it, so edu.au matches www.anu.edu.au but
+  not notedu.au.evil.com. When several rules match, the longest one (the one
+  with the most labels) wins. Case is ignored, as are a trailing "." on the
+  host and a leading "*." or "." on a rule.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef DOMAIN_TRIE_H
+#define DOMAIN_TRIE_H
+
+struct config_token;
+
+struct domain_node {
+  char *label;                // in the rule's token, not terminated
+  int label_len;
+  int parent;                 // index of the node of the label after it
+  unsigned int hash;          // of the label and the parent
+  struct config_token *entry; // rule which ends at this label, or NULL
+};
+
+struct domain_trie {
+  struct domain_node *nodes;  // nodes[0] is the root
+  int num_nodes, max_nodes;
+  int *slots;                 // node indexes by hash, -1 when empty
+  int num_slots;              // a power of 2, at least twice num_nodes
+};
+
+
+/* Compiles the tokens of a config section into a trie. The tokens must
+ * outlive it. If two rules are the same the first one is kept.
+ * Return the trie or NULL if out of memory */
+struct domain_trie *domain_trie_build(struct config_token *tokens);
+
+/* Finds the longest rule matching host. labels (if not NULL) is set to the
+ * number of labels in it.
+ * Return the rule's token or NULL if none match */
+struct config_token *domain_trie_match(struct domain_trie *trie, char *host,
+                                       int *labels);
+
+void domain_trie_free(struct domain_trie *trie);
+
+void domain_trie_tests(void);
+
+#endif
@@ -32,3 +32,5 @@
 #define EXPECTATION_FAILED -417
 #define IM_A_TEAPOT        -418
 
+#define BAD_GATEWAY         -502
+#define SERVICE_UNAVAILABLE -503
@@ -0,0 +1,1199 @@
+/******************************** event_loop.c ********************************
+ Description:
+  Single process relay engine. Every connection is a small state machine
+  driven from one epoll loop instead of a forked process running relay().
+
+  A connection moves through the following states:
+   CONN_READ_HEADER -> Reading the first request header. Once the host is
+                       known the connection to the server is started.
+   CONN_RELAYING    -> Requests (header and body) are forwarded to the server
+                       and the response is relayed back, rate limited.
+   CONN_TUNNEL_CONNECT -> The first request was a CONNECT, waiting for the
+                       connect to the server to finish.
+   CONN_TUNNEL      -> The client has been told the tunnel is open. Bytes are
+                       relayed both ways without being parsed, rate limited
+                       back to the client like a response.
+   CONN_CLOSED      -> Both sockets closed. The connection is put back on the
+                       free list once the current batch of events is done.
+
+  Data on its way through a connection sits in a buffer from the loop's
+  buffer pool, taken when it is read and given back once it has been sent,
+  so a connection waiting on its sockets holds no buffer.
+
+  Connections of this loop waiting on the same shared budget queue for it in
+  a fair queue (fair_queue.h), which hands the budget out to their clients in
+  turn whenever it has some to give.
+
+  Sockets are registered edge triggered and each side remembers whether it
+  is readable/writable. A side is only read from when the buffer going the
+  other way is empty, so a slow reader holds back the sender the same way
+  the blocking relay does.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#include "event_loop.h"
+#include "timer_heap.h"
+#include "handoff_queue.h"
+#include "buffer_pool.h"
+#include "fair_queue.h"
+#include "admission.h"
+#include "config_snapshot.h"
+#include "error_codes.h"
+#include "defaults.h"
+
+#if RELAY_BUF_SIZE < MAX_HEADER_LENGTH
+#error "RELAY_BUF_SIZE must be able to hold a whole header"
+#endif
+
+#define CONN_READ_HEADER    0
+#define CONN_RELAYING       1
+#define CONN_TUNNEL_CONNECT 2
+#define CONN_TUNNEL         3
+#define CONN_CLOSED         4
+
+// Events returned from a single epoll_wait
+#define MAX_EVENTS 256
+
+#define EDGE_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+#define CONN_OF_TIMER(t) \
+  ((struct connection *) ((char *) (t) - offsetof(struct connection, timer)))
+
+#define CONN_OF_FLOW(f) \
+  ((struct connection *) ((char *) (f) - offsetof(struct connection, fair)))
+
+#define QUEUE_OF_TIMER(t) \
+  ((struct fair_queue *) ((char *) (t) - offsetof(struct fair_queue, timer)))
+
+
+struct relay_buf {
+  char *data;     // RELAY_BUF_SIZE from the pool, NULL when empty
+  int start, end; // data still to be sent is data[start] .. data[end -1]
+};
+
+struct event_handle {
+  int fd;
+  int readable, writable;  // cleared when the socket returns EAGAIN
+  struct connection *conn; // NULL for the listening socket
+};
+
+struct connection {
+  int state;
+  struct event_handle client, server;
+
+  struct header_data request;    // requests read in from the client, holds
+                                 // storage from the pool while any are
+  int header_incomplete;         // request needs more data before parsing
+  long body_remaining;           // request body still to go to the server
+  struct chunk_tracker body_chunks; // where a chunked request body ends
+  int send_more;                 // to_server has body and more follows it
+  char host_field[MAX_URL_SIZE];
+
+  struct relay_buf to_server, to_client;
+  int server_closed;
+  struct response_tracker responses; // where each response from the server
+                                     // ends, to know if it can be reconnected
+
+  struct rate rate_limit;
+  struct rate *rate_limit_ptr;   // NULL if no rate limiting is applied
+  int parked;                    // waiting for the rate limit bin to refill
+  struct fair_flow fair;         // place in the fair queue of its budget
+  int fair_grant;                // left of the budget given by its turn
+
+  long long wake_time;           // when a parked connection can send again
+  long long idle_deadline;       // closed if nothing is read before this
+  struct timer timer;            // expires at the earlier of the two
+
+  struct admission_ticket admission;
+  struct config_snapshot *config; // rules the connection started with
+
+  struct connection *next;       // free list and closed list
+};
+
+struct event_loop {
+  int epoll_fd;
+  struct event_handle listener;  // or the eventfd of the handoff queue
+  struct config_sect *config_options; // start up options, connections use
+                                      // the snapshot they started with
+  int rate_limiting;
+
+  // Acceptor engine workers: sockets come from queues[worker] instead of
+  // a listening socket. NULL otherwise
+  struct handoff_queue *queues;
+  int num_queues, worker;
+
+  int accept_paused;  // listener taken out of epoll, see admission_paused()
+
+  // Holds the timer of every open connection
+  struct timer_heap timers;
+
+  // Connections waiting on a shared budget, one queue per budget
+  struct fair_queue *fair_queues;
+  struct timer_heap fair_timers;  // when each queue's budget has some again
+
+  struct buffer_pool pool;        // relay buffers of every connection
+
+  struct connection *free_list;   // closed connections ready for reuse
+  struct connection *closed_list; // closed during the current batch
+};
+
+
+/**************************** Prototypes ********************************/
+
+struct event_loop *event_loop_new(int watch_fd,
+                                  struct config_sect *config_options,
+                                  int rate_limiting);
+void accept_clients(struct event_loop *loop);
+void take_handoffs(struct event_loop *loop);
+void add_client(struct event_loop *loop, int client_sock);
+void pause_accept(struct event_loop *loop, int pause);
+void conn_progress(struct event_loop *loop, struct connection *conn);
+void close_connection(struct event_loop *loop, struct connection *conn);
+void release_closed(struct event_loop *loop);
+
+int client_to_server(struct event_loop *loop, struct connection *conn);
+int server_to_client(struct event_loop *loop, struct connection *conn);
+int forward_request(struct event_loop *loop, struct connection *conn);
+int start_server(struct event_loop *loop, struct connection *conn, char *port);
+int connect_server(struct event_loop *loop, struct connection *conn, char *port);
+void server_reset(struct connection *conn);
+int open_tunnel(struct event_loop *loop, struct connection *conn, char *port);
+int tunnel_connected(struct event_loop *loop, struct connection *conn);
+int flush_relay_buf(struct event_loop *loop, struct event_handle *handle,
+                    struct relay_buf *buf, int flags);
+int relay_buf_take(struct event_loop *loop, struct relay_buf *buf);
+void relay_buf_release(struct event_loop *loop, struct relay_buf *buf);
+int request_storage_take(struct event_loop *loop, struct header_data *request);
+void request_storage_release(struct event_loop *loop,
+                             struct header_data *request);
+
+void conn_timer_update(struct event_loop *loop, struct connection *conn);
+void run_timers(struct event_loop *loop);
+
+int wait_fair_turn(struct event_loop *loop, struct connection *conn,
+                   long long now);
+void leave_fair_queue(struct event_loop *loop, struct connection *conn);
+struct fair_queue *find_fair_queue(struct event_loop *loop, long long *tat);
+void serve_fair_queue(struct event_loop *loop, struct fair_queue *queue);
+void free_fair_queue(struct event_loop *loop, struct fair_queue *queue);
+
+/***********************************************************************/
+
+
+/* Creates an event loop which accepts connections from lis_sock. The
+ * listening socket is made non-blocking.
+ *
+ * Return: The event loop
+ *         NULL if an error occurred
+ */
+struct event_loop *event_loop_create(int lis_sock,
+                                     struct config_sect *config_options,
+                                     int rate_limiting)
+{
+  assert(lis_sock >= 0);
+
+  int flags = fcntl(lis_sock, F_GETFL, 0);
+  if(flags < 0 || fcntl(lis_sock, F_SETFL, flags | O_NONBLOCK) < 0){
+    printf("ERROR making listening socket non-blocking: %s\n",
+           strerror(errno));
+    return NULL;
+  }
+
+  return event_loop_new(lis_sock, config_options, rate_limiting);
+} // End event_loop_create
+
+
+
+/* Creates an event loop for a worker of the acceptor engine. It relays the
+ * sockets pushed onto queues[worker], and once that is empty steals from
+ * the other queues.
+ *
+ * Return: The event loop
+ *         NULL if an error occurred
+ */
+struct event_loop *event_loop_create_worker(struct handoff_queue *queues,
+                                            int num_queues, int worker,
+                                            struct config_sect *config_options,
+                                            int rate_limiting)
+{
+  assert(worker >= 0 && worker < num_queues);
+
+  struct event_loop *loop =
+    event_loop_new(queues[worker].notify_fd, config_options, rate_limiting);
+  if(loop == NULL) return NULL;
+
+  loop -> queues = queues;
+  loop -> num_queues = num_queues;
+  loop -> worker = worker;
+  return loop;
+} // End event_loop_create_worker
+
+
+
+/* Sets up the loop and registers watch_fd, which is readable when there
+ * are new clients to take.
+ * Return NULL on error */
+struct event_loop *event_loop_new(int watch_fd,
+                                  struct config_sect *config_options,
+                                  int rate_limiting)
+{
+  struct event_loop *loop = calloc(1, sizeof(struct event_loop));
+  if(loop == NULL) return NULL;
+
+  loop -> config_options = config_options;
+  loop -> rate_limiting = rate_limiting;
+  loop -> listener.fd = watch_fd;
+  loop -> listener.conn = NULL;
+  buffer_pool_init(&(loop -> pool));
+
+  loop -> epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(loop -> epoll_fd < 0){
+    printf("ERROR creating epoll: %s\n", strerror(errno));
+    free(loop);
+    return NULL;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN,
+                              .data.ptr = &(loop -> listener)};
+  if(epoll_ctl(loop -> epoll_fd, EPOLL_CTL_ADD, watch_fd, &event) < 0){
+    printf("ERROR adding listening socket to epoll: %s\n", strerror(errno));
+    close(loop -> epoll_fd);
+    free(loop);
+    return NULL;
+  }
+  return loop;
+} // End event_loop_new
+
+
+
+/* Accepts and relays connections until a fatal error occurs.
+ *
+ * Return -1 on error
+ */
+int event_loop_run(struct event_loop *loop)
+{
+  assert(loop != NULL);
+
+  struct epoll_event events[MAX_EVENTS];
+  int i, num_events, timeout, fair_timeout;
+
+  while(1){
+    // Sleep no longer than the first timer
+    timeout = timer_wait_ms(&(loop -> timers));
+    fair_timeout = timer_wait_ms(&(loop -> fair_timers));
+    if(fair_timeout >= 0 && (timeout < 0 || fair_timeout < timeout)){
+      timeout = fair_timeout;
+    }
+    if(loop -> accept_paused && (timeout < 0 || timeout > ADMISSION_POLL_MS)){
+      timeout = ADMISSION_POLL_MS;
+    }
+
+    num_events = epoll_wait(loop -> epoll_fd, events, MAX_EVENTS, timeout);
+
+    // Before accepting so new connections get a new config straight away
+    config_reload_check();
+    if(num_events < 0){
+      if(errno == EINTR) continue;
+      printf("ERROR in epoll_wait: %s\n", strerror(errno));
+      return -1;
+    }
+
+    for(i = 0; i < num_events; i++){
+      struct event_handle *handle = events[i].data.ptr;
+
+      if(handle == &(loop -> listener)){
+        if(loop -> queues != NULL) take_handoffs(loop);
+        else accept_clients(loop);
+        continue;
+      }
+
+      struct connection *conn = handle -> conn;
+      if(conn -> state == CONN_CLOSED) continue;
+
+      if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+        handle -> readable = 1;
+      }
+      if(events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)){
+        handle -> writable = 1;
+      }
+      conn_progress(loop, conn);
+    }
+
+    run_timers(loop);
+    release_closed(loop);
+
+    if(loop -> accept_paused && !admission_paused()) pause_accept(loop, 0);
+  }
+  return -1;
+} // End event_loop_run
+
+
+
+/* Closes every connection owned by the loop and frees it. The listening
+ * socket is left open. */
+void event_loop_destroy(struct event_loop *loop)
+{
+  if(loop == NULL) return;
+
+  // Every open connection is in the timer heap
+  struct timer *timer;
+  while((timer = timer_first(&(loop -> timers))) != NULL){
+    close_connection(loop, CONN_OF_TIMER(timer));
+  }
+  release_closed(loop);
+
+  // Emptied as their connections closed, but not freed
+  while(loop -> fair_queues != NULL){
+    free_fair_queue(loop, loop -> fair_queues);
+  }
+
+  while(loop -> free_list != NULL){
+    struct connection *next = loop -> free_list -> next;
+    free(loop -> free_list);
+    loop -> free_list = next;
+  }
+
+  close(loop -> epoll_fd);
+  timer_heap_free(&(loop -> timers));
+  timer_heap_free(&(loop -> fair_timers));
+  buffer_pool_destroy(&(loop -> pool));
+  free(loop);
+} // End event_loop_destroy
+
+
+
+/* Accepts every waiting connection on the listening socket and registers
+ * it with epoll.
+ */
+void accept_clients(struct event_loop *loop)
+{
+  int client_sock;
+
+  while(1){
+    if(admission_paused()){
+      pause_accept(loop, 1);
+      return;
+    }
+
+    client_sock = accept4(loop -> listener.fd, NULL, NULL, SOCK_NONBLOCK);
+    if(client_sock < 0){
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK){
+        printf("ERROR in accepting connection: %s\n", strerror(errno));
+      }
+      return;
+    }
+    add_client(loop, client_sock);
+  }
+} // End accept_clients
+
+
+
+/* Takes the listening socket out of epoll (pause = 1) while the proxy is at
+ * max_connections, or puts it back (pause = 0). Clients wait in the listen
+ * backlog meanwhile. */
+void pause_accept(struct event_loop *loop, int pause)
+{
+  struct epoll_event event = {.events = pause ? 0 : EPOLLIN,
+                              .data.ptr = &(loop -> listener)};
+  if(epoll_ctl(loop -> epoll_fd, EPOLL_CTL_MOD, loop -> listener.fd,
+               &event) < 0){
+    printf("ERROR pausing the listening socket: %s\n", strerror(errno));
+    return;
+  }
+  loop -> accept_paused = pause;
+} // End pause_accept
+
+
+
+/* Takes every socket handed to this worker, then steals half of what is
+ * waiting on each of the other workers' queues. A worker only gets here when
+ * it is not busy, so work backed up behind a slow worker moves to idle ones.
+ */
+void take_handoffs(struct event_loop *loop)
+{
+  eventfd_t count;
+  int client_sock, i;
+
+  // Clear the wakeup before looking at the queue so a push is not missed
+  eventfd_read(loop -> listener.fd, &count);
+
+  struct handoff_queue *own = &(loop -> queues[loop -> worker]);
+  while((client_sock = handoff_pop(own, 0)) >= 0){
+    add_client(loop, client_sock);
+  }
+
+  for(i = 1; i < loop -> num_queues; i++){
+    struct handoff_queue *victim =
+      &(loop -> queues[(loop -> worker + i) % loop -> num_queues]);
+
+    unsigned long to_steal = (handoff_depth(victim) + 1) / 2;
+    while(to_steal-- > 0 && (client_sock = handoff_pop(victim, 1)) >= 0){
+      add_client(loop, client_sock);
+    }
+  }
+} // End take_handoffs
+
+
+
+/* Sets up a connection for a newly accepted (non-blocking) client socket.
+ * Clients over the connection limits are sent a 503 and closed. */
+void add_client(struct event_loop *loop, int client_sock)
+{
+  struct admission_ticket ticket;
+  admission_ticket_init(&ticket);
+
+  if(admit_client(client_sock, &ticket) < 0){
+    send_overloaded(client_sock);
+    close(client_sock);
+    return;
+  }
+
+  // Reuse a closed connection if there is one
+  struct connection *conn = loop -> free_list;
+  if(conn != NULL) loop -> free_list = conn -> next;
+  else conn = malloc(sizeof(struct connection));
+
+  if(conn == NULL){
+    printf("ERROR out of memory for connection\n");
+    admission_release(&ticket);
+    close(client_sock);
+    return;
+  }
+
+  conn -> state = CONN_READ_HEADER;
+  conn -> client = (struct event_handle) {.fd = client_sock, .conn = conn};
+  conn -> server = (struct event_handle) {.fd = -1, .conn = conn};
+  conn -> request = (struct header_data) {.header_storage = NULL};
+  conn -> header_incomplete = 0;
+  conn -> body_remaining = 0;
+  conn -> body_chunks.state = CHUNK_OFF;
+  conn -> send_more = 0;
+  conn -> to_server = (struct relay_buf) {.data = NULL};
+  conn -> to_client = (struct relay_buf) {.data = NULL};
+  conn -> server_closed = 0;
+  response_init(&(conn -> responses), &(loop -> pool));
+  conn -> rate_limit_ptr = NULL;
+  conn -> parked = 0;
+  conn -> fair.client = NULL;
+  conn -> fair_grant = 0;
+  conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+  conn -> timer.expires = conn -> idle_deadline;
+  conn -> admission = ticket;
+  conn -> config = config_snapshot_get();
+  conn -> next = NULL;
+
+  struct epoll_event event = {.events = EDGE_EVENTS,
+                              .data.ptr = &(conn -> client)};
+  if(epoll_ctl(loop -> epoll_fd, EPOLL_CTL_ADD, client_sock, &event) < 0
+     || timer_add(&(loop -> timers), &(conn -> timer)) < 0)
+    {
+      printf("ERROR registering connection: %s\n", strerror(errno));
+      admission_release(&(conn -> admission));
+      config_snapshot_put(conn -> config);
+      close(client_sock);
+      conn -> next = loop -> free_list;
+      loop -> free_list = conn;
+    }
+} // End add_client
+
+
+
+/* Moves data through the connection until neither direction can make any
+ * more progress without waiting for the sockets or the rate limiter.
+ */
+void conn_progress(struct event_loop *loop, struct connection *conn)
+{
+  int request_status, response_status;
+
+  if(conn -> state == CONN_TUNNEL_CONNECT){
+    if(!conn -> server.writable) return;
+    if(tunnel_connected(loop, conn) < 0){
+      send_connect_failed(conn -> client.fd);
+      close_connection(loop, conn);
+      return;
+    }
+  }
+
+  do {
+    request_status = client_to_server(loop, conn);
+    if(request_status < 0){
+      close_connection(loop, conn);
+      return;
+    }
+
+    response_status = 0;
+    if(conn -> state == CONN_RELAYING || conn -> state == CONN_TUNNEL){
+      response_status = server_to_client(loop, conn);
+      if(response_status < 0){
+        close_connection(loop, conn);
+        return;
+      }
+    }
+  } while(request_status > 0 || response_status > 0);
+
+  // The server has closed and everything it sent has been relayed. If every
+  // request had its whole response the client can carry on, the next
+  // request goes to a new server connection
+  if(conn -> server_closed && conn -> to_client.start == conn -> to_client.end){
+    if(conn -> state == CONN_RELAYING &&
+       response_server_closed(&(conn -> responses)))
+      {
+        server_reset(conn);
+        conn_progress(loop, conn); // requests the client already sent
+      }
+    else close_connection(loop, conn);
+  }
+} // End conn_progress
+
+
+
+// Closes the server connection, which has nothing left to send or receive
+void server_reset(struct connection *conn)
+{
+  close(conn -> server.fd);
+  conn -> server.fd = -1;
+  conn -> server.readable = 0;
+  conn -> server.writable = 0;
+  conn -> server_closed = 0;
+} // End server_reset
+
+
+
+/* Relays CLIENT -> SERVER. Pipelined requests are checked to be for the
+ * same host, as in relay_request(). No rate limiting is applied.
+ *
+ * Return:  1 progress was made
+ *          0 waiting on a socket
+ *        <=-1 the connection should be closed
+ */
+int client_to_server(struct event_loop *loop, struct connection *conn)
+{
+  struct relay_buf *buf = &(conn -> to_server);
+  int nread;
+
+  // Send what is waiting before reading any more from the client
+  if(buf -> start < buf -> end){
+    if(!conn -> server.writable) return 0;
+
+    // The rest of the body follows, do not send a short segment before it
+    int flags = 0;
+    if(conn -> state == CONN_RELAYING && conn -> send_more &&
+       conn -> body_remaining > 0)
+      {
+        flags = MSG_MORE;
+      }
+    return flush_relay_buf(loop, &(conn -> server), buf, flags);
+  }
+
+  if(conn -> body_remaining > 0){
+    if(!conn -> client.readable) return 0;
+
+    int amount = RELAY_BUF_SIZE;
+    if(conn -> body_remaining < amount) amount = conn -> body_remaining;
+
+    if(relay_buf_take(loop, buf) < 0) return -1;
+    nread = read(conn -> client.fd, buf -> data, amount);
+    if(nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      relay_buf_release(loop, buf);
+      conn -> client.readable = 0;
+      return 0;
+    }
+    if(nread <= 0) return -1; // client closed or error
+
+    buf -> start = 0;
+    buf -> end = nread;
+    conn -> send_more = 1;
+    if(track_body(&(conn -> body_remaining), &(conn -> body_chunks),
+                  buf -> data, nread) < 0) return -1;
+    conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+    return 1;
+  }
+
+  // A request may already be waiting from an earlier read
+  if(conn -> request.amount_stored > 0 && !conn -> header_incomplete){
+    return forward_request(loop, conn);
+  }
+
+  if(!conn -> client.readable) return 0;
+
+  struct header_data *request = &(conn -> request);
+  if(request_storage_take(loop, request) < 0) return -1;
+  int space = header_space(request);
+  if(space <= 0) return REQUEST_ENT_TOO_LARGE;
+
+  nread = read(conn -> client.fd,
+               STORED_DATA(request) + request -> amount_stored, space);
+  if(nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+    request_storage_release(loop, request);
+    conn -> client.readable = 0;
+    return 0;
+  }
+  if(nread <= 0) return -1; // client closed or error
+
+  request -> amount_stored += nread;
+  conn -> header_incomplete = 0;
+  conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+  return 1;
+} // End client_to_server
+
+
+
+/* Moves the request at the front of the request storage (and as much of
+ * its body as has been read) into the buffer for the server. The first
+ * request sets the host and connects to the server.
+ *
+ * Return:  1 request queued for the server
+ *          0 the header is not complete yet
+ *        <=-1 the connection should be closed
+ */
+int forward_request(struct event_loop *loop, struct connection *conn)
+{
+  char requested_host[MAX_URL_SIZE];
+  char connect_port[MAX_PORT_SIZE];
+
+  if(relay_buf_take(loop, &(conn -> to_server)) < 0) return -1;
+
+  if(conn -> state == CONN_READ_HEADER){
+    int status = take_connect(&(conn -> request), conn -> host_field,
+                              sizeof(conn -> host_field), connect_port,
+                              sizeof(connect_port));
+    if(status == 1) return open_tunnel(loop, conn, connect_port);
+    if(status < 0 && status != BAD_REQUEST) return status;
+  }
+
+  int amount_copied = take_request(&(conn -> request), requested_host,
+                                   sizeof(requested_host),
+                                   conn -> to_server.data,
+                                   &(conn -> body_remaining),
+                                   &(conn -> body_chunks),
+                                   &(conn -> send_more));
+  if(amount_copied == BAD_REQUEST){
+    relay_buf_release(loop, &(conn -> to_server));
+    conn -> header_incomplete = 1; // wait for the rest of the header
+    return 0;
+  }
+  if(amount_copied < 0) return amount_copied;
+  request_storage_release(loop, &(conn -> request));
+
+  conn -> to_server.start = 0;
+  conn -> to_server.end = amount_copied;
+
+  if(conn -> state == CONN_READ_HEADER){
+    strcpy(conn -> host_field, requested_host);
+    if(start_server(loop, conn, SERVER_PORT) < 0) return -1;
+    conn -> state = CONN_RELAYING;
+  }
+  // if the host field is different close the connection
+  else if(strcmp(conn -> host_field, requested_host) != 0) return -1;
+  // the server closed after answering every request, connect again
+  else if(conn -> server.fd < 0){
+    if(connect_server(loop, conn, SERVER_PORT) < 0) return -1;
+  }
+
+  response_expect(&(conn -> responses), conn -> to_server.data);
+  return 1;
+} // End forward_request
+
+
+
+/* Starts relaying a CONNECT to host_field:port. Anything the client sent
+ * after the CONNECT is queued for the server. Everything the client sends
+ * from now on is treated as one request body which never ends.
+ *
+ * Return 1 on success, -1 if the server could not be reached or is at its
+ * connection limit
+ */
+int open_tunnel(struct event_loop *loop, struct connection *conn, char *port)
+{
+  int status = start_server(loop, conn, port);
+  if(status == -1) send_connect_failed(conn -> client.fd);
+  if(status < 0) return -1;
+
+  struct header_data *request = &(conn -> request);
+  if(request -> amount_stored > 0){
+    memcpy(conn -> to_server.data, STORED_DATA(request),
+           request -> amount_stored);
+    conn -> to_server.start = 0;
+    conn -> to_server.end = request -> amount_stored;
+    request -> amount_stored = 0;
+  }
+  else relay_buf_release(loop, &(conn -> to_server));
+  request_storage_release(loop, request);
+
+  conn -> body_remaining = LONG_MAX;
+  conn -> body_chunks.state = CHUNK_OFF;
+  conn -> state = CONN_TUNNEL_CONNECT;
+  return 1;
+} // End open_tunnel
+
+
+
+/* Checks the connect to the server of a tunnel finished and tells the client
+ * the tunnel is open.
+ *
+ * Return 1 if connected, -1 if the connect failed
+ */
+int tunnel_connected(struct event_loop *loop, struct connection *conn)
+{
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+
+  if(getsockopt(conn -> server.fd, SOL_SOCKET, SO_ERROR, &error,
+                &error_len) < 0 || error != 0)
+    return -1;
+
+  // Goes out before anything the server sends
+  if(relay_buf_take(loop, &(conn -> to_client)) < 0) return -1;
+  memcpy(conn -> to_client.data, CONNECT_ESTABLISHED,
+         strlen(CONNECT_ESTABLISHED));
+  conn -> to_client.start = 0;
+  conn -> to_client.end = strlen(CONNECT_ESTABLISHED);
+  conn -> state = CONN_TUNNEL;
+  return 1;
+} // End tunnel_connected
+
+
+
+/* Sets up the rate limit for the host and starts a non-blocking connect to
+ * port on the server. The server side becomes writable once connected.
+ *
+ * Return 1 on success
+ *        SERVICE_UNAVAILABLE if the host is at its connection limit, the
+ *        client has been sent a 503
+ *        -1 if the server could not be reached
+ */
+int start_server(struct event_loop *loop, struct connection *conn, char *port)
+{
+  struct rate *rate_limit = &(conn -> rate_limit);
+
+  if(admit_host(conn -> host_field, &(conn -> admission)) < 0){
+    send_overloaded(conn -> client.fd);
+    return SERVICE_UNAVAILABLE;
+  }
+
+  rate_init(rate_limit, conn -> config -> config_options, conn -> host_field);
+
+  if(loop -> rate_limiting){
+    conn -> rate_limit_ptr = rate_limit;
+    rate_offload(rate_limit, conn -> client.fd);
+    rate_limit_queue(rate_limit, conn -> client.fd);
+  }
+  if(loop -> rate_limiting && rate_limit -> shared.tat != NULL){
+    fair_flow_init(&(conn -> fair), conn -> client.fd,
+                   conn -> config -> config_options);
+  }
+
+  return connect_server(loop, conn, port);
+} // End start_server
+
+
+
+/* Starts a non-blocking connect to port on the server of host_field.
+ *
+ * Return 1 on success, -1 if the server could not be reached
+ */
+int connect_server(struct event_loop *loop, struct connection *conn, char *port)
+{
+  int server_sock = setup_socket(port, conn -> host_field, SOCK_NONBLOCKING);
+  if(server_sock < 0) return -1;
+
+  conn -> server.fd = server_sock;
+  struct epoll_event event = {.events = EDGE_EVENTS,
+                              .data.ptr = &(conn -> server)};
+  if(epoll_ctl(loop -> epoll_fd, EPOLL_CTL_ADD, server_sock, &event) < 0){
+    printf("ERROR adding server socket to epoll: %s\n", strerror(errno));
+    return -1;
+  }
+  return 1;
+} // End connect_server
+
+
+
+/* Relays SERVER -> CLIENT, rate limited if enabled. When the bin is empty
+ * the connection is parked on the timer heap until it is refilled. When its
+ * host has a shared budget which other connections are waiting on, or which
+ * is empty, it waits for its turn in the fair queue instead.
+ *
+ * Return:  1 progress was made
+ *          0 waiting on a socket or the rate limiter
+ *        <=-1 the connection should be closed
+ */
+int server_to_client(struct event_loop *loop, struct connection *conn)
+{
+  struct relay_buf *buf = &(conn -> to_client);
+
+  if(buf -> start < buf -> end){
+    if(!conn -> client.writable) return 0;
+    return flush_relay_buf(loop, &(conn -> client), buf, 0);
+  }
+
+  if(conn -> server_closed || !conn -> server.readable || conn -> parked ||
+     conn -> fair.client != NULL){
+    return 0;
+  }
+
+  int amount = RELAY_BUF_SIZE;
+  if(conn -> rate_limit_ptr != NULL){
+    long long now = monotonic_ms();
+
+    if(conn -> fair_grant > 0){
+      if(conn -> fair_grant < amount) amount = conn -> fair_grant;
+    }
+    else if(conn -> rate_limit_ptr -> shared.tat != NULL &&
+            bin_allowance(conn -> rate_limit_ptr, amount, now,
+                          &(conn -> wake_time)) > 0)
+      {
+        int waiting = wait_fair_turn(loop, conn, now);
+        if(waiting != 0) return (waiting < 0) ? -1 : 0;
+      }
+
+    amount = rate_allowance(conn -> rate_limit_ptr, amount, now,
+                            &(conn -> wake_time));
+    if(amount == 0){
+      conn -> parked = 1;
+      conn_timer_update(loop, conn);
+      return 0;
+    }
+  }
+
+  if(relay_buf_take(loop, buf) < 0) return -1;
+  int nread = read(conn -> server.fd, buf -> data, amount);
+  if(nread <= 0) relay_buf_release(loop, buf);
+  if(nread < 0){
+    if(errno == EAGAIN || errno == EWOULDBLOCK){
+      conn -> server.readable = 0;
+      return 0;
+    }
+    printf("ERROR in reading:%s\n", strerror(errno));
+    return -1;
+  }
+  if(nread == 0){
+    conn -> server_closed = 1;
+    return 0;
+  }
+
+  if(conn -> rate_limit_ptr != NULL) update_bin(nread, conn -> rate_limit_ptr);
+  if(conn -> fair_grant > 0){
+    conn -> fair_grant = (nread < conn -> fair_grant) ?
+      conn -> fair_grant - nread : 0;
+  }
+  if(conn -> state == CONN_RELAYING){
+    response_track(&(conn -> responses), buf -> data, nread);
+  }
+  buf -> start = 0;
+  buf -> end = nread;
+  conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+  return 1;
+} // End server_to_client
+
+
+
+/* Writes out as much of the buffer as the socket will take. The buffer goes
+ * back to the pool once it is all sent.
+ *
+ * flags -> added to the send() flags, MSG_MORE when more of the same
+ *          message follows
+ *
+ * Return:  1 something was written
+ *          0 the socket would block
+ *         -1 error in writing or the connection was closed
+ */
+int flush_relay_buf(struct event_loop *loop, struct event_handle *handle,
+                    struct relay_buf *buf, int flags)
+{
+  int progress = 0;
+  int nwrite;
+
+  while(buf -> start < buf -> end){
+    nwrite = send(handle -> fd, buf -> data + buf -> start,
+                  buf -> end - buf -> start, MSG_NOSIGNAL | flags);
+    if(nwrite < 0){
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK){
+        handle -> writable = 0;
+        return progress;
+      }
+      return -1;
+    }
+    buf -> start += nwrite;
+    progress = 1;
+  }
+  relay_buf_release(loop, buf);
+  return progress;
+} // End flush_relay_buf
+
+
+
+/* Makes sure buf has a buffer to read into.
+ * Return -1 if out of memory, 1 otherwise */
+int relay_buf_take(struct event_loop *loop, struct relay_buf *buf)
+{
+  if(buf -> data != NULL) return 1;
+
+  buf -> data = buffer_get(&(loop -> pool), RELAY_BUF_SIZE);
+  if(buf -> data == NULL){
+    printf("ERROR out of memory for relay buffers\n");
+    return -1;
+  }
+  return 1;
+} // End relay_buf_take
+
+
+
+// Empties buf and gives its buffer back to the pool
+void relay_buf_release(struct event_loop *loop, struct relay_buf *buf)
+{
+  buffer_put(&(loop -> pool), buf -> data, RELAY_BUF_SIZE);
+  buf -> data = NULL;
+  buf -> start = buf -> end = 0;
+} // End relay_buf_release
+
+
+
+/* Makes sure request has storage to read into.
+ * Return -1 if out of memory, 1 otherwise */
+int request_storage_take(struct event_loop *loop, struct header_data *request)
+{
+  if(request -> header_storage != NULL) return 1;
+
+  request -> header_storage = buffer_get(&(loop -> pool), MAX_HEADER_LENGTH);
+  if(request -> header_storage == NULL){
+    printf("ERROR out of memory for request storage\n");
+    return -1;
+  }
+  request -> start = request -> amount_stored = 0;
+  reset_header(&(request -> info));
+  return 1;
+} // End request_storage_take
+
+
+
+// Gives the storage of request back to the pool if nothing is stored in it
+void request_storage_release(struct event_loop *loop,
+                             struct header_data *request)
+{
+  if(request -> amount_stored > 0) return;
+
+  buffer_put(&(loop -> pool), request -> header_storage, MAX_HEADER_LENGTH);
+  request -> header_storage = NULL;
+} // End request_storage_release
+
+
+
+/* Closes both sides of the connection. It is not reused until the current
+ * batch of events has been handled as later events may still refer to it.
+ */
+void close_connection(struct event_loop *loop, struct connection *conn)
+{
+  if(conn -> state == CONN_CLOSED) return;
+
+  close(conn -> client.fd);
+  if(conn -> server.fd >= 0) close(conn -> server.fd);
+
+  timer_remove(&(loop -> timers), &(conn -> timer));
+  leave_fair_queue(loop, conn);
+  admission_release(&(conn -> admission));
+  config_snapshot_put(conn -> config);
+  relay_buf_release(loop, &(conn -> to_server));
+  relay_buf_release(loop, &(conn -> to_client));
+  response_free(&(conn -> responses));
+  conn -> request.amount_stored = 0;
+  request_storage_release(loop, &(conn -> request));
+  conn -> state = CONN_CLOSED;
+  conn -> next = loop -> closed_list;
+  loop -> closed_list = conn;
+} // End close_connection
+
+
+
+// Moves connections closed during this batch on to the free list
+void release_closed(struct event_loop *loop)
+{
+  while(loop -> closed_list != NULL){
+    struct connection *conn = loop -> closed_list;
+    loop -> closed_list = conn -> next;
+    conn -> next = loop -> free_list;
+    loop -> free_list = conn;
+  }
+} // End release_closed
+
+
+
+/***************************** TIMERS ***********************************/
+
+/* Deadlines are only checked when a connection reaches the top of the heap,
+ * so moving the idle deadline on every read does not touch the heap. */
+
+// Sets the timer to the time the connection next needs attention
+void conn_timer_update(struct event_loop *loop, struct connection *conn)
+{
+  conn -> timer.expires = conn -> idle_deadline;
+  if(conn -> parked && conn -> wake_time < conn -> idle_deadline){
+    conn -> timer.expires = conn -> wake_time;
+  }
+  timer_update(&(loop -> timers), &(conn -> timer));
+} // End conn_timer_update
+
+
+
+// Handles every connection whose timer has expired
+void run_timers(struct event_loop *loop)
+{
+  long long now = monotonic_ms();
+  struct timer *timer;
+
+  while((timer = timer_first(&(loop -> timers))) != NULL &&
+        timer -> expires <= now){
+    struct connection *conn = CONN_OF_TIMER(timer);
+
+    if(conn -> idle_deadline <= now){
+      close_connection(loop, conn);
+      continue;
+    }
+    if(conn -> parked && conn -> wake_time <= now) conn -> parked = 0;
+
+    conn_timer_update(loop, conn);
+    conn_progress(loop, conn);
+  }
+
+  while((timer = timer_first(&(loop -> fair_timers))) != NULL &&
+        timer -> expires <= now){
+    serve_fair_queue(loop, QUEUE_OF_TIMER(timer));
+  }
+} // End run_timers
+
+
+
+/**************************** FAIR QUEUES *******************************/
+
+/* Queues conn for its turn at its shared budget if other connections of the
+ * loop are already waiting on it, or if it is empty. The connection asks
+ * the budget itself only when nobody is waiting and it has some to give.
+ *
+ * Return:  1 conn is waiting for its turn
+ *          0 conn may go ahead
+ *         -1 out of memory
+ */
+int wait_fair_turn(struct event_loop *loop, struct connection *conn,
+                   long long now)
+{
+  struct shared_budget *budget = &(conn -> rate_limit_ptr -> shared);
+  struct fair_queue *queue = find_fair_queue(loop, budget -> tat);
+
+  if(queue == NULL){
+    long long next_send;
+    if(shared_budget_allowance(budget, RATE_MIN_SEND, now, &next_send) > 0){
+      return 0;
+    }
+
+    queue = malloc(sizeof(struct fair_queue));
+    if(queue == NULL){
+      printf("ERROR out of memory for fair queue\n");
+      return -1;
+    }
+    fair_queue_init(queue, budget);
+    queue -> timer.expires = next_send;
+    if(timer_add(&(loop -> fair_timers), &(queue -> timer)) < 0){
+      free(queue);
+      return -1;
+    }
+    queue -> next = loop -> fair_queues;
+    loop -> fair_queues = queue;
+  }
+
+  if(fair_queue_push(queue, &(conn -> fair)) < 0) return -1;
+  return 1;
+} // End wait_fair_turn
+
+
+
+// Takes a closing connection out of the fair queue it is waiting in
+void leave_fair_queue(struct event_loop *loop, struct connection *conn)
+{
+  if(conn -> fair.client == NULL) return;
+
+  struct fair_queue *queue =
+    find_fair_queue(loop, conn -> rate_limit_ptr -> shared.tat);
+  fair_queue_remove(queue, &(conn -> fair));
+  if(fair_queue_empty(queue)) free_fair_queue(loop, queue);
+} // End leave_fair_queue
+
+
+
+// Return the queue of the budget whose TAT is at tat, NULL if it has none
+struct fair_queue *find_fair_queue(struct event_loop *loop, long long *tat)
+{
+  struct fair_queue *queue = loop -> fair_queues;
+
+  while(queue != NULL && queue -> budget.tat != tat) queue = queue -> next;
+  return queue;
+} // End find_fair_queue
+
+
+
+/* Hands out the budget of queue to the connections waiting on it in turn,
+ * each reading what its turn allows, until nobody is waiting (the queue is
+ * freed) or the budget is empty (the queue waits on its timer).
+ */
+void serve_fair_queue(struct event_loop *loop, struct fair_queue *queue)
+{
+  long long next_send;
+  struct fair_flow *flow;
+  int available, most;
+
+  while(!fair_queue_empty(queue)){
+    available = shared_budget_allowance(&(queue -> budget), INT_MAX,
+                                        monotonic_ms(), &next_send);
+    if(available == 0){
+      queue -> timer.expires = next_send;
+      timer_update(&(loop -> fair_timers), &(queue -> timer));
+      return;
+    }
+
+    /* Given no more than the budget holds, so the connection uses all it is
+     * given and queues again (if it wants more) while the client's turn
+     * lasts, rather than parking on its own timer and losing the turn */
+    flow = fair_queue_pop(queue, &most);
+    struct connection *conn = CONN_OF_FLOW(flow);
+    if(available < most) most = available;
+    conn -> fair_grant = most;
+    conn_progress(loop, conn);
+    fair_queue_charge(queue, most - conn -> fair_grant);
+    conn -> fair_grant = 0;
+  }
+  free_fair_queue(loop, queue);
+} // End serve_fair_queue
+
+
+
+// Frees a queue nobody is waiting in
+void free_fair_queue(struct event_loop *loop, struct fair_queue *queue)
+{
+  struct fair_queue **link = &(loop -> fair_queues);
+
+  while(*link != queue) link = &((*link) -> next);
+  *link = queue -> next;
+  timer_remove(&(loop -> fair_timers), &(queue -> timer));
+  free(queue);
+} // End free_fair_queue
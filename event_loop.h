@@ -0,0 +1,51 @@
+/******************************** event_loop.h ********************************
+ Description:
+  Single process relay engine. Every connection is a small state machine
+  driven from one epoll loop instead of a forked process running relay().
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "relay_comms.h"
+#include "handoff_queue.h"
+
+struct event_loop;
+
+
+/* Creates an event loop which accepts connections from lis_sock. The
+ * listening socket is made non-blocking.
+ *
+ * Return: The event loop
+ *         NULL if an error occurred
+ */
+struct event_loop *event_loop_create(int lis_sock,
+                                     struct config_sect *config_options,
+                                     int rate_limiting);
+
+/* Creates an event loop for a worker of the acceptor engine. It relays the
+ * sockets pushed onto queues[worker], and once that is empty steals from
+ * the other queues.
+ *
+ * Return: The event loop
+ *         NULL if an error occurred
+ */
+struct event_loop *event_loop_create_worker(struct handoff_queue *queues,
+                                            int num_queues, int worker,
+                                            struct config_sect *config_options,
+                                            int rate_limiting);
+
+/* Accepts and relays connections until a fatal error occurs.
+ *
+ * Return -1 on error
+ */
+int event_loop_run(struct event_loop *loop);
+
+/* Closes every connection owned by the loop and frees it. The listening
+ * socket is left open. */
+void event_loop_destroy(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,387 @@
+/******************************** fair_queue.c ********************************
+ Description:
+  Deficit round robin between the clients waiting on a shared budget. See
+  fair_queue.h.
+
+  Clients with connections waiting are kept in a round. The client at the
+  front has FAIR_QUANTUM times its weight added to its deficit when its turn
+  starts and its connections are served one after another (each going to the
+  back of the client's list) until what is left of the deficit is less than
+  RATE_MIN_SEND. The client then goes to the back of the round keeping what
+  is left for its next turn. A client which has nothing left waiting leaves
+  the round and loses what it had left, so an idle client can not save up a
+  share to burst with later.
+
+  A flow taken out by fair_queue_pop() has usually asked for more by the time
+  it has been served, so its client is kept until fair_queue_charge() rather
+  than dropped the moment its list is empty.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fair_queue.h"
+#include "defaults.h"
+
+struct fair_client {
+  unsigned int key;
+  int weight;
+  long long deficit;           // bytes it may still send
+  int turn_started;            // the quantum of this turn has been added
+
+  struct fair_flow *head, *tail;      // its connections waiting
+  struct fair_client *prev, *next;    // round
+  struct fair_client *hash_next;
+};
+
+
+/**************************** Prototypes ********************************/
+unsigned int fair_hash(unsigned char *data, int length);
+struct fair_client *find_client(struct fair_queue *queue, unsigned int key);
+void round_append(struct fair_queue *queue, struct fair_client *client);
+void round_unlink(struct fair_queue *queue, struct fair_client *client);
+void drop_client(struct fair_queue *queue, struct fair_client *client);
+
+void test_fair_split(void);
+void test_fair_remove(void);
+/***********************************************************************/
+
+
+/* Gives flow the key and weight of the client on the other end of
+ * client_sock, from the [client_weights] section of config_options. */
+void fair_flow_init(struct fair_flow *flow, int client_sock,
+                    struct config_sect *config_options)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  char name[INET6_ADDRSTRLEN] = "";
+
+  flow -> client_key = 0;
+  flow -> weight = 1;
+  flow -> client = NULL;
+  flow -> next = NULL;
+
+  // Clients which are not on IP (tests use AF_UNIX) all share one key
+  if(getpeername(client_sock, (struct sockaddr *) &addr, &addr_len) < 0){
+    return;
+  }
+  if(addr.ss_family == AF_INET){
+    struct sockaddr_in *addr4 = (struct sockaddr_in *) &addr;
+    flow -> client_key = fair_hash((unsigned char *) &(addr4 -> sin_addr),
+                                   sizeof(addr4 -> sin_addr));
+    inet_ntop(AF_INET, &(addr4 -> sin_addr), name, sizeof(name));
+  }
+  else if(addr.ss_family == AF_INET6){
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &addr;
+    flow -> client_key = fair_hash((unsigned char *) &(addr6 -> sin6_addr),
+                                   sizeof(addr6 -> sin6_addr));
+    inet_ntop(AF_INET6, &(addr6 -> sin6_addr), name, sizeof(name));
+  }
+
+  char *weight = config_get_value(config_options, "client_weights", name, 0);
+  if(weight != NULL){
+    flow -> weight = atoi(weight);
+    if(flow -> weight < 1) flow -> weight = 1;
+    if(flow -> weight > FAIR_MAX_WEIGHT) flow -> weight = FAIR_MAX_WEIGHT;
+  }
+} // End fair_flow_init
+
+
+
+void fair_queue_init(struct fair_queue *queue, struct shared_budget *budget)
+{
+  memset(queue, 0, sizeof(struct fair_queue));
+  queue -> budget = *budget;
+} // End fair_queue_init
+
+
+
+/* Puts flow at the back of its client's connections, and the client at the
+ * back of the round if it had none waiting.
+ * Return -1 if out of memory, 1 on success */
+int fair_queue_push(struct fair_queue *queue, struct fair_flow *flow)
+{
+  assert(flow -> client == NULL);
+
+  struct fair_client *client = find_client(queue, flow -> client_key);
+  if(client == NULL){
+    client = calloc(1, sizeof(struct fair_client));
+    if(client == NULL){
+      printf("ERROR out of memory for fair queue\n");
+      return -1;
+    }
+    client -> key = flow -> client_key;
+    client -> weight = flow -> weight;
+
+    int bucket = client -> key % FAIR_CLIENT_BUCKETS;
+    client -> hash_next = queue -> clients[bucket];
+    queue -> clients[bucket] = client;
+    round_append(queue, client);
+  }
+
+  flow -> next = NULL;
+  if(client -> tail != NULL) client -> tail -> next = flow;
+  else client -> head = flow;
+  client -> tail = flow;
+
+  flow -> client = client;
+  queue -> num_flows++;
+  return 1;
+} // End fair_queue_push
+
+
+
+// Takes a waiting flow out of the queue, e.g. when its connection closes
+void fair_queue_remove(struct fair_queue *queue, struct fair_flow *flow)
+{
+  struct fair_client *client = flow -> client;
+  if(client == NULL) return;
+
+  struct fair_flow **link = &(client -> head);
+  struct fair_flow *prev = NULL;
+  while(*link != flow){
+    prev = *link;
+    link = &((*link) -> next);
+  }
+  *link = flow -> next;
+  if(client -> tail == flow) client -> tail = prev;
+
+  flow -> client = NULL;
+  flow -> next = NULL;
+  queue -> num_flows--;
+
+  // The client being served is dealt with by fair_queue_charge()
+  if(client -> head == NULL && client != queue -> serving){
+    drop_client(queue, client);
+  }
+} // End fair_queue_remove
+
+
+
+/* Takes the next flow to serve out of the queue: the first connection of
+ * the client whose turn it is. most is set to what is left of the client's
+ * share this turn. Once the flow has been served fair_queue_charge() must be
+ * called before the next pop; the flow may be pushed again before that.
+ *
+ * Return the flow, NULL if none are waiting
+ */
+struct fair_flow *fair_queue_pop(struct fair_queue *queue, int *most)
+{
+  assert(queue -> serving == NULL);
+
+  struct fair_client *client = queue -> head;
+  if(client == NULL) return NULL;
+
+  if(!client -> turn_started){
+    client -> deficit += (long long) FAIR_QUANTUM * client -> weight;
+    client -> turn_started = 1;
+  }
+
+  struct fair_flow *flow = client -> head;
+  client -> head = flow -> next;
+  if(client -> head == NULL) client -> tail = NULL;
+  flow -> client = NULL;
+  flow -> next = NULL;
+  queue -> num_flows--;
+
+  queue -> serving = client;
+  *most = (client -> deficit > INT_MAX) ? INT_MAX : client -> deficit;
+  return flow;
+} // End fair_queue_pop
+
+
+
+/* Takes sent out of the share of the client of the last pop. Its turn ends
+ * once what is left is too little to send, or when it has nothing waiting.
+ */
+void fair_queue_charge(struct fair_queue *queue, int sent)
+{
+  struct fair_client *client = queue -> serving;
+  if(client == NULL) return;
+  queue -> serving = NULL;
+
+  client -> deficit -= sent;
+  if(client -> deficit < 0) client -> deficit = 0;
+
+  if(client -> head == NULL){
+    drop_client(queue, client);
+  }
+  else if(client -> deficit < RATE_MIN_SEND){
+    round_unlink(queue, client);
+    round_append(queue, client);
+    client -> turn_started = 0;
+  }
+} // End fair_queue_charge
+
+
+
+// Return 1 if no flows are waiting and none is being served
+int fair_queue_empty(struct fair_queue *queue)
+{
+  return queue -> num_flows == 0 && queue -> serving == NULL;
+} // End fair_queue_empty
+
+
+
+// FNV-1a hash of a client address
+unsigned int fair_hash(unsigned char *data, int length)
+{
+  unsigned int hash = 2166136261u;
+  int i;
+
+  for(i = 0; i < length; i++){
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+} // End fair_hash
+
+
+
+// Return the client with key which has flows in the queue, or NULL
+struct fair_client *find_client(struct fair_queue *queue, unsigned int key)
+{
+  struct fair_client *client = queue -> clients[key % FAIR_CLIENT_BUCKETS];
+
+  while(client != NULL && client -> key != key) client = client -> hash_next;
+  return client;
+} // End find_client
+
+
+
+void round_append(struct fair_queue *queue, struct fair_client *client)
+{
+  client -> next = NULL;
+  client -> prev = queue -> tail;
+  if(queue -> tail != NULL) queue -> tail -> next = client;
+  else queue -> head = client;
+  queue -> tail = client;
+} // End round_append
+
+
+
+void round_unlink(struct fair_queue *queue, struct fair_client *client)
+{
+  if(client -> prev != NULL) client -> prev -> next = client -> next;
+  else queue -> head = client -> next;
+  if(client -> next != NULL) client -> next -> prev = client -> prev;
+  else queue -> tail = client -> prev;
+} // End round_unlink
+
+
+
+// Takes a client with nothing waiting out of the round and frees it
+void drop_client(struct fair_queue *queue, struct fair_client *client)
+{
+  round_unlink(queue, client);
+
+  struct fair_client **link = &(queue -> clients[client -> key %
+                                                 FAIR_CLIENT_BUCKETS]);
+  while(*link != client) link = &((*link) -> hash_next);
+  *link = client -> hash_next;
+  free(client);
+} // End drop_client
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void fair_queue_tests(void){
+
+  printf("\n\n*** Test fair queue splits by client, not connection ***\n");
+  test_fair_split();
+
+  printf("\n\n*** Test fair queue removal ***\n");
+  test_fair_remove();
+}
+
+/* Client 1 has five connections, client 2 one and client 3 one with weight
+ * 3. Every connection always wants more and reads up to RELAY_BUF_SIZE at a
+ * time: clients 1 and 2 should get the same and client 3 three times that */
+void test_fair_split(void){
+  struct shared_budget budget = {.tat = NULL};
+  struct fair_queue queue;
+  struct fair_flow flows[7];
+  long long sent[3] = {0, 0, 0};
+  int i, ok = 1;
+
+  fair_queue_init(&queue, &budget);
+  for(i = 0; i < 7; i++){
+    flows[i] = (struct fair_flow) {.client_key = (i < 5) ? 1 : i - 3,
+                                   .weight = (i == 6) ? 3 : 1};
+    if(fair_queue_push(&queue, &(flows[i])) < 0) ok = 0;
+  }
+
+  for(i = 0; i < 10000; i++){
+    int most;
+    struct fair_flow *flow = fair_queue_pop(&queue, &most);
+    if(flow == NULL){
+      ok = 0;
+      break;
+    }
+    int amount = (most < RELAY_BUF_SIZE) ? most : RELAY_BUF_SIZE;
+    sent[flow -> client_key - 1] += amount;
+    fair_queue_push(&queue, flow);
+    fair_queue_charge(&queue, amount);
+  }
+
+  printf("Sent client 1 (5 connections) %lld, client 2 %lld, "
+         "client 3 (weight 3) %lld\n", sent[0], sent[1], sent[2]);
+  // Each client can be at most a turn ahead of the others
+  long long turn = (long long) 3 * FAIR_QUANTUM + RELAY_BUF_SIZE;
+  if(llabs(sent[0] - sent[1]) > turn) ok = 0;
+  if(llabs(sent[2] - 3 * sent[1]) > 3 * turn) ok = 0;
+
+  for(i = 0; i < 7; i++) fair_queue_remove(&queue, &(flows[i]));
+  if(!fair_queue_empty(&queue)) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+/* Flows leaving the queue while waiting, and the flow being served leaving
+ * its client with nothing, leave the queue empty */
+void test_fair_remove(void){
+  struct shared_budget budget = {.tat = NULL};
+  struct fair_queue queue;
+  struct fair_flow flows[3];
+  int i, most, ok = 1;
+
+  fair_queue_init(&queue, &budget);
+  for(i = 0; i < 3; i++){
+    flows[i] = (struct fair_flow) {.client_key = i % 2, .weight = 1};
+    fair_queue_push(&queue, &(flows[i]));
+  }
+
+  // Client 0 has flows 0 and 2, client 1 flow 1
+  fair_queue_remove(&queue, &(flows[1]));
+  if(queue.head == NULL || queue.head != queue.tail) ok = 0;
+
+  struct fair_flow *flow = fair_queue_pop(&queue, &most);
+  if(flow != &(flows[0]) || most != FAIR_QUANTUM) ok = 0;
+  fair_queue_remove(&queue, &(flows[2]));
+  if(fair_queue_empty(&queue)) ok = 0; // still being served
+  fair_queue_charge(&queue, 100);
+  if(!fair_queue_empty(&queue) || queue.head != NULL) ok = 0;
+
+  // A client which left the round starts again with no deficit
+  fair_queue_push(&queue, &(flows[0]));
+  flow = fair_queue_pop(&queue, &most);
+  if(flow != &(flows[0]) || most != FAIR_QUANTUM) ok = 0;
+  fair_queue_charge(&queue, most);
+  if(!fair_queue_empty(&queue)) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
@@ -0,0 +1,85 @@
+/******************************** fair_queue.h ********************************
+ Description:
+  Deficit round robin between the clients whose connections are waiting on
+  one shared budget in one event loop. Without it a contended budget goes to
+  whichever connection asks first, so a client with more connections gets
+  more of it. With it the budget is handed to one client at a time in turn,
+  each getting FAIR_QUANTUM bytes per turn times its weight, and a client's
+  own connections take turns within its share.
+
+  Weights are given per client IP in their own section of the conf file:
+
+   [client_weights]
+   10.0.0.5  4   # gets four times the share of a client with no entry
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include "config.h"
+#include "shared_budget.h"
+#include "timer_heap.h"
+
+// Buckets of the table of clients in each queue
+#define FAIR_CLIENT_BUCKETS 64
+
+struct fair_client;
+
+// Embedded in a connection which may have to wait on a fair queue
+struct fair_flow {
+  unsigned int client_key;     // hash of the client's IP
+  int weight;
+  struct fair_client *client;  // NULL unless waiting in a queue
+  struct fair_flow *next;      // next connection of the same client
+};
+
+struct fair_queue {
+  struct shared_budget budget;         // the budget it hands out
+  struct fair_client *head, *tail;     // round of clients with flows waiting
+  struct fair_client *serving;         // client of the last fair_queue_pop()
+  struct fair_client *clients[FAIR_CLIENT_BUCKETS];
+  int num_flows;
+
+  struct timer timer;                  // when the budget can next be given
+  struct fair_queue *next;             // other queues of the same loop
+};
+
+
+/* Gives flow the key and weight of the client on the other end of
+ * client_sock, from the [client_weights] section of config_options. */
+void fair_flow_init(struct fair_flow *flow, int client_sock,
+                    struct config_sect *config_options);
+
+void fair_queue_init(struct fair_queue *queue, struct shared_budget *budget);
+
+/* Puts flow at the back of its client's connections, and the client at the
+ * back of the round if it had none waiting.
+ * Return -1 if out of memory, 1 on success */
+int fair_queue_push(struct fair_queue *queue, struct fair_flow *flow);
+
+// Takes a waiting flow out of the queue, e.g. when its connection closes
+void fair_queue_remove(struct fair_queue *queue, struct fair_flow *flow);
+
+/* Takes the next flow to serve out of the queue: the first connection of
+ * the client whose turn it is. most is set to what is left of the client's
+ * share this turn. Once the flow has been served fair_queue_charge() must be
+ * called before the next pop; the flow may be pushed again before that.
+ *
+ * Return the flow, NULL if none are waiting
+ */
+struct fair_flow *fair_queue_pop(struct fair_queue *queue, int *most);
+
+/* Takes sent out of the share of the client of the last pop. Its turn ends
+ * once what is left is too little to send, or when it has nothing waiting.
+ */
+void fair_queue_charge(struct fair_queue *queue, int sent);
+
+// Return 1 if no flows are waiting and none is being served
+int fair_queue_empty(struct fair_queue *queue);
+
+void fair_queue_tests(void);
+
+#endif
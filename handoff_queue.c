@@ -0,0 +1,327 @@
+/******************************* handoff_queue.c *******************************
+ Description:
+  Bounded lock-free multi-producer multi-consumer queue of accepted client
+  sockets. The acceptor engine gives each worker thread one of these. The
+  acceptor pushes onto a worker's queue and idle workers steal from the
+  queues of busy ones.
+
+  Each cell carries a sequence number saying which lap of the ring it is
+  ready for, so producers and consumers only contend on the head/tail
+  index they move (D. Vyukov's bounded MPMC queue).
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "handoff_queue.h"
+
+/**************************** Prototypes ********************************/
+void counter_max(unsigned long *counter, unsigned long value);
+
+void test_handoff_order(void);
+void test_handoff_full(void);
+void test_handoff_threads(void);
+void *test_handoff_producer(void *arg);
+void *test_handoff_consumer(void *arg);
+/***********************************************************************/
+
+
+/* Sets up a queue of size slots (rounded up to a power of 2) and the eventfd
+ * used to wake the worker which owns it.
+ * Return -1 on error, 1 on success */
+int handoff_queue_init(struct handoff_queue *queue, unsigned long size)
+{
+  unsigned long slots = 2, i;
+  while(slots < size) slots *= 2;
+
+  memset(queue, 0, sizeof(struct handoff_queue));
+  queue -> cells = malloc(slots * sizeof(struct handoff_cell));
+  if(queue -> cells == NULL) return -1;
+
+  queue -> notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(queue -> notify_fd < 0){
+    printf("ERROR creating eventfd: %s\n", strerror(errno));
+    free(queue -> cells);
+    return -1;
+  }
+
+  queue -> mask = slots - 1;
+  for(i = 0; i < slots; i++) queue -> cells[i].seq = i;
+  return 1;
+} // End handoff_queue_init
+
+
+
+// Frees the queue, closing any sockets still in it
+void handoff_queue_free(struct handoff_queue *queue)
+{
+  int fd;
+  while((fd = handoff_pop(queue, 0)) >= 0) close(fd);
+
+  close(queue -> notify_fd);
+  free(queue -> cells);
+  queue -> cells = NULL;
+} // End handoff_queue_free
+
+
+
+/* Adds fd to the back of the queue.
+ * Return -1 if the queue is full, 1 on success */
+int handoff_push(struct handoff_queue *queue, int fd)
+{
+  struct handoff_cell *cell;
+  unsigned long pos = __atomic_load_n(&(queue -> tail), __ATOMIC_RELAXED);
+
+  while(1){
+    cell = &(queue -> cells[pos & queue -> mask]);
+    unsigned long seq = __atomic_load_n(&(cell -> seq), __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - pos);
+
+    if(diff == 0){
+      // The cell is free on this lap, claim it
+      if(__atomic_compare_exchange_n(&(queue -> tail), &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(diff < 0){
+      // Still holds a socket from the last lap
+      __atomic_fetch_add(&(queue -> full), 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    else pos = __atomic_load_n(&(queue -> tail), __ATOMIC_RELAXED);
+  }
+
+  cell -> fd = fd;
+  __atomic_store_n(&(cell -> seq), pos + 1, __ATOMIC_RELEASE);
+
+  __atomic_fetch_add(&(queue -> pushed), 1, __ATOMIC_RELAXED);
+  counter_max(&(queue -> max_depth), handoff_depth(queue));
+  return 1;
+} // End handoff_push
+
+
+
+/* Takes the socket at the front of the queue. stealing is set when the
+ * caller is not the owner of the queue, it is only used for the counters.
+ * Return the socket or -1 if the queue is empty */
+int handoff_pop(struct handoff_queue *queue, int stealing)
+{
+  struct handoff_cell *cell;
+  unsigned long pos = __atomic_load_n(&(queue -> head), __ATOMIC_RELAXED);
+
+  while(1){
+    cell = &(queue -> cells[pos & queue -> mask]);
+    unsigned long seq = __atomic_load_n(&(cell -> seq), __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - (pos + 1));
+
+    if(diff == 0){
+      if(__atomic_compare_exchange_n(&(queue -> head), &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(diff < 0) return -1; // nothing pushed into the cell yet
+    else pos = __atomic_load_n(&(queue -> head), __ATOMIC_RELAXED);
+  }
+
+  int fd = cell -> fd;
+  // Free the cell for the next lap
+  __atomic_store_n(&(cell -> seq), pos + queue -> mask + 1, __ATOMIC_RELEASE);
+
+  if(stealing) __atomic_fetch_add(&(queue -> stolen), 1, __ATOMIC_RELAXED);
+  else __atomic_fetch_add(&(queue -> popped), 1, __ATOMIC_RELAXED);
+  return fd;
+} // End handoff_pop
+
+
+
+// Number of sockets waiting in the queue (approximate while it is in use)
+unsigned long handoff_depth(struct handoff_queue *queue)
+{
+  unsigned long head = __atomic_load_n(&(queue -> head), __ATOMIC_RELAXED);
+  unsigned long tail = __atomic_load_n(&(queue -> tail), __ATOMIC_RELAXED);
+  return (tail > head) ? tail - head : 0;
+} // End handoff_depth
+
+
+
+// Wakes the worker which owns the queue
+void handoff_notify(struct handoff_queue *queue)
+{
+  eventfd_write(queue -> notify_fd, 1);
+} // End handoff_notify
+
+
+
+// Prints the counters of each queue, to see how evenly work is spread
+void handoff_print_stats(struct handoff_queue *queues, int num_queues)
+{
+  int i;
+  printf("worker   depth  max_depth     pushed     popped  stolen_from  full\n");
+  for(i = 0; i < num_queues; i++){
+    struct handoff_queue *queue = &(queues[i]);
+    printf("%6d %7lu %10lu %10lu %10lu %12lu %5lu\n", i, handoff_depth(queue),
+           __atomic_load_n(&(queue -> max_depth), __ATOMIC_RELAXED),
+           __atomic_load_n(&(queue -> pushed), __ATOMIC_RELAXED),
+           __atomic_load_n(&(queue -> popped), __ATOMIC_RELAXED),
+           __atomic_load_n(&(queue -> stolen), __ATOMIC_RELAXED),
+           __atomic_load_n(&(queue -> full), __ATOMIC_RELAXED));
+  }
+  fflush(stdout);
+} // End handoff_print_stats
+
+
+
+// Raises counter to value if it is bigger
+void counter_max(unsigned long *counter, unsigned long value)
+{
+  unsigned long current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  while(value > current &&
+        !__atomic_compare_exchange_n(counter, &current, value, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+} // End counter_max
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+#define TEST_PRODUCERS 2
+#define TEST_CONSUMERS 2
+#define TEST_PER_PRODUCER 100000
+
+struct test_handoff_arg {
+  struct handoff_queue *queue;
+  int id;
+  long sum;         // consumers: sum of the values taken
+  long count;       // consumers: number of values taken
+  int *done;        // set once every producer has finished
+};
+
+void handoff_queue_tests(void){
+
+  printf("\n\n*** Test handoff queue order ***\n");
+  test_handoff_order();
+
+  printf("\n\n*** Test handoff queue full ***\n");
+  test_handoff_full();
+
+  printf("\n\n*** Test handoff queue threads ***\n");
+  test_handoff_threads();
+}
+
+void test_handoff_order(void){
+  struct handoff_queue queue;
+  int i, fd, ok = 1;
+
+  handoff_queue_init(&queue, 8);
+
+  // Go round the ring a few times
+  for(i = 0; i < 20; i++){
+    handoff_push(&queue, i);
+    handoff_push(&queue, i + 100);
+    if(handoff_pop(&queue, 0) != i) ok = 0;
+    if(handoff_pop(&queue, 1) != i + 100) ok = 0;
+  }
+  fd = handoff_pop(&queue, 0);
+  if(fd != -1) ok = 0;
+
+  if(ok && queue.popped == 20 && queue.stolen == 20) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+
+  handoff_queue_free(&queue);
+}
+
+void test_handoff_full(void){
+  struct handoff_queue queue;
+  int i, ok = 1;
+
+  handoff_queue_init(&queue, 5); // rounded up to 8
+
+  for(i = 0; i < 8; i++){
+    if(handoff_push(&queue, i) < 0) ok = 0;
+  }
+  if(handoff_push(&queue, 8) != -1) ok = 0;
+  if(handoff_depth(&queue) != 8 || queue.max_depth != 8 || queue.full != 1)
+    ok = 0;
+
+  // A slot frees up once one is taken
+  if(handoff_pop(&queue, 0) != 0) ok = 0;
+  if(handoff_push(&queue, 8) != 1) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+
+  // Nothing in the queue is a real socket
+  while(handoff_pop(&queue, 0) >= 0);
+  handoff_queue_free(&queue);
+}
+
+void *test_handoff_producer(void *arg){
+  struct test_handoff_arg *info = arg;
+  int i;
+
+  for(i = 1; i <= TEST_PER_PRODUCER; i++){
+    while(handoff_push(info -> queue, i) < 0);
+  }
+  return NULL;
+}
+
+void *test_handoff_consumer(void *arg){
+  struct test_handoff_arg *info = arg;
+  int fd;
+
+  while(1){
+    fd = handoff_pop(info -> queue, info -> id);
+    if(fd >= 0){
+      info -> sum += fd;
+      info -> count++;
+    }
+    else if(__atomic_load_n(info -> done, __ATOMIC_ACQUIRE) &&
+            handoff_depth(info -> queue) == 0)
+      return NULL;
+  }
+}
+
+void test_handoff_threads(void){
+  struct handoff_queue queue;
+  pthread_t producers[TEST_PRODUCERS], consumers[TEST_CONSUMERS];
+  struct test_handoff_arg info[TEST_CONSUMERS], producer_info;
+  int i, done = 0;
+  long sum = 0, count = 0;
+
+  handoff_queue_init(&queue, 64);
+
+  for(i = 0; i < TEST_CONSUMERS; i++){
+    info[i] = (struct test_handoff_arg) {.queue = &queue, .id = i,
+                                         .done = &done};
+    pthread_create(&consumers[i], NULL, test_handoff_consumer, &info[i]);
+  }
+  producer_info = (struct test_handoff_arg) {.queue = &queue};
+  for(i = 0; i < TEST_PRODUCERS; i++){
+    pthread_create(&producers[i], NULL, test_handoff_producer, &producer_info);
+  }
+
+  for(i = 0; i < TEST_PRODUCERS; i++) pthread_join(producers[i], NULL);
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  for(i = 0; i < TEST_CONSUMERS; i++){
+    pthread_join(consumers[i], NULL);
+    sum += info[i].sum;
+    count += info[i].count;
+  }
+
+  // Every value taken exactly once
+  long expected = (long) TEST_PRODUCERS * TEST_PER_PRODUCER *
+    (TEST_PER_PRODUCER + 1) / 2;
+  if(count == (long) TEST_PRODUCERS * TEST_PER_PRODUCER && sum == expected)
+    printf("PASSED TEST\n");
+  else printf("FAILED TEST: took %ld values, sum %ld\n", count, sum);
+
+  handoff_queue_free(&queue);
+}
@@ -0,0 +1,64 @@
+/******************************* handoff_queue.h *******************************
+ Description:
+  Bounded lock-free multi-producer multi-consumer queue of accepted client
+  sockets. The acceptor engine gives each worker thread one of these. The
+  acceptor pushes onto a worker's queue and idle workers steal from the
+  queues of busy ones.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef HANDOFF_QUEUE_H
+#define HANDOFF_QUEUE_H
+
+#define CACHE_LINE 64
+
+struct handoff_cell {
+  unsigned long seq; // which lap of the ring the cell is ready for
+  int fd;
+};
+
+struct handoff_queue {
+  // Written by the producers and the consumers, kept on separate lines
+  unsigned long tail __attribute__((aligned(CACHE_LINE)));
+  unsigned long head __attribute__((aligned(CACHE_LINE)));
+
+  struct handoff_cell *cells __attribute__((aligned(CACHE_LINE)));
+  unsigned long mask;  // size - 1
+  int notify_fd;       // eventfd the owning worker waits on
+
+  // Counters, only ever added to
+  unsigned long pushed, popped, stolen, full, max_depth;
+};
+
+
+/* Sets up a queue of size slots (rounded up to a power of 2) and the eventfd
+ * used to wake the worker which owns it.
+ * Return -1 on error, 1 on success */
+int handoff_queue_init(struct handoff_queue *queue, unsigned long size);
+
+// Frees the queue, closing any sockets still in it
+void handoff_queue_free(struct handoff_queue *queue);
+
+/* Adds fd to the back of the queue.
+ * Return -1 if the queue is full, 1 on success */
+int handoff_push(struct handoff_queue *queue, int fd);
+
+/* Takes the socket at the front of the queue. stealing is set when the
+ * caller is not the owner of the queue, it is only used for the counters.
+ * Return the socket or -1 if the queue is empty */
+int handoff_pop(struct handoff_queue *queue, int stealing);
+
+// Number of sockets waiting in the queue (approximate while it is in use)
+unsigned long handoff_depth(struct handoff_queue *queue);
+
+// Wakes the worker which owns the queue
+void handoff_notify(struct handoff_queue *queue);
+
+// Prints the counters of each queue, to see how evenly work is spread
+void handoff_print_stats(struct handoff_queue *queues, int num_queues);
+
+void handoff_queue_tests(void);
+
+#endif
@@ -0,0 +1,162 @@
+/******************************** header_bench.c ******************************
+ Description:
+  Compares the time taken to tag the fields of a http header by the byte at
+  a time parser (tag_header_bytewise()) and by tag_header() with each of the
+  block scanners the CPU has (see header_scan.h).
+
+  Usage: header_bench [iterations] [header file]
+
+  Without a file it uses a browser request of about 500 bytes and a request
+  of about 4kB carrying large cookies. A file is read up to MAX_HEADER_LENGTH
+  bytes and must hold a whole header.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "header_parser.h"
+#include "header_scan.h"
+
+#define DEF_BENCH_ITERATIONS 1000000
+
+char browser_request[] =
+  "GET http://dwl999.blogspot.com.au/search/label/Blog HTTP/1.1\r\n"
+  "Host: dwl999.blogspot.com.au\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:10.0.1) "
+  "Gecko/20100101 Firefox/10.0.1\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+  "*/*;q=0.8\r\n"
+  "Accept-Language: en-us,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\n"
+  "Referer: http://dwl999.blogspot.com.au/search/label/Bash\r\n"
+  "Cookie: blogger_TID=4bd1206bb13d9c17\r\n"
+  "\r\n";
+
+/**************************** Prototypes ********************************/
+int make_large_request(char *storage, int sizeof_storage);
+int read_header_file(char *path, char *storage, int sizeof_storage);
+void run_bench(char *name, char *header, int length, long iterations);
+long long now_ns(void);
+/***********************************************************************/
+
+
+int main(int argc, char *argv[])
+{
+  long iterations = DEF_BENCH_ITERATIONS;
+  char header[MAX_HEADER_LENGTH];
+  int length;
+
+  scan_select(NULL);
+
+  if(argc > 1) iterations = atol(argv[1]);
+  if(iterations <= 0){
+    printf("Usage: %s [iterations] [header file]\n", argv[0]);
+    return 1;
+  }
+
+  if(argc > 2){
+    length = read_header_file(argv[2], header, sizeof(header));
+    if(length <= 0) return 1;
+    run_bench(argv[2], header, length, iterations);
+    return 0;
+  }
+
+  run_bench("browser request", browser_request, sizeof(browser_request) - 1,
+            iterations);
+  length = make_large_request(header, sizeof(header));
+  run_bench("large request", header, length, iterations / 4);
+  return 0;
+} // End main
+
+
+
+/* Times tagging header iterations times with each parser and prints the
+ * time per header and the bytes tagged per second */
+void run_bench(char *name, char *header, int length, long iterations)
+{
+  char *scanners[] = {"bytewise", "scalar", "sse2", "avx2"};
+  struct http_header_info info;
+  int i, status = 0;
+
+  printf("%s: %d bytes\n", name, length);
+  for(i = 0; i < 4; i++){
+    if(i > 0 && scan_select(scanners[i]) < 0) continue;
+
+    long n;
+    long long start = now_ns();
+    for(n = 0; n < iterations; n++){
+      if(i > 0) status = parse_header(&info, header, length);
+      else{
+        info.read_storage = header;
+        info.end_data = header + length - 1;
+        status = tag_header_bytewise(&info);
+      }
+    }
+    long long elapsed = now_ns() - start;
+
+    if(status <= 0){
+      printf("ERROR the header could not be parsed (%d)\n", status);
+      return;
+    }
+    printf("  %-9s %8.1f ns/header  %8.1f MB/s  %d fields\n", scanners[i],
+           (double) elapsed / iterations,
+           ((double) status * iterations / (1024.0 * 1024.0)) /
+           (elapsed / 1e9), info.num_fields);
+  }
+  scan_select(NULL);
+} // End run_bench
+
+
+
+/* Fills storage with a request whose cookies take it to about 4kB.
+ * Return its length */
+int make_large_request(char *storage, int sizeof_storage)
+{
+  int length = snprintf(storage, sizeof_storage, "%.*s",
+                        (int) sizeof(browser_request) - 3, browser_request);
+  int i;
+
+  for(i = 0; i < 12 && length < sizeof_storage - 400; i++){
+    length += snprintf(storage + length, sizeof_storage - length,
+                       "Cookie: session%d=", i);
+    memset(storage + length, 'a' + i, 300);
+    length += 300;
+    length += snprintf(storage + length, sizeof_storage - length, "\r\n");
+  }
+  length += snprintf(storage + length, sizeof_storage - length, "\r\n");
+  return length;
+} // End make_large_request
+
+
+
+/* Reads a header from path into storage.
+ * Return the bytes read or -1 on error */
+int read_header_file(char *path, char *storage, int sizeof_storage)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0){
+    printf("ERROR could not open %s\n", path);
+    return -1;
+  }
+  int length = read(fd, storage, sizeof_storage);
+  close(fd);
+  if(length <= 0) printf("ERROR could not read %s\n", path);
+  return length;
+} // End read_header_file
+
+
+
+long long now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+} // End now_ns
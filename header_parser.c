@@ -12,14 +12,17 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 #include "defaults.h"
 #include "header_parser.h"
+#include "header_scan.h"
 #include "error_codes.h"
 
 //Testing
@@ -31,6 +34,7 @@
 
 /************************ Prototypes ***************************/
 int tag_header(struct http_header_info *http_header);
+int tag_header_bytewise(struct http_header_info *http_header);
 char* find_field_end(char *start_pos, char *end_pos );
 
 int get_field(struct http_header_info *http_header, 
@@ -38,6 +42,12 @@ int get_field(struct http_header_info *http_header,
 	      char *url_storage, 
 	      int sizeof_url_storage);
 
+void index_field(struct http_header_info *http_header, int field_num,
+		 char *colon);
+int find_field(struct http_header_info *http_header, char *field_name);
+int known_field(char *name, int name_len);
+unsigned int field_hash(char *name, int name_len);
+
 int get_field_content(char *content_start_pos,
 		      char *content_end_pos,
 		      char *content_storage,
@@ -55,6 +65,8 @@ char* find_non_whitespace(char *start, char *end);
 
 // Testing functions
 void test_tag_header(void);
+void test_scan_header(void);
+void test_resume_header(void);
 void test_find_field_end(void);
 void test_find_non_CRLF(void);
 void test_is_CRLF(void);
@@ -62,7 +74,12 @@ void test_find_non_whitespace(void);
 void test_get_field_content(void);
 void test_is_field(void);
 void test_get_field(void);
+void test_field_index(void);
 void test_get_content_length(void);
+void test_get_transfer_encoding(void);
+void test_get_status_code(void);
+void test_expects_continue(void);
+void test_get_connect_target(void);
 /***************************************************************/
 
 
@@ -89,6 +106,7 @@ int parse_header(struct http_header_info *http_header, char *received_data,
   assert(http_header != NULL);
   if(received_data == NULL || sizeof_RX_data <= 0) return -1;
 
+  reset_header(http_header);
   http_header->read_storage = received_data;
   http_header->end_data = http_header->read_storage + sizeof_RX_data -1;
 
@@ -97,6 +115,43 @@ int parse_header(struct http_header_info *http_header, char *received_data,
 
 
 
+/* The same as parse_header(), but if the last call was for a header starting
+   at received_data it carries on from where that one stopped, only looking
+   at what has been read in since. A whole header found by the last call is
+   returned again without looking at it.
+
+   The bytes given to the last call must not have changed. reset_header()
+   must be called before the storage is used for another header, and before
+   the first call if http_header was not zeroed.
+*/
+int resume_header(struct http_header_info *http_header, char *received_data,
+		  int sizeof_RX_data){
+  assert(http_header != NULL);
+  if(received_data == NULL || sizeof_RX_data <= 0) return -1;
+
+  char *end_data = received_data + sizeof_RX_data -1;
+  if(received_data != http_header->read_storage ||
+     http_header->scan_next == NULL || end_data < http_header->scan_next -1){
+    return parse_header(http_header, received_data, sizeof_RX_data);
+  }
+
+  http_header->end_data = end_data;
+  return tag_header(http_header);
+}
+
+
+
+// Forgets where the last parse got to, the next one starts again
+void reset_header(struct http_header_info *http_header){
+  http_header->scan_next = NULL;
+  http_header->scan_fields = 0;
+  http_header->scan_carry = 0;
+  http_header->scan_in_name = 0;
+  http_header->num_fields = 0;
+}
+
+
+
 /*Goes through the http header and finds the content stored in the 
   host header field. If url_storage is not large enough it will 
   return with an error -1
@@ -117,6 +172,66 @@ int get_host(struct http_header_info *http_header, char *url_storage,
 
 
 
+/* Checks whether the request line is "CONNECT host:port HTTP/1.x". If it
+   is the host (without the brackets of an IPv6 address) and the port are
+   stored.
+
+   Return 1 if it is a CONNECT and host and port were stored
+   0 if it is not a CONNECT
+   BAD_REQUEST if the CONNECT does not give a host and port
+   -1 if host or port storage is too small
+*/
+int get_connect_target(struct http_header_info *http_header,
+		       char *host_storage, int sizeof_host_storage,
+		       char *port_storage, int sizeof_port_storage){
+  assert(http_header != NULL);
+  if(http_header->num_fields <= 0) return 0;
+
+  char *method = "CONNECT ";
+  int method_len = strlen(method);
+  char *pos = http_header->header_fields[0];
+  char *line_end = http_header->header_end;
+
+  if(line_end - pos + 1 <= method_len) return 0;
+  if(strncmp(pos, method, method_len) != 0) return 0; // methods are case sensitive
+
+  // The authority runs up to the next space
+  char *start = find_non_whitespace(pos + method_len, line_end);
+  if(start == NULL) return BAD_REQUEST;
+  char *end = start;
+  while(end <= line_end && *end != ' ' && *end != '\r') end++;
+
+  // The port follows the last ':'
+  char *colon = end - 1;
+  while(colon > start && *colon != ':') colon--;
+  if(*colon != ':' || colon == end - 1) return BAD_REQUEST;
+
+  char *i;
+  for(i = colon + 1; i < end; i++){
+    if(!isdigit(*i)) return BAD_REQUEST;
+  }
+
+  char *host_start = start;
+  char *host_end = colon;
+  if(*host_start == '['){ // IPv6 address
+    if(*(host_end -1) != ']') return BAD_REQUEST;
+    host_start++;
+    host_end--;
+  }
+  if(host_end <= host_start) return BAD_REQUEST;
+
+  if(host_end - host_start >= sizeof_host_storage) return -1;
+  if(end - colon - 1 >= sizeof_port_storage) return -1;
+
+  memcpy(host_storage, host_start, host_end - host_start);
+  host_storage[host_end - host_start] = '\0';
+  memcpy(port_storage, colon + 1, end - colon - 1);
+  port_storage[end - colon - 1] = '\0';
+  return 1;
+}
+
+
+
 /* Finds gets the content-length field
    Return  Length of the body
      -1 if error has occurred */
@@ -147,6 +262,90 @@ int get_content_length(struct http_header_info *http_header){
 
 
 
+/* Finds how the Transfer-Encoding field (if any) frames the body. Only the
+   last coding matters, e.g. "gzip, chunked" is chunked (http spec 3.3.1).
+   Return TRANSFER_NONE, TRANSFER_CHUNKED or TRANSFER_OTHER */
+int get_transfer_encoding(struct http_header_info *http_header){
+  assert(http_header != NULL);
+  if(http_header->num_fields <= 0) return TRANSFER_NONE;
+
+  int field = http_header->known_fields[FIELD_TRANSFER_ENCODING];
+  if(field == 0) return TRANSFER_NONE;
+
+  char *value = http_header->field_colons[field] + 1;
+  char *end = (field == http_header->num_fields -1) ?
+    http_header->header_end : http_header->header_fields[field+1] -1;
+
+  // The last coding, going back over the CRLF and any white space
+  while(end >= value && isspace(*end)) end--;
+  char *coding = end;
+  while(coding >= value && *coding != ',' && !isspace(*coding)) coding--;
+  coding++;
+
+  if(end - coding + 1 == 7 && strncasecmp(coding, "chunked", 7) == 0)
+    return TRANSFER_CHUNKED;
+  return TRANSFER_OTHER;
+}
+
+
+
+/* Finds the status code of a response, whose first line is a status line
+   "HTTP/1.1 200 OK" (http spec 3.1.2) rather than a request line.
+   Return the status code, -1 if the first line is not a status line */
+int get_status_code(struct http_header_info *http_header){
+  assert(http_header != NULL);
+  if(http_header->num_fields <= 0) return -1;
+
+  char *line = http_header->header_fields[0];
+  char *end = (http_header->num_fields == 1) ?
+    http_header->header_end : http_header->header_fields[1] -1;
+
+  if(end - line + 1 < 12 || strncmp(line, "HTTP/", 5) != 0) return -1;
+
+  char *code = memchr(line, ' ', end - line + 1);
+  if(code == NULL || end - code < 3) return -1;
+  code++;
+  if(!isdigit(code[0]) || !isdigit(code[1]) || !isdigit(code[2]) ||
+     isdigit(code[3])) return -1;
+
+  return (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+}
+
+
+
+/* Return 1 if the request has "Expect: 100-continue" (http spec 5.1.1), so
+   the client waits for the server to answer the header before sending the
+   body, 0 if not */
+int expects_continue(struct http_header_info *http_header){
+  assert(http_header != NULL);
+  if(http_header->num_fields <= 0) return 0;
+
+  int field = http_header->known_fields[FIELD_EXPECT];
+  if(field == 0) return 0;
+
+  char *value = http_header->field_colons[field] + 1;
+  char *end = (field == http_header->num_fields -1) ?
+    http_header->header_end : http_header->header_fields[field+1] -1;
+
+  // Without the white space around it
+  while(value <= end && isspace(*value)) value++;
+  while(end >= value && isspace(*end)) end--;
+
+  return end - value + 1 == 12 && strncasecmp(value, "100-continue", 12) == 0;
+}
+
+
+
+// Return 1 if the header has the field, 0 if not
+int has_known_field(struct http_header_info *http_header,
+		    enum known_field field){
+  assert(http_header != NULL);
+  if(http_header->num_fields <= 0) return 0;
+  return http_header->known_fields[field] != 0;
+}
+
+
+
 /*Goes through the http header and finds the content stored in the 
   specifid header field. If url_storage is not large enough it will 
   return with an error -1
@@ -154,6 +353,9 @@ int get_content_length(struct http_header_info *http_header){
   Precondition: The Http header must be brought into memory beforehand
   using the produre parse_header()
 
+  The field is found with one probe of the index of the field names built
+  by tag_header(), not by comparing against every field.
+
   Return  0 if failed to find a field
   -1 if error occured
   positive integer indicates the size stored
@@ -173,36 +375,123 @@ int get_field(struct http_header_info *http_header,
   assert(http_header->header_end <= http_header->end_data);
   assert(http_header->read_storage <= http_header->header_end);
 
-  int i;
-  int field_status;
-  char *content_start_pos = NULL;
+  int field = find_field(http_header, field_name);
+  if(field == 0) return 0;  // Failed to find field 
+
   char *field_end_pos;
-  
-  /* skip the first field as this is the request field and does not
-     match the syntax of other header fields (see http spec)*/
-  for(i = 1; i < http_header->num_fields ; i++){
+  if(field == http_header->num_fields -1){
+    field_end_pos = http_header->header_end;
+  }
+  else{
+    field_end_pos = (http_header->header_fields[field+1]) -1;
+  }
 
-    if(i == http_header->num_fields -1){
-      field_end_pos = http_header->header_end;
-    }
-    else{
-      field_end_pos = (http_header->header_fields[i+1]) -1;
-    }
+  int size = get_field_content(http_header->field_colons[field] + 1,
+			       field_end_pos, url_storage, sizeof_url_storage);
+  if(size <= 0) return -1;
+  else return size;
+}
 
-    field_status = is_field(field_name, http_header->header_fields[i], 
-			    field_end_pos, &content_start_pos);
 
-    if(field_status == 1){
-      int size = get_field_content(content_start_pos, field_end_pos, 
-				   url_storage, sizeof_url_storage);
-      if(size <= 0){
-	return -1;
-      }
-      else return size;
+
+/* Adds the field field_num, whose name ends at colon, to the index of the
+   field names. Trailing spaces are not part of the name. A name which is
+   already indexed keeps its first field. */
+void index_field(struct http_header_info *http_header, int field_num,
+		 char *colon){
+  char *name = http_header->header_fields[field_num];
+  char *name_end = colon;
+  while(name_end > name && *(name_end -1) == ' ') name_end--;
+
+  int name_len = name_end - name;
+  if(name_len == 0) return;
+  http_header->field_name_lens[field_num] = name_len;
+
+  int known = known_field(name, name_len);
+  if(known >= 0){
+    if(http_header->known_fields[known] == 0){
+      http_header->known_fields[known] = field_num;
     }
-    if( field_status <= -1 ) return -1; 
+    return;
   }
-  return 0;  // Failed to find field 
+
+  unsigned int hash = field_hash(name, name_len);
+  unsigned int slot = hash & (FIELD_INDEX_SLOTS -1);
+  http_header->field_hashes[field_num] = hash;
+
+  while(http_header->field_index[slot] != 0){
+    int other = http_header->field_index[slot];
+    if(http_header->field_hashes[other] == hash &&
+       http_header->field_name_lens[other] == name_len &&
+       strncasecmp(http_header->header_fields[other], name, name_len) == 0)
+      return;
+    slot = (slot + 1) & (FIELD_INDEX_SLOTS -1);
+  }
+  http_header->field_index[slot] = field_num;
+}
+
+
+
+/* Looks field_name up in the index of the field names.
+   Return the number of the first field with that name, 0 if there is none */
+int find_field(struct http_header_info *http_header, char *field_name){
+  int name_len = strlen(field_name);
+
+  int known = known_field(field_name, name_len);
+  if(known >= 0) return http_header->known_fields[known];
+
+  unsigned int hash = field_hash(field_name, name_len);
+  unsigned int slot = hash & (FIELD_INDEX_SLOTS -1);
+  while(http_header->field_index[slot] != 0){
+    int field = http_header->field_index[slot];
+    if(http_header->field_hashes[field] == hash &&
+       http_header->field_name_lens[field] == name_len &&
+       strncasecmp(http_header->header_fields[field], field_name,
+		   name_len) == 0)
+      return field;
+    slot = (slot + 1) & (FIELD_INDEX_SLOTS -1);
+  }
+  return 0;
+}
+
+
+
+/* Return which of the known fields (see header_parser.h) name is, -1 if it
+   is none of them. They all have different lengths so only one is compared */
+int known_field(char *name, int name_len){
+  switch(name_len){
+  case 4:
+    if(strncasecmp(name, "Host", 4) == 0) return FIELD_HOST;
+    break;
+  case 6:
+    if(strncasecmp(name, "Expect", 6) == 0) return FIELD_EXPECT;
+    break;
+  case 10:
+    if(strncasecmp(name, "Connection", 10) == 0) return FIELD_CONNECTION;
+    break;
+  case 14:
+    if(strncasecmp(name, "Content-Length", 14) == 0)
+      return FIELD_CONTENT_LENGTH;
+    break;
+  case 17:
+    if(strncasecmp(name, "Transfer-Encoding", 17) == 0)
+      return FIELD_TRANSFER_ENCODING;
+    break;
+  }
+  return -1;
+}
+
+
+
+// FNV-1a hash of a field name, not case sensitive (http spec 4.2)
+unsigned int field_hash(char *name, int name_len){
+  unsigned int hash = 2166136261u;
+  int i;
+  for(i = 0; i < name_len; i++){
+    hash ^= tolower((unsigned char) name[i]);
+    hash *= 16777619u;
+  }
+  return hash;
 }
 
 
@@ -389,11 +678,22 @@ void print_header(struct http_header_info *http_header){
 
 /*
   Goes through and tags the http header at points where a new header field
-  starts
+  starts, and at the first colon of each field.
 
   It ignoring empty CRLF lines above request (http spec 4.1)
   Checks for continuing header fields HTTP specification - 4.2 
 
+  The header is scanned SCAN_BLOCK bytes at a time (see header_scan.h). A
+  CRLF is an LF whose mask bit lines up with a CR bit moved up by one, the
+  CR of the last byte of a block carrying over to the next, so the fields are
+  found from the masks without going back over the bytes.
+
+  It carries on from the scan state in http_header (see reset_header()), so
+  when the header is not complete it can be called again once more of it
+  has been read in and only looks at what is new. An LF whose next two bytes
+  have not been read in yet is looked at again. Once the whole header has
+  been found it is not looked at again.
+
   Return: The size of the header field
   Errors
   REQUEST_ENT_TOO_LARGE -  Too many headers, raise entity too large
@@ -403,6 +703,118 @@ void print_header(struct http_header_info *http_header){
   Raise a http 400 error (Bad Request)   
 */
 int tag_header(struct http_header_info *http_header){
+  assert(http_header != NULL);
+  char *end = http_header->end_data;
+  char padded[SCAN_BLOCK];
+  struct scan_masks masks;
+  unsigned long long carry = http_header->scan_carry;
+  int in_name = http_header->scan_in_name;
+  int i = http_header->scan_fields;
+
+  // Already found the whole header
+  if(http_header->scan_next != NULL && http_header->num_fields > 0){
+    return http_header->header_end - http_header->header_fields[0] + 1;
+  }
+
+  http_header->num_fields = 0;
+  if(http_header->scan_next == NULL){
+    http_header->scan_next = http_header->read_storage;
+  }
+  if(http_header->scan_next > end) return BAD_REQUEST; // nothing new
+
+  if(i == 0){
+    // Ignoring empty CRLF lines above request (http spec 4.1)
+    char *start = find_non_CRLF(http_header->scan_next, end);
+    if(start == NULL){
+      // Carry on from the first pair of bytes it did not look at
+      http_header->scan_next += 2 * ((end - http_header->scan_next) / 2);
+      return BAD_REQUEST;
+    }
+    http_header->header_fields[0] = start;
+    http_header->field_colons[0] = NULL;
+    memset(http_header->known_fields, 0, sizeof(http_header->known_fields));
+    memset(http_header->field_index, 0, sizeof(http_header->field_index));
+    http_header->scan_next = start;
+    carry = 0;
+    in_name = 1;
+    i = 1;
+  }
+
+  char *block;
+  for(block = http_header->scan_next; block <= end; block += SCAN_BLOCK){
+    if(end - block + 1 >= SCAN_BLOCK) scan_block(block, &masks);
+    else{
+      memset(padded, 0, SCAN_BLOCK);
+      memcpy(padded, block, end - block + 1);
+      scan_block(padded, &masks);
+    }
+
+    unsigned long long line_ends = masks.lf & ((masks.cr << 1) | carry);
+    unsigned long long marks = line_ends | masks.colon;
+    carry = masks.cr >> (SCAN_BLOCK - 1);
+
+    while(marks != 0){
+      int bit = __builtin_ctzll(marks);
+      char *pos = block + bit;
+      marks &= marks - 1;
+
+      if(!((line_ends >> bit) & 1)){ // a colon
+	if(in_name){
+	  http_header->field_colons[i-1] = pos;
+	  if(i > 1) index_field(http_header, i-1, pos);
+	}
+	in_name = 0;
+	continue;
+      }
+      in_name = 0;
+
+      // pos is the LF of a CRLF, check if there is any other header fields
+      if(pos + 1 >= end){
+	// Not read in yet, start from this LF next time
+	http_header->scan_next = pos;
+	http_header->scan_carry = 1;
+	http_header->scan_in_name = 0;
+	http_header->scan_fields = i;
+	return BAD_REQUEST;
+      }
+      if(*(pos+1) == '\r' && *(pos+2) == '\n'){
+	// header_end now points to the LF of the second CRLF
+	http_header->header_end = pos + 2;
+	http_header->num_fields = i;
+	http_header->scan_fields = i;
+	http_header->scan_next = pos + 3;
+	return http_header->header_end - http_header->header_fields[0] + 1;
+      }
+
+      // Check for continuing header fields HTTP specification - 4.2 
+      if(*(pos+1) != ' '){
+	//Reach the maximum number of fields - Raise "Entity too large"
+	if(i + 1 >= MAX_NUM_FIELDS){
+	  reset_header(http_header);
+	  return REQUEST_ENT_TOO_LARGE;
+	}
+	http_header->header_fields[i] = pos + 1;
+	http_header->field_colons[i] = NULL;
+	in_name = 1;
+	i++;
+      }
+    }
+  }
+
+  // no double CRLF at the end yet
+  http_header->scan_next = end + 1;
+  http_header->scan_carry = (*end == '\r');
+  http_header->scan_in_name = in_name;
+  http_header->scan_fields = i;
+  return BAD_REQUEST;
+}
+
+
+
+/* tag_header() as it was before the block scanner, looking at a byte at a
+   time. Kept for header_bench and to check the scanner against. Does not
+   tag the colons or index the names. */
+int tag_header_bytewise(struct http_header_info *http_header){
   assert(http_header != NULL);
   // Ignoring empty CRLF lines above request (http spec 4.1)
   http_header->header_fields[0] = find_non_CRLF(http_header->read_storage, 
@@ -413,7 +825,7 @@ int tag_header(struct http_header_info *http_header){
   }
   http_header->num_fields = 1;
   
-  char *end_field_pos = find_field_end(http_header->read_storage,
+  char *end_field_pos = find_field_end(http_header->header_fields[0],
 				       http_header->end_data);
     
   int i = http_header->num_fields;
@@ -562,6 +974,12 @@ void header_parser_tests(void){
   printf("\n\n Testing tag_header()");
   test_tag_header();
 
+  printf("\n\n*** Test tag_header() block scanners ***\n");
+  test_scan_header();
+
+  printf("\n\n*** Test parsing a header read in a piece at a time ***\n");
+  test_resume_header();
+
   printf("\n\n*** Test find_non_whitespace ***\n");
   test_find_non_whitespace();
 
@@ -574,11 +992,312 @@ void header_parser_tests(void){
   printf("\n\n*** Test get_field ***\n");
   test_get_field();
 
+  printf("\n\n*** Test the index of field names ***\n");
+  test_field_index();
+
   printf("\n\n*** Test get_content_length ***\n");
   test_get_content_length();
+
+  printf("\n\n*** Test get_transfer_encoding ***\n");
+  test_get_transfer_encoding();
+
+  printf("\n\n*** Test get_status_code ***\n");
+  test_get_status_code();
+
+  printf("\n\n*** Test expects_continue ***\n");
+  test_expects_continue();
+
+  printf("\n\n*** Test get_connect_target ***\n");
+  test_get_connect_target();
   
 }
 
+/* Every scanner tags the same fields as the byte at a time parser, for
+   headers made up of the characters it looks for, and finds the colons */
+void test_scan_header(void){
+  char *scanners[] = {"scalar", "sse2", "avx2"};
+  char *chars = "\r\n: aH";
+  char header[300];
+  struct http_header_info expect, got;
+  int s, n, i, ok = 1;
+
+  for(s = 0; s < 3; s++){
+    if(scan_select(scanners[s]) < 0){
+      printf("No %s on this CPU\n", scanners[s]);
+      continue;
+    }
+    srand(21);
+    for(n = 0; n < 20000 && ok; n++){
+      int len = 1 + rand() % sizeof(header);
+      for(i = 0; i < len; i++){
+	// Mostly whole lines so some headers are valid
+	if(rand() % 4 == 0 && i + 1 < len){
+	  header[i++] = '\r';
+	  header[i] = '\n';
+	}
+	else header[i] = chars[rand() % 7];
+      }
+      expect.read_storage = header;
+      expect.end_data = header + len - 1;
+      int expect_status = tag_header_bytewise(&expect);
+      int got_status = parse_header(&got, header, len);
+
+      if(got_status != expect_status ||
+	 (got_status > 0 && (got.num_fields != expect.num_fields ||
+			     got.header_end != expect.header_end ||
+			     memcmp(got.header_fields, expect.header_fields,
+				    got.num_fields * sizeof(char *)) != 0))){
+	printf("%s: header %d tagged differently\n", scanners[s], n);
+	ok = 0;
+      }
+    }
+
+    char request[] = "\r\nGET http://a.b:80/ HTTP/1.1\r\nHost : a.b\r\n"
+      "X-Long-Name-To-Cross-A-Block-Boundary-Here: 1\r\n cont: x\r\n"
+      "NoColon\r\n\r\n";
+    if(parse_header(&got, request, sizeof(request) - 1) !=
+       sizeof(request) - 3 || got.num_fields != 4 ||
+       got.field_colons[1] != strchr(got.header_fields[1], ':') ||
+       got.field_colons[2] != strchr(got.header_fields[2], ':') ||
+       got.field_colons[3] != NULL){
+      printf("%s: request tagged wrongly\n", scanners[s]);
+      ok = 0;
+    }
+  }
+  scan_select(NULL);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+/* Fields are found by name whatever their case, the first of two with the
+   same name wins, and a longer name starting with the one looked up (which
+   get_field() used to take as a malformed field) does not get in the way */
+void test_field_index(void){
+  char header[MAX_HEADER_LENGTH];
+  char storage[64], name[32];
+  struct http_header_info http_header;
+  int i, ok = 1;
+
+  int length = snprintf(header, sizeof(header),
+			"GET http://a.b/ HTTP/1.1\r\nHostname: wrong\r\n"
+			"host  : a.b\r\nHOST: second\r\n"
+			"Content-length: 42\r\nX-Empty:\r\n");
+  // Enough other fields to fill a good part of the index
+  for(i = 0; i < 200; i++){
+    length += snprintf(header + length, sizeof(header) - length,
+		       "X-Field-%d: %d\r\n", i, i);
+  }
+  length += snprintf(header + length, sizeof(header) - length, "\r\n");
+
+  if(parse_header(&http_header, header, length) != length) ok = 0;
+  if(get_host(&http_header, storage, sizeof(storage)) <= 0 ||
+     strcmp(storage, "a.b") != 0) ok = 0;
+  if(get_content_length(&http_header) != 42) ok = 0;
+  if(get_field(&http_header, "hostname", storage, sizeof(storage)) <= 0 ||
+     strcmp(storage, "wrong") != 0) ok = 0;
+  if(get_field(&http_header, "Transfer-Encoding", storage,
+	       sizeof(storage)) != 0) ok = 0;
+  if(get_field(&http_header, "X-Empty", storage, sizeof(storage)) != 1 ||
+     storage[0] != '\0') ok = 0;
+  if(get_field(&http_header, "X-Field-200", storage, sizeof(storage)) != 0)
+    ok = 0;
+
+  for(i = 0; i < 200 && ok; i++){
+    snprintf(name, sizeof(name), "x-FIELD-%d", i);
+    if(get_field(&http_header, name, storage, sizeof(storage)) <= 0 ||
+       atoi(storage) != i){
+      printf("%s not found\n", name);
+      ok = 0;
+    }
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+void test_get_transfer_encoding(void){
+  char *headers[] = {
+    "POST / HTTP/1.1\r\nHost: a.b\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+    "POST / HTTP/1.1\r\ntransfer-encoding:gzip, CHUNKED  \r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding:\r\n\r\n"
+  };
+  int expect[] = {TRANSFER_NONE, TRANSFER_CHUNKED, TRANSFER_CHUNKED,
+		  TRANSFER_OTHER, TRANSFER_OTHER, TRANSFER_OTHER};
+  struct http_header_info http_header;
+  int i, ok = 1;
+
+  for(i = 0; i < sizeof(expect) / sizeof(expect[0]); i++){
+    parse_header(&http_header, headers[i], strlen(headers[i]));
+    if(get_transfer_encoding(&http_header) != expect[i]){
+      printf("Wrong coding for header %d\n", i);
+      ok = 0;
+    }
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+void test_get_status_code(void){
+  char *headers[] = {
+    "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n",
+    "\r\nHTTP/1.0 404 Not Found\r\n\r\n",
+    "HTTP/1.1 204\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: a.b\r\n\r\n",
+    "HTTP/1.1 20 OK\r\n\r\n",
+    "HTTP/1.1 2000 OK\r\n\r\n"
+  };
+  int expect[] = {200, 404, 204, -1, -1, -1};
+  struct http_header_info http_header;
+  int i, ok = 1;
+
+  for(i = 0; i < sizeof(expect) / sizeof(expect[0]); i++){
+    parse_header(&http_header, headers[i], strlen(headers[i]));
+    if(get_status_code(&http_header) != expect[i]){
+      printf("Wrong status code for header %d\n", i);
+      ok = 0;
+    }
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+void test_expects_continue(void){
+  char *headers[] = {
+    "POST / HTTP/1.1\r\nExpect: 100-continue\r\nHost: a.b\r\n\r\n",
+    "POST / HTTP/1.1\r\nHost: a.b\r\nexpect:100-Continue  \r\n\r\n",
+    "POST / HTTP/1.1\r\nHost: a.b\r\n\r\n",
+    "POST / HTTP/1.1\r\nExpect: 100-continued\r\n\r\n",
+    "POST / HTTP/1.1\r\nExpect:\r\n\r\n"
+  };
+  int expect[] = {1, 1, 0, 0, 0};
+  struct http_header_info http_header;
+  int i, ok = 1;
+
+  for(i = 0; i < sizeof(expect) / sizeof(expect[0]); i++){
+    parse_header(&http_header, headers[i], strlen(headers[i]));
+    if(expects_continue(&http_header) != expect[i]){
+      printf("Wrong expectation for header %d\n", i);
+      ok = 0;
+    }
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+/* A header read in one byte at a time, or in random pieces, parses the same
+   as when it is read in whole, and one byte at a time costs about as much as
+   parsing it once rather than once per byte */
+void test_resume_header(void){
+  char header[MAX_HEADER_LENGTH];
+  char host[64];
+  struct http_header_info whole, pieces;
+  int i, n, ok = 1;
+
+  int length = snprintf(header, sizeof(header),
+			"\r\n\r\nGET http://a.b/ HTTP/1.1\r\nHost: a.b\r\n"
+			"X-Folded: one\r\n two\r\n");
+  // Long values, so the storage fills up before MAX_NUM_FIELDS is reached
+  for(i = 0; length < sizeof(header) - 100; i++){
+    length += snprintf(header + length, sizeof(header) - length,
+		       "X-Field-%d: %060d\r\n", i, i);
+  }
+  length += snprintf(header + length, sizeof(header) - length, "\r\n");
+  int expect = parse_header(&whole, header, length);
+  if(expect != length - 4) ok = 0;
+
+  srand(23);
+  for(n = 0; n < 20 && ok; n++){
+    int status = BAD_REQUEST, stored = 0;
+    reset_header(&pieces);
+    while(stored < length && ok){
+      stored += (n == 0) ? 1 : 1 + rand() % 200;
+      if(stored > length) stored = length;
+      status = resume_header(&pieces, header, stored);
+      if(stored < length && status != BAD_REQUEST) ok = 0;
+    }
+    if(status != expect || pieces.num_fields != whole.num_fields ||
+       memcmp(pieces.header_fields, whole.header_fields,
+	      whole.num_fields * sizeof(char *)) != 0 ||
+       memcmp(pieces.field_colons, whole.field_colons,
+	      whole.num_fields * sizeof(char *)) != 0 ||
+       get_host(&pieces, host, sizeof(host)) <= 0 || strcmp(host, "a.b") != 0)
+      ok = 0;
+  }
+  // Parsed again it is not looked at
+  if(resume_header(&pieces, header, length) != expect) ok = 0;
+
+  clock_t start = clock();
+  for(n = 0; n < 100; n++){
+    reset_header(&pieces);
+    for(i = 1; i <= length; i++) resume_header(&pieces, header, i);
+  }
+  clock_t resumed = clock();
+  for(n = 0; n < 100; n++){
+    for(i = length - 200; i <= length; i++) parse_header(&whole, header, i);
+  }
+  clock_t whole_parse = clock();
+  printf("%d byte header read a byte at a time: %ldus resuming, about "
+	 "%ldus parsing from the start each time\n", length,
+	 (long) ((resumed - start) * 10000 / CLOCKS_PER_SEC),
+	 (long) ((whole_parse - resumed) * 10000 / CLOCKS_PER_SEC) *
+	 length / 201);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+void test_get_connect_target(void){
+  struct http_header_info http_header;
+  char host[MAX_URL_SIZE], port[8];
+  int status;
+
+  char connect[] = "CONNECT www.example.com:443 HTTP/1.1\r\n"
+    "Host: www.example.com:443\r\n\r\n";
+  parse_header(&http_header, connect, sizeof(connect) -1);
+  status = get_connect_target(&http_header, host, sizeof(host),
+			      port, sizeof(port));
+  if(status == 1 && strcmp(host, "www.example.com") == 0 &&
+     strcmp(port, "443") == 0) printf("PASSED TEST\n");
+  else printf("FAILED expected www.example.com 443 got: %d\n", status);
+
+  char ipv6[] = "CONNECT [::1]:8443 HTTP/1.1\r\n\r\n";
+  parse_header(&http_header, ipv6, sizeof(ipv6) -1);
+  status = get_connect_target(&http_header, host, sizeof(host),
+			      port, sizeof(port));
+  if(status == 1 && strcmp(host, "::1") == 0 && strcmp(port, "8443") == 0)
+    printf("PASSED TEST\n");
+  else printf("FAILED expected ::1 8443 got: %d\n", status);
+
+  char get[] = "GET http://www.example.com/ HTTP/1.1\r\n"
+    "Host: www.example.com\r\n\r\n";
+  parse_header(&http_header, get, sizeof(get) -1);
+  status = get_connect_target(&http_header, host, sizeof(host),
+			      port, sizeof(port));
+  if(status == 0) printf("PASSED TEST\n");
+  else printf("FAILED expected 0 got: %d\n", status);
+
+  char no_port[] = "CONNECT www.example.com HTTP/1.1\r\n\r\n";
+  parse_header(&http_header, no_port, sizeof(no_port) -1);
+  status = get_connect_target(&http_header, host, sizeof(host),
+			      port, sizeof(port));
+  if(status == BAD_REQUEST) printf("PASSED TEST\n");
+  else printf("FAILED expected %d got: %d\n", BAD_REQUEST, status);
+}
+
+
 void test_get_content_length(void){
   char read_buffer[8012];
   int read_status;
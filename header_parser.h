@@ -11,14 +11,51 @@
 ***************************************************************************/
 
 
+#ifndef HEADER_PARSER_H
+#define HEADER_PARSER_H
+
 //If this is changed it needs to be a multiple of MAX_HEADER_LENGTH
 #include "defaults.h"
 
+// Fields looked up on every request, which have a slot of their own
+enum known_field {
+  FIELD_HOST,
+  FIELD_CONTENT_LENGTH,
+  FIELD_TRANSFER_ENCODING,
+  FIELD_CONNECTION,
+  FIELD_EXPECT,
+  NUM_KNOWN_FIELDS
+};
+
+// What get_transfer_encoding() found
+#define TRANSFER_NONE 0    // no Transfer-Encoding field
+#define TRANSFER_CHUNKED 1 // the last coding is chunked
+#define TRANSFER_OTHER 2   // there are codings but chunked is not the last
+
+// Slots of the index of field names, a power of 2 at least 2*MAX_NUM_FIELDS
+#define FIELD_INDEX_SLOTS 512
+
 struct http_header_info {
   char *read_storage;
   char *header_fields[MAX_NUM_FIELDS];
+  char *field_colons[MAX_NUM_FIELDS]; // first ':' of each field, or NULL
   char *header_end, *end_data ;
   int num_fields;
+
+  /* Index of the fields by name, built by tag_header(). Each entry is the
+     number of the first field with that name, 0 if there is none (field 0
+     is the request line). Names are hashed without case. */
+  unsigned char known_fields[NUM_KNOWN_FIELDS];
+  unsigned char field_index[FIELD_INDEX_SLOTS];
+  unsigned int field_hashes[MAX_NUM_FIELDS];
+  int field_name_lens[MAX_NUM_FIELDS];
+
+  /* Where the last parse got to, so resume_header() can carry on from there
+     when more of the header has been read in */
+  char *scan_next;   // next byte to look at, NULL to start again
+  int scan_fields;   // fields tagged so far, 0 before the request line
+  int scan_carry;    // the byte before scan_next is a CR
+  int scan_in_name;  // the last field tagged has not had a colon or CRLF
 }; 
 
 
@@ -44,6 +81,21 @@ struct http_header_info {
 int parse_header(struct http_header_info *http_header, char *received_data,
 					  int sizeof_RX_data);
 
+/* The same as parse_header(), but if the last call was for a header starting
+   at received_data it carries on from where that one stopped, only looking
+   at what has been read in since. A whole header found by the last call is
+   returned again without looking at it.
+
+   The bytes given to the last call must not have changed. reset_header()
+   must be called before the storage is used for another header, and before
+   the first call if http_header was not zeroed.
+*/
+int resume_header(struct http_header_info *http_header, char *received_data,
+		  int sizeof_RX_data);
+
+// Forgets where the last parse got to, the next one starts again
+void reset_header(struct http_header_info *http_header);
+
 
 
 /*** The following procedures must read in the header field using parse_header()
@@ -65,12 +117,55 @@ int get_host(struct http_header_info *http_header, char *url_storage,
 				 int sizeof_url_storage);
 
 
+/* Checks whether the request line is "CONNECT host:port HTTP/1.x". If it
+   is the host (without the brackets of an IPv6 address) and the port are
+   stored.
+
+   Return 1 if it is a CONNECT and host and port were stored
+   0 if it is not a CONNECT
+   BAD_REQUEST if the CONNECT does not give a host and port
+   -1 if host or port storage is too small
+*/
+int get_connect_target(struct http_header_info *http_header,
+		       char *host_storage, int sizeof_host_storage,
+		       char *port_storage, int sizeof_port_storage);
+
+
 /* Finds gets the content-length field
    Return  Length of the body
      -1 if error has occurred*/
 int get_content_length(struct http_header_info *http_header);
 
 
+/* Tags the header fields of a header already given to parse_header() again,
+   looking at a byte at a time instead of with the block scanner. This is the
+   parser from before header_scan.c, kept to compare against (header_bench).
+   It does not tag the colons or index the names, so the get_ procedures can
+   not be used after it.
+   Returns the same as parse_header() */
+int tag_header_bytewise(struct http_header_info *http_header);
+
+
+/* Finds how the Transfer-Encoding field (if any) frames the body. Only the
+   last coding matters, e.g. "gzip, chunked" is chunked (http spec 3.3.1).
+   Return TRANSFER_NONE, TRANSFER_CHUNKED or TRANSFER_OTHER */
+int get_transfer_encoding(struct http_header_info *http_header);
+
+/* Finds the status code of a response, whose first line is a status line
+   "HTTP/1.1 200 OK" (http spec 3.1.2) rather than a request line.
+   Return the status code, -1 if the first line is not a status line */
+int get_status_code(struct http_header_info *http_header);
+
+/* Return 1 if the request has "Expect: 100-continue" (http spec 5.1.1), so
+   the client waits for the server to answer the header before sending the
+   body, 0 if not */
+int expects_continue(struct http_header_info *http_header);
+
+// Return 1 if the header has the field, 0 if not
+int has_known_field(struct http_header_info *http_header,
+		    enum known_field field);
+
+
 /* Prints the header information */
 void print_header(struct http_header_info *http_header);
 
@@ -85,3 +180,4 @@ void print_range(char *start, char *end);
 // TEST FUNCTION HEADERS
 void header_parser_tests(void);
 
+#endif
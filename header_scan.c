@@ -0,0 +1,160 @@
+/******************************** header_scan.c *******************************
+ Description:
+  Block scanners for the CR, LF and ':' bytes of a http header. See
+  header_scan.h.
+
+  The vector scanners compare a whole register against each character and
+  take the top bit of every byte of the result with movemask, so a block
+  costs a few instructions per 16 or 32 bytes instead of three compares per
+  byte. Which one is used is decided at run time, the binary is built for
+  the baseline CPU and the AVX2 scanner alone is compiled for AVX2.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#include "header_scan.h"
+
+
+/**************************** Prototypes ********************************/
+void scan_block_scalar(const char *block, struct scan_masks *masks);
+#ifdef SCAN_X86
+void scan_block_sse2(const char *block, struct scan_masks *masks);
+void scan_block_avx2(const char *block, struct scan_masks *masks);
+#endif
+/***********************************************************************/
+
+/* Written only by scan_select(), which main() calls before any worker or
+ * thread starts, so every thread reads it without a lock */
+void (*scan_block)(const char *block, struct scan_masks *masks) =
+  scan_block_scalar;
+
+const char *scanner_name = "scalar";
+
+
+/* Makes scan_block use the scanner called name ("avx2", "sse2" or "scalar"),
+ * or the fastest the CPU has if name is NULL.
+ * Return -1 if the CPU does not have it, 1 on success */
+int scan_select(const char *name)
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if((name == NULL && __builtin_cpu_supports("avx2")) ||
+     (name != NULL && strcmp(name, "avx2") == 0)){
+    if(!__builtin_cpu_supports("avx2")) return -1;
+    scan_block = scan_block_avx2;
+    scanner_name = "avx2";
+    return 1;
+  }
+  if((name == NULL && __builtin_cpu_supports("sse2")) ||
+     (name != NULL && strcmp(name, "sse2") == 0)){
+    if(!__builtin_cpu_supports("sse2")) return -1;
+    scan_block = scan_block_sse2;
+    scanner_name = "sse2";
+    return 1;
+  }
+#endif
+  if(name != NULL && strcmp(name, "scalar") != 0) return -1;
+  scan_block = scan_block_scalar;
+  scanner_name = "scalar";
+  return 1;
+} // End scan_select
+
+
+
+// Name of the scanner in use
+const char *scan_name(void)
+{
+  return scanner_name;
+} // End scan_name
+
+
+
+void scan_block_scalar(const char *block, struct scan_masks *masks)
+{
+  const unsigned long long ones = 0x0101010101010101ULL;
+  const unsigned long long low7 = 0x7f7f7f7f7f7f7f7fULL;
+  unsigned long long cr = 0, lf = 0, colon = 0, word;
+  int i, j;
+
+  for(i = 0; i < SCAN_BLOCK; i += 8){
+    /* Looks at 8 bytes at once and only goes through them one by one if one
+     * of them is a CR, LF or colon. A byte of x_c is 0 where the byte of the
+     * word is c, and zeros has the top bit set of exactly those bytes. */
+    memcpy(&word, block + i, sizeof(word));
+    unsigned long long x_cr = word ^ ('\r' * ones);
+    unsigned long long x_lf = word ^ ('\n' * ones);
+    unsigned long long x_colon = word ^ (':' * ones);
+    unsigned long long zeros =
+      ~(((x_cr & low7) + low7) | x_cr | low7) |
+      ~(((x_lf & low7) + low7) | x_lf | low7) |
+      ~(((x_colon & low7) + low7) | x_colon | low7);
+    if(zeros == 0) continue;
+
+    for(j = i; j < i + 8; j++){
+      if(block[j] == '\r') cr |= 1ULL << j;
+      else if(block[j] == '\n') lf |= 1ULL << j;
+      else if(block[j] == ':') colon |= 1ULL << j;
+    }
+  }
+  masks -> cr = cr;
+  masks -> lf = lf;
+  masks -> colon = colon;
+} // End scan_block_scalar
+
+
+
+#ifdef SCAN_X86
+
+void scan_block_sse2(const char *block, struct scan_masks *masks)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i colon = _mm_set1_epi8(':');
+  int i;
+
+  masks -> cr = masks -> lf = masks -> colon = 0;
+  for(i = 0; i < SCAN_BLOCK; i += 16){
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (block + i));
+    masks -> cr |= (unsigned long long)
+      (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, cr)) << i;
+    masks -> lf |= (unsigned long long)
+      (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, lf)) << i;
+    masks -> colon |= (unsigned long long)
+      (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, colon)) << i;
+  }
+} // End scan_block_sse2
+
+
+
+__attribute__((target("avx2")))
+void scan_block_avx2(const char *block, struct scan_masks *masks)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i colon = _mm256_set1_epi8(':');
+
+  __m256i low = _mm256_loadu_si256((const __m256i *) block);
+  __m256i high = _mm256_loadu_si256((const __m256i *) (block + 32));
+
+#define SCAN_MASK(c) \
+  ((unsigned long long) (unsigned int) \
+   _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, c)) | \
+   (unsigned long long) (unsigned int) \
+   _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, c)) << 32)
+
+  masks -> cr = SCAN_MASK(cr);
+  masks -> lf = SCAN_MASK(lf);
+  masks -> colon = SCAN_MASK(colon);
+#undef SCAN_MASK
+} // End scan_block_avx2
+
+#endif
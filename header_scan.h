@@ -0,0 +1,39 @@
+/******************************** header_scan.h *******************************
+ Description:
+  Finds the CR, LF and ':' bytes of a http header a block at a time, for
+  tag_header() to build the index of header fields from in one pass. Each
+  block of SCAN_BLOCK bytes is turned into three bit masks, bit i set when
+  byte i of the block is that character.
+
+  The masks are made a byte at a time until scan_select() is called, once,
+  from main() (or tests.c) before any threads start. It then picks AVX2 (32
+  bytes per compare) or SSE2 (16 bytes) when the CPU has them.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef HEADER_SCAN_H
+#define HEADER_SCAN_H
+
+#define SCAN_BLOCK 64
+
+struct scan_masks {
+  unsigned long long cr, lf, colon;
+};
+
+/* Fills masks for the SCAN_BLOCK bytes from block. All of them must be
+ * readable, the last block of a header is copied into a padded one. The
+ * scalar scanner until scan_select() picks another. */
+extern void (*scan_block)(const char *block, struct scan_masks *masks);
+
+/* Makes scan_block use the scanner called name ("avx2", "sse2" or "scalar"),
+ * or the fastest the CPU has if name is NULL. Not thread safe, call it
+ * before starting any threads.
+ * Return -1 if the CPU does not have it, 1 on success */
+int scan_select(const char *name);
+
+// Name of the scanner in use
+const char *scan_name(void);
+
+#endif
@@ -12,47 +12,55 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "rate_lib.h"
 #include "defaults.h"
 
+int kernel_pacing = 0;
+
 /****************************************************************************/
-int time_compare(struct timeval *time1, struct timeval *time2);
+int entry_burst(struct config_token *entry, int bytes_per_sec);
+int entry_field(struct config_token *entry, int field);
+int ms_of_rate(int ms, int bytes_per_sec);
+void fill_bin(struct rate *rate_limit, long long now);
+long long bin_wait_ms(struct rate *rate_limit);
 
 // TESTING FUNCTIONS
-void test_suspend(void);
+void test_token_bucket(void);
+void test_kernel_pacing(void);
+void test_send_queue(void);
+void test_many_flows(void);
+void test_achieved_rate(void);
 /*****************************************************************************/
 
 
-/* Searches through the config options to determine the size of the outgoing
- * buffer used for rate limiting.
+/* Searches through the config options to determine the rate limit in kB/s
+ * of host_address: that of the longest [rates] domain it is in.
  */
 int get_rate_limit(struct config_sect * config_options, char * host_address){
-  char *section = "rates";
-
-  while (config_options) {
-    if (strcmp (section, config_options->name) == 0) {
-      //             printf("Looking at rates to limit domain\n");
-      struct config_token *tokens = config_options->tokens;
-      while (tokens) {
-	if(strstr( host_address, tokens->token) != NULL){
-	  //                     printf("Matched entry: %s\n", tokens->token);
-	  return atoi(tokens->value);
-	}
-	tokens = tokens->next;
-      }
-    }
-    config_options = config_options->next;
-  }
+  struct config_token *entry =
+    config_match_domain(config_options, "rates", host_address);
+
   //     printf("Domain not matched: %s\n", host_address);
-  return RATE_LIMIT;
+  if(entry == NULL) return RATE_LIMIT;
+  return atoi(entry->value);
 }// End get_rate_limit
 
 
+
 /* Simple function to convert form kB/s to B/ms
  * if rate = x kB/s then rate = x*1024/1000 B/ms = x*1.024 B/ms */
 int convertToBpInterval(int rate_limit){
@@ -62,127 +70,533 @@ int convertToBpInterval(int rate_limit){
 
 
 
-/* Suspends process if bin amount is empty and deadline has not been reached.
- * If the deadline has been passed then the bin_amount is reset to its maximum
- * value
- *
- * Return -1  error occurred in getting time
- *         1 successful completion
- */
-int suspend(struct rate *rate_limit){
+/* Returns the time from the monotonic clock in milliseconds. Used for
+ * timers which must not jump when the wall clock is changed. */
+long long monotonic_ms(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+} // End monotonic_ms
+
+
+
+/* Sets up a full bin for the [rates] entry which matches host_address: its
+ * rate and its burst, or RATE_BURST_MS of the rate if it gives none, and the
+ * send queue of the socket from the ms given after them (rate:burst:queue
+ * for TCP_NOTSENT_LOWAT and :sndbuf for SO_SNDBUF). */
+void rate_init(struct rate *rate_limit, struct config_sect *config_options,
+               char *host_address){
   assert(rate_limit != NULL);
 
-  struct timeval current_time, deadline, sleeptime;
-  // find the deadline
-  timeradd(&(rate_limit -> timestamp), &(rate_limit -> period), &deadline);
+  struct config_token *entry =
+    config_match_domain(config_options, "rates", host_address);
+
+  rate_limit -> bytes_per_sec =
+    convertToBpInterval((entry == NULL) ? RATE_LIMIT : atoi(entry -> value));
+  if(rate_limit -> bytes_per_sec <= 0) rate_limit -> bytes_per_sec = 1;
+
+  rate_limit -> bin_max_amount = entry_burst(entry, rate_limit -> bytes_per_sec);
+
+  rate_limit -> bin_amount = rate_limit -> bin_max_amount;
+  rate_limit -> refill_remainder = 0;
+  rate_limit -> timestamp = monotonic_ms();
+  rate_limit -> kernel_paced = 0;
 
-  if(gettimeofday(&current_time, NULL) < 0){
-    printf("getting clock information failed: %s", strerror(errno));
-    return -1;
+  int queue_ms = entry_field(entry, 2), sndbuf_ms = entry_field(entry, 3);
+  rate_limit -> notsent_lowat =
+    ms_of_rate((queue_ms > 0) ? queue_ms : RATE_QUEUE_MS,
+               rate_limit -> bytes_per_sec);
+  if(rate_limit -> notsent_lowat < RATE_MIN_SEND){
+    rate_limit -> notsent_lowat = RATE_MIN_SEND;
+  }
+  rate_limit -> sndbuf = ms_of_rate((sndbuf_ms > 0) ? sndbuf_ms : RATE_SNDBUF_MS,
+                                    rate_limit -> bytes_per_sec);
+  if(rate_limit -> sndbuf < 2 * rate_limit -> notsent_lowat){
+    rate_limit -> sndbuf = 2 * rate_limit -> notsent_lowat;
   }
 
-  // if have not reached deadline and bin_amount is 0 then reset bin_amount and
-  // suspend until reach timer
-  if(time_compare(&current_time, &deadline) <= 0  && rate_limit -> bin_amount <= 0){
-    timersub( &deadline, &current_time , &sleeptime);
-    printf("Going to sleep");
-    select(0,0,0,0,&sleeptime); // sleep until sleeptime has expired
-    rate_limit -> timestamp = deadline;
-    rate_limit -> bin_amount = rate_limit ->bin_max_amount;
+  rate_limit -> shared.tat = NULL;
+  struct config_token *shared =
+    config_match_domain(config_options, "shared_rates", host_address);
+  if(shared != NULL){
+    int bytes_per_sec = convertToBpInterval(atoi(shared -> value));
+    shared_budget_attach(&(rate_limit -> shared), shared -> token,
+                         bytes_per_sec, entry_burst(shared, bytes_per_sec));
   }
-  else if(time_compare(&current_time, &deadline) > 0){
-    rate_limit -> timestamp = current_time;
-    rate_limit -> bin_amount = rate_limit -> bin_max_amount;
+} // End rate_init
+
+
+
+/* Burst of entry in bytes: given after its rate as "rate:burst", otherwise
+ * (or without an entry) RATE_BURST_MS of bytes_per_sec */
+int entry_burst(struct config_token *entry, int bytes_per_sec){
+  int burst = entry_field(entry, 1);
+  if(burst > 0) return convertToBpInterval(burst);
+
+  return ms_of_rate(RATE_BURST_MS, bytes_per_sec);
+} // End entry_burst
+
+
+
+/* Returns field (counted from 0) of the ':' separated value of entry, or 0
+ * if there is no such field (or no entry) */
+int entry_field(struct config_token *entry, int field){
+  if(entry == NULL) return 0;
+
+  char *value = entry -> value;
+  while(field-- > 0){
+    value = strchr(value, ':');
+    if(value == NULL) return 0;
+    value++;
   }
+  return atoi(value);
+} // End entry_field
+
+
+
+// Bytes sent in ms at bytes_per_sec, at least 1
+int ms_of_rate(int ms, int bytes_per_sec){
+  long long bytes = (long long) bytes_per_sec * ms / 1000;
+  if(bytes > INT_MAX) return INT_MAX;
+  return (bytes < 1) ? 1 : bytes;
+} // End ms_of_rate
+
+
+
+/* Lets the kernel pace rate limited connections (use = 1), see
+ * rate_offload(). Set from the conf file at start up. */
+void rate_kernel_pacing(int use){
+  kernel_pacing = use;
+} // End rate_kernel_pacing
+
+
+
+/* Hands the connection's own rate to the kernel if kernel pacing is on:
+ * sock (the client socket) is given SO_MAX_PACING_RATE and the bin is no
+ * longer used, everything is sent as fast as the socket takes it. The shared
+ * budget, if there is one, is still paced here. The bin stays in use if the
+ * socket does not take the option.
+ *
+ * Return 1 if the kernel paces the connection, 0 otherwise
+ */
+int rate_offload(struct rate *rate_limit, int sock){
+  assert(rate_limit != NULL);
+
+  if(!kernel_pacing) return 0;
+
+  /* TCP spaces out the packets itself, with the fq qdisc if the interface
+   * has it or its own pacing timer if not. Other sockets take the option
+   * but do nothing with it */
+  int protocol = 0;
+  socklen_t protocol_len = sizeof(protocol);
+  if(getsockopt(sock, SOL_SOCKET, SO_PROTOCOL, &protocol, &protocol_len) < 0
+     || protocol != IPPROTO_TCP)
+    return 0;
+
+  // Some kernels (and sandboxes) take the option without keeping it
+  unsigned int pacing_rate = rate_limit -> bytes_per_sec, kept = 0;
+  socklen_t kept_len = sizeof(kept);
+  if(setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate,
+                sizeof(pacing_rate)) < 0 ||
+     getsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &kept, &kept_len) < 0
+     || kept != pacing_rate)
+    return 0;
+
+  rate_limit -> kernel_paced = 1;
   return 1;
+} // End rate_offload
+
+
+
+/* Keeps what the kernel queues on sock (the client socket) to a few ms of
+ * the rate, so the latency it adds is no more than the bin's. Without this
+ * the send buffer grows to megabytes and holds seconds of a slow flow. */
+void rate_limit_queue(struct rate *rate_limit, int sock){
+  assert(rate_limit != NULL);
+
+  /* Writes wait (and epoll holds back EPOLLOUT) while notsent_lowat is
+   * unsent. SO_SNDBUF also covers what is in flight, so it caps the rate at
+   * sndbuf / RTT, and the kernel limits it to net.core.wmem_max. Sockets
+   * which are not TCP do not take the first and are left as they are */
+  if(setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &(rate_limit -> notsent_lowat),
+                sizeof(rate_limit -> notsent_lowat)) < 0)
+    return;
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &(rate_limit -> sndbuf),
+             sizeof(rate_limit -> sndbuf));
+} // End rate_limit_queue
+
+
+
+/* Suspends process until there is enough in the bin to send, see
+ * rate_allowance(). Only for relay(), where each connection has a process
+ * of its own.
+ *
+ * Return the bytes of want which may be sent now
+ */
+int suspend(struct rate *rate_limit, int want){
+  assert(rate_limit != NULL);
+
+  long long now, next_send;
+  int amount;
+  while((amount = rate_allowance(rate_limit, want, now = monotonic_ms(),
+                                 &next_send)) == 0){
+    long long wait = next_send - now;
+    struct timeval sleeptime = {.tv_sec = wait / 1000,
+                                .tv_usec = (wait % 1000) * 1000};
+    select(0,0,0,0,&sleeptime); // sleep until sleeptime has expired
+  }
+  return amount;
 } // End suspend
 
 
 
-/*Update the bin given that an amount was sent */
+/* Asks the bin (and the shared budget) how much may be sent at now
+ * (monotonic ms) without waiting, filling it up to now. Never blocks, so an
+ * event loop can pace any number of flows by parking the ones told to wait
+ * on a timer for next_send. Whatever is sent must still be taken out with
+ * update_bin().
+ *
+ * Return: the bytes of want which may be sent now
+ *         0 if nothing may be sent yet, next_send is set to the monotonic ms
+ *           at which the bin will hold RATE_MIN_SEND (or the whole burst if
+ *           that is smaller)
+ */
+int rate_allowance(struct rate *rate_limit, int want, long long now,
+                   long long *next_send){
+  want = bin_allowance(rate_limit, want, now, next_send);
+
+  if(want > 0 && rate_limit -> shared.tat != NULL){
+    want = shared_budget_allowance(&(rate_limit -> shared), want, now,
+                                   next_send);
+  }
+  return want;
+} // End rate_allowance
+
+
+
+/* As rate_allowance() but for the connection's own bin only, leaving the
+ * shared budget to be asked separately (see fair_queue.h). */
+int bin_allowance(struct rate *rate_limit, int want, long long now,
+                  long long *next_send){
+  assert(rate_limit != NULL);
+  assert(next_send != NULL);
+
+  if(rate_limit -> kernel_paced){
+    *next_send = now;
+    return want;
+  }
+
+  fill_bin(rate_limit, now);
+
+  long long wait = bin_wait_ms(rate_limit);
+  if(wait > 0){
+    *next_send = now + wait;
+    return 0;
+  }
+  if(rate_limit -> bin_amount < want) want = rate_limit -> bin_amount;
+  *next_send = now;
+  return want;
+} // End bin_allowance
+
+
+
+/*Update the bin (and the shared budget) given that an amount was sent */
 void update_bin(int amount_sent, struct rate *rate_limit){
   assert(amount_sent >= 0);
   assert(rate_limit != NULL);
 
-  rate_limit -> bin_amount = rate_limit -> bin_amount - amount_sent;
+  if(!rate_limit -> kernel_paced){
+    rate_limit -> bin_amount = rate_limit -> bin_amount - amount_sent;
+  }
+  if(rate_limit -> shared.tat != NULL){
+    shared_budget_charge(&(rate_limit -> shared), amount_sent);
+  }
 } // End update_bin
 
 
 
-/*Compares two timeval structs
- * Returns:
- *      -1  time1 < time2
- *       0  time1 == time2
- *       1  time1 > time2
- */
-int time_compare(struct timeval *time1, struct timeval *time2){
-  // pre condition
-  assert((time1 -> tv_sec) >= 0);
-  assert((time1 -> tv_usec) >= 0);
-  assert((time2 -> tv_sec) >= 0);
-  assert((time2 -> tv_usec) >= 0);
+/* Adds what has dripped into the bin between the timestamp and now (ms).
+ * Fractions of a byte are kept for the next fill so none of the rate is
+ * lost to rounding. */
+void fill_bin(struct rate *rate_limit, long long now){
+  long long elapsed = now - rate_limit -> timestamp;
+  if(elapsed <= 0) return;
+  rate_limit -> timestamp = now;
 
-  if( (time1 -> tv_sec) > (time2 -> tv_sec) ) return 1;
-  else if ((time1 -> tv_sec) < (time2 -> tv_sec) ) return -1;
-  else{
-    if( (time1 -> tv_usec) > (time2 -> tv_usec) ) return 1;
-    else if ((time1 -> tv_sec) < (time2 -> tv_sec) ) return -1;
-    else return 0;
+  // Any longer and the bin is full anyway, this keeps the product in range
+  long long full_ms = (long long) rate_limit -> bin_max_amount * 1000 /
+    rate_limit -> bytes_per_sec + 1;
+  if(elapsed > full_ms) elapsed = full_ms;
+
+  long long added = elapsed * rate_limit -> bytes_per_sec +
+    rate_limit -> refill_remainder;
+  long long bin_amount = rate_limit -> bin_amount + added / 1000;
+
+  if(bin_amount >= rate_limit -> bin_max_amount){
+    rate_limit -> bin_amount = rate_limit -> bin_max_amount;
+    rate_limit -> refill_remainder = 0;
+  }
+  else {
+    rate_limit -> bin_amount = bin_amount;
+    rate_limit -> refill_remainder = added % 1000;
   }
-} // End time_compare
+} // End fill_bin
 
 
 
-void print_timeval(struct timeval *value){
-  printf("%ld sec %ld usec", value -> tv_sec, value -> tv_usec); 
-}
+/* Return 0 if the bin holds enough to send, otherwise the ms until it
+ * does */
+long long bin_wait_ms(struct rate *rate_limit){
+  int enough = RATE_MIN_SEND;
+  if(rate_limit -> bin_max_amount < enough) enough = rate_limit -> bin_max_amount;
+
+  long long needed = enough - rate_limit -> bin_amount;
+  if(needed <= 0) return 0;
+
+  // Each ms adds bytes_per_sec thousandths of a byte
+  long long needed_milli = needed * 1000 - rate_limit -> refill_remainder;
+  return (needed_milli + rate_limit -> bytes_per_sec - 1) /
+    rate_limit -> bytes_per_sec;
+} // End bin_wait_ms
+
 
 
 /******************************TEST FUNCTIONS **************************/
 void rate_lib_tests(void){
-  test_suspend();
 
+  printf("\n\n*** Test token bucket burst ***\n");
+  test_token_bucket();
+
+  printf("\n\n*** Test pacing many flows from one thread ***\n");
+  test_many_flows();
+
+  printf("\n\n*** Test achieved rate ***\n");
+  test_achieved_rate();
+
+  printf("\n\n*** Test kernel pacing offload ***\n");
+  test_kernel_pacing();
+
+  printf("\n\n*** Test send queue sized from the rate ***\n");
+  test_send_queue();
 }
 
 
-void test_suspend(void){
-  int amount, max_amount;
-  max_amount = 3;
-  amount = 0;
-
-  const struct timeval reader_timeout = {.tv_sec = 3, .tv_usec = 0};
-  struct timeval  exp_time;
-  struct rate rate_limit = {.period = reader_timeout, .bin_amount = amount,
-      .bin_max_amount = max_amount };
-
-  gettimeofday(&(rate_limit.timestamp), NULL);
-  timeradd(&(rate_limit.timestamp), &reader_timeout, &exp_time);
-  suspend(&rate_limit);
-  printf("\nExpect:"); print_timeval(&exp_time);
-  printf("\nGot: ");  print_timeval(&(rate_limit.timestamp));
-  printf("\nAmount(3):%d\n", amount);
-  
-
-
-  gettimeofday(&(rate_limit.timestamp), NULL);
-  exp_time = rate_limit.timestamp;
-  rate_limit.bin_amount = 2;
-  suspend(&rate_limit);
-  printf("\n\nExpect:"); print_timeval(&exp_time);
-  printf("\nGot: ");  print_timeval(&(rate_limit.timestamp));
-  printf("\nAmount(2):%d\n", amount);
-
-
-  gettimeofday(&rate_limit.timestamp, NULL);
-  amount = 2;
-
-  select(0,0,0,0,&((struct timeval) {.tv_sec = 4, .tv_usec = 0}));
-  gettimeofday(&exp_time, NULL); 
-  suspend(&rate_limit);
-  printf("\n\nExpect:"); print_timeval(&exp_time);
-  printf("\nGot: ");  print_timeval(&(rate_limit.timestamp));
-  printf("\nAmount(3):%d\n", amount);
-  
+/* Drives the bin with a made up clock: a flow sending as fast as the bin
+ * allows for 10 seconds gets the rate plus at most one burst, never more
+ * than a burst in any ms, and is never made to wait longer than needed */
+void test_token_bucket(void){
+  struct rate rate_limit = {.bytes_per_sec = 10240, .bin_max_amount = 2048,
+                            .bin_amount = 2048, .timestamp = 0};
+  long long now, sent = 0, sent_by_5s = 0;
+  int ok = 1;
+
+  for(now = 0; now < 10000; now++){
+    long long next_send;
+    if(now == 5000) sent_by_5s = sent;
+
+    int amount = rate_allowance(&rate_limit, INT_MAX, now, &next_send);
+    if(rate_limit.bin_amount > rate_limit.bin_max_amount) ok = 0;
+
+    if(amount == 0){
+      // The bin must then hold RATE_MIN_SEND, not before
+      struct rate later = rate_limit;
+      fill_bin(&later, next_send);
+      if(next_send <= now || later.bin_amount < RATE_MIN_SEND) ok = 0;
+      if(next_send > now + 1){
+        later = rate_limit;
+        fill_bin(&later, next_send - 1);
+        if(later.bin_amount >= RATE_MIN_SEND) ok = 0;
+      }
+      continue;
+    }
+
+    if(amount > rate_limit.bin_max_amount) ok = 0; // burst bound
+    update_bin(amount, &rate_limit);
+    sent += amount;
+  }
+
+  // Rate over the whole run: one burst up front plus 10s worth
+  long long expect = 10 * 10240;
+  if(sent > expect + 2048 || sent < expect - RATE_MIN_SEND) ok = 0;
+  // ...and over the second half, where the burst has long been spent
+  if(sent - sent_by_5s > 5 * 10240 + RATE_MIN_SEND ||
+     sent - sent_by_5s < 5 * 10240 - RATE_MIN_SEND) ok = 0;
+
+  printf("sent %lld bytes in 10s at %d B/s with a %d byte burst\n", sent,
+         rate_limit.bytes_per_sec, rate_limit.bin_max_amount);
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
 }
 
 
+/* Paces TEST_FLOWS flows at different rates the way an event loop does:
+ * the clock jumps to the earliest next_send, as if from the timer heap, and
+ * only the flows due then are asked. Each gets its own rate, and is woken
+ * no more often than it has RATE_MIN_SEND (or its burst) to send. */
+#define TEST_FLOWS 2000
+void test_many_flows(void){
+  static struct rate flows[TEST_FLOWS];
+  static long long wake[TEST_FLOWS], sent[TEST_FLOWS], wakeups[TEST_FLOWS];
+  long long now = 0;
+  int i, ok = 1;
+
+  for(i = 0; i < TEST_FLOWS; i++){
+    flows[i] = (struct rate) {.bytes_per_sec = 4096 * (1 + i % 8),
+                              .bin_max_amount = 1, .bin_amount = 0};
+    flows[i].bin_max_amount = flows[i].bytes_per_sec / 10;
+    wake[i] = 0;
+    sent[i] = wakeups[i] = 0;
+  }
+
+  while(now < 10000){
+    long long next = LLONG_MAX;
+    for(i = 0; i < TEST_FLOWS; i++){
+      if(wake[i] <= now){
+        wakeups[i]++;
+        int amount = rate_allowance(&(flows[i]), INT_MAX, now, &(wake[i]));
+        if(amount > 0){
+          update_bin(amount, &(flows[i]));
+          sent[i] += amount;
+          wake[i] = now + 1; // send as soon as the bin allows
+        }
+      }
+      if(wake[i] < next) next = wake[i];
+    }
+    now = next;
+  }
+
+  for(i = 0; i < TEST_FLOWS; i++){
+    long long expect = (long long) flows[i].bytes_per_sec * now / 1000;
+    if(sent[i] > expect || sent[i] < expect - 2 * RATE_MIN_SEND) ok = 0;
+    // One wake up to find the bin empty and one to send per send
+    int enough = RATE_MIN_SEND;
+    if(flows[i].bin_max_amount < enough) enough = flows[i].bin_max_amount;
+    if(wakeups[i] > 2 * (expect / enough + 2)) ok = 0;
+  }
+
+  printf("%d flows paced for %lldms, flow 0 sent %lld bytes in %lld wake ups\n",
+         TEST_FLOWS, now, sent[0], wakeups[0]);
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+// The same with the real clock and suspend(), for half a second
+void test_achieved_rate(void){
+  struct rate rate_limit;
+  long long sent = 0;
+
+  rate_init(&rate_limit, NULL, "example.com"); // RATE_LIMIT kB/s
+  update_bin(rate_limit.bin_amount, &rate_limit); // burst spent
+
+  long long start = monotonic_ms();
+  while(monotonic_ms() - start < 500){
+    int amount = suspend(&rate_limit, INT_MAX);
+    sent += amount;
+    update_bin(amount, &rate_limit);
+  }
+  long long elapsed = monotonic_ms() - start;
+  long long expect = (long long) rate_limit.bytes_per_sec * elapsed / 1000;
+
+  printf("sent %lld bytes in %lldms, expected %lld\n", sent, elapsed, expect);
+  if(sent <= expect + RATE_MIN_SEND && sent >= expect - 2 * RATE_MIN_SEND)
+    printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+/* A TCP socket takes the rate and the bin stops limiting, a socket which can
+ * not be paced (AF_UNIX) keeps the bin. Passes without checking the TCP
+ * socket if the kernel does not keep the rate */
+void test_kernel_pacing(void){
+  struct rate rate_limit;
+  long long next_send;
+  int unix_socks[2], ok = 1;
+
+  int tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(tcp_sock < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, unix_socks) < 0){
+    printf("FAILED TEST\n");
+    return;
+  }
+
+  rate_init(&rate_limit, NULL, "example.com");
+  if(rate_offload(&rate_limit, tcp_sock) != 0) ok = 0; // not turned on
+
+  rate_kernel_pacing(1);
+  if(rate_offload(&rate_limit, tcp_sock) == 1){
+    update_bin(10 * rate_limit.bin_max_amount, &rate_limit);
+    if(rate_allowance(&rate_limit, INT_MAX, monotonic_ms(), &next_send) !=
+       INT_MAX)
+      ok = 0;
+  }
+  else printf("SO_MAX_PACING_RATE is not kept by this kernel\n");
+
+  rate_init(&rate_limit, NULL, "example.com");
+  if(rate_offload(&rate_limit, unix_socks[0]) != 0) ok = 0;
+  update_bin(rate_limit.bin_max_amount, &rate_limit);
+  if(rate_allowance(&rate_limit, INT_MAX, monotonic_ms(), &next_send) != 0)
+    ok = 0;
+  rate_kernel_pacing(0);
+
+  close(tcp_sock);
+  close(unix_socks[0]);
+  close(unix_socks[1]);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+
+/* The send queue of a rule which gives it and of one which does not, and
+ * the socket options they set */
+void test_send_queue(void){
+  char conf_name[] = "/tmp/rate_lib_testXXXXXX";
+  struct rate rate_limit;
+  int value, ok = 1;
+  socklen_t value_len = sizeof(value);
+
+  int conf_fd = mkstemp(conf_name);
+  char *conf = "[rates]\nqueue.example 1000:16:5:100\nplain.example 1000\n";
+  if(conf_fd < 0 || write(conf_fd, conf, strlen(conf)) < 0){
+    printf("FAILED TEST\n");
+    return;
+  }
+  close(conf_fd);
+  struct config_sect *config_options = config_load(conf_name);
+  unlink(conf_name);
+
+  rate_init(&rate_limit, config_options, "www.queue.example");
+  if(rate_limit.bin_max_amount != 16 * 1024 ||
+     rate_limit.notsent_lowat != 1024000 * 5 / 1000 ||
+     rate_limit.sndbuf != 1024000 * 100 / 1000)
+    ok = 0;
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  rate_limit_queue(&rate_limit, sock);
+  if(getsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, &value_len) < 0
+     || value != rate_limit.notsent_lowat)
+    ok = 0;
+  value_len = sizeof(value);
+  // The kernel doubles it for its own overhead
+  if(getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &value, &value_len) < 0 ||
+     value < rate_limit.sndbuf)
+    ok = 0;
+  close(sock);
+
+  rate_init(&rate_limit, config_options, "plain.example");
+  if(rate_limit.notsent_lowat != 1024000 * RATE_QUEUE_MS / 1000 ||
+     rate_limit.sndbuf != 1024000 * RATE_SNDBUF_MS / 1000)
+    ok = 0;
+
+  // Too slow for RATE_QUEUE_MS to hold a segment
+  rate_init(&rate_limit, config_options, "other.example"); // RATE_LIMIT
+  if(rate_limit.notsent_lowat != RATE_MIN_SEND ||
+     rate_limit.sndbuf < 2 * RATE_MIN_SEND)
+    ok = 0;
+
+  config_destroy(config_options);
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
@@ -10,31 +10,96 @@
 
 ***************************************************************************/
 
+#ifndef RATE_LIB_H
+#define RATE_LIB_H
+
+#include <sys/time.h>
 #include "config.h"
+#include "shared_budget.h"
 
+/* Token bucket. The bin fills at bytes_per_sec, a little every ms, up to
+ * bin_max_amount (the burst size) and every byte sent is taken out of it.
+ * What is sent is also taken from the shared budget of the domain if it has
+ * one. */
 struct rate{
-  struct timeval timestamp, period;
+  long long timestamp;     // monotonic ms the bin was last filled up to
+  int bytes_per_sec;
+  int refill_remainder;    // thousandths of a byte filled but not in the bin
   int bin_amount, bin_max_amount;
+  int kernel_paced;        // the socket paces itself, see rate_offload()
+  int notsent_lowat;       // bytes the client socket may hold unsent
+  int sndbuf;              // and unsent and in flight, see rate_limit_queue()
+
+  struct shared_budget shared; // tat is NULL without a [shared_rates] rule
 };
 
 
-/* Suspends process if bin amount is empty and deadline has not been reached.
- * If the deadline has been passed then the bin_amount is reset to its maximum
- * value
+/* Sets up a full bin for the [rates] entry which matches host_address: its
+ * rate and its burst, or RATE_BURST_MS of the rate if it gives none, and the
+ * send queue of the socket from the ms given after them. Attaches the budget
+ * of the [shared_rates] entry which matches it, if there is one.
+ */
+void rate_init(struct rate *rate_limit, struct config_sect *config_options,
+               char *host_address);
+
+/* Lets the kernel pace rate limited connections (use = 1), see
+ * rate_offload(). Set from the conf file at start up. */
+void rate_kernel_pacing(int use);
+
+/* Hands the connection's own rate to the kernel if kernel pacing is on:
+ * sock (the client socket) is given SO_MAX_PACING_RATE and the bin is no
+ * longer used, everything is sent as fast as the socket takes it. The shared
+ * budget, if there is one, is still paced here. The bin stays in use if the
+ * socket does not take the option.
+ *
+ * Return 1 if the kernel paces the connection, 0 otherwise
+ */
+int rate_offload(struct rate *rate_limit, int sock);
+
+/* Keeps what the kernel queues on sock (the client socket) to a few ms of
+ * the rate, so the latency it adds is no more than the bin's. Without this
+ * the send buffer grows to megabytes and holds seconds of a slow flow. */
+void rate_limit_queue(struct rate *rate_limit, int sock);
+
+/* Suspends process until there is enough in the bin to send, see
+ * rate_allowance(). Only for relay(), where each connection has a process
+ * of its own.
  *
- * Return -1  error occurred in getting time
- *         1 successful completion
+ * Return the bytes of want which may be sent now
  */
-int suspend(struct rate *rate_limit);
+int suspend(struct rate *rate_limit, int want);
 
-/*Update the bin given that an amount was sent */
+/* Asks the bin (and the shared budget) how much may be sent at now
+ * (monotonic ms) without waiting, filling it up to now. Never blocks, so an
+ * event loop can pace any number of flows by parking the ones told to wait
+ * on a timer for next_send. Whatever is sent must still be taken out with
+ * update_bin().
+ *
+ * Return: the bytes of want which may be sent now
+ *         0 if nothing may be sent yet, next_send is set to the monotonic ms
+ *           at which the bin will hold RATE_MIN_SEND (or the whole burst if
+ *           that is smaller)
+ */
+int rate_allowance(struct rate *rate_limit, int want, long long now,
+                   long long *next_send);
+
+/* As rate_allowance() but for the connection's own bin only, leaving the
+ * shared budget to be asked separately (see fair_queue.h). */
+int bin_allowance(struct rate *rate_limit, int want, long long now,
+                  long long *next_send);
+
+/*Update the bin (and the shared budget) given that an amount was sent */
 void update_bin(int amount_sent, struct rate *rate_limit);
 
-/* Searches through the config options to determine the size of the outgoing
- * buffer used for rate limiting.
+/* Searches through the config options to determine the rate limit in kB/s
+ * of host_address: that of the longest [rates] domain it is in.
  */
 int get_rate_limit(struct config_sect * config_options, char * host_address);
 
+/* Returns the time from the monotonic clock in milliseconds. Used for
+ * timers which must not jump when the wall clock is changed. */
+long long monotonic_ms(void);
+
 /* Simple function to convert form kB/s to B/ms
  * if rate = x kB/s then rate = x*1024/1000 B/ms = x*1.024 B/ms */
 int convertToBpInterval(int rate_limit);
@@ -44,3 +109,4 @@ int convertToBpInterval(int rate_limit);
 /** TESTING functions **/
 void rate_lib_tests(void);
 
+#endif
@@ -9,12 +9,10 @@
  Date Modified:    $LastChangedDate: 2012-05-25 16:35:41 +1000 (Fri, 25 May 2012) $
  Last Modified by: $Author: u4395897 $
 
- BUGS:
- *  5 may 12: Fork code leaves defunct processes around.
-             Not sure how to clean these up
-
 ***************************************************************************/
 
+#define _GNU_SOURCE // splice()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,15 +24,24 @@
 #include <netdb.h>
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>  
 
+#include <linux/filter.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+
 #include <sys/time.h>
 
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "relay_comms.h"
 #include "header_parser.h"
+#include "admission.h"
+#include "buffer_pool.h"
 #include "error_codes.h"
 #include "defaults.h"
 
@@ -43,20 +50,37 @@
 struct timeval read_timeout =
   {.tv_sec = READ_TIMEOUT_SEC, .tv_usec = READ_TIMEOUT_USEC};
 
+// Unthrottled sends of at least this many bytes use MSG_ZEROCOPY, 0 is off
+int zerocopy_threshold = 0;
 
-struct header_data {
-  char header_storage[MAX_HEADER_LENGTH];
-  int amount_stored;
-  struct http_header_info info;
-};
+/* Buffers for data copied rather than spliced. A process relays with these
+ * functions from one thread only, so one pool serves the process. All zero
+ * is an empty pool. */
+struct buffer_pool relay_pool;
+
+char connect_failed_response[] =
+  "HTTP/1.1 502 Bad Gateway\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n\r\n";
 
 
 /**************************** Prototypes ********************************/
 
-int relay_response(int RX_socket, int TX_socket, struct rate *rate_limit);
+int relay_response(int RX_socket, int TX_socket, struct rate *rate_limit,
+                   struct splice_pipe *relay_pipe,
+                   struct response_tracker *responses,
+                   struct zerocopy_ring *zerocopy);
+
+int relay_request(int RX_socket, int *TX_socket, char *host_field, 
+                  struct header_data *request_header, struct rate *rate_limit,
+                  struct splice_pipe *relay_pipe,
+                  struct response_tracker *responses);
+
+void close_server(int server_socket, struct splice_pipe *relay_pipe,
+                  struct response_tracker *responses,
+                  struct zerocopy_ring *zerocopy);
 
-int relay_request(int RX_socket, int TX_socket, char *host_field, 
-                  struct header_data *request_header, struct rate *rate_limit);
+int wait_readable(int RX_socket, struct timeval *timeout);
 
 
 int time_limit_read(int RX_socket,  char *buffer, int buffer_size, 
@@ -69,20 +93,29 @@ int read_header(struct header_data *header, int reading_socket,
 		struct timeval *timeout);
 
 int send_msg(struct header_data *header, int msg_length, 
-             int read_socket, int send_socket, struct rate *rate_limit);
-
-int send_rate_limited(int TX_socket, char *message, int size_message, 
-                      struct rate *rate_limit);
+             int read_socket, int send_socket, struct rate *rate_limit,
+             struct splice_pipe *relay_pipe, struct chunk_tracker *chunks);
 
 int rate_limited_relay(int RX_sock, int TX_sock, int amount2relay,
-                       struct rate *rate_limit);
+                       struct rate *rate_limit, struct splice_pipe *relay_pipe);
 
+int chunked_relay(int RX_sock, int TX_sock, struct chunk_tracker *chunks,
+                  struct rate *rate_limit);
 
+int splice_relay(int RX_sock, int TX_sock, int amount,
+                 struct splice_pipe *relay_pipe, struct rate *rate_limit);
 
+int relay_tunnel(int client_socket, int server_socket,
+                 struct header_data *client_header, struct rate *rate_limit);
+
+void set_cork(int TX_socket, int cork);
+
+int reap_zerocopy(struct zerocopy_ring *zerocopy, unsigned int until);
 
-int max(int number1, int number2);
 
-void remove_message(struct header_data *header, char *message_end);
+
+
+int max(int number1, int number2);
 
 // Testing functions 
 //void test_read_in_header(void);
@@ -98,6 +131,8 @@ void test_send_msg(void);
  *
  * client_socket -> The socket connection between client and proxy
  * config_options -> The options from the parsed .conf file. See config.h
+ * ticket -> counted against the host once it is known. The caller gives it
+ *           back with admission_release()
  *
  * Return:
  *       1 Success
@@ -106,25 +141,35 @@ void test_send_msg(void);
  */
 int relay(int client_socket,
 		struct config_sect * config_options,
-		int rate_limiting)
+		int rate_limiting, struct admission_ticket *ticket)
 {
   assert(client_socket >= 0);
 
   int status;
   int server_socket;
   char host_field[MAX_URL_SIZE];
+  char connect_port[MAX_PORT_SIZE];
 
-  size_t client_msg_length;
+  int client_msg_length;
+  struct chunk_tracker chunks;
+  struct response_tracker responses;
+  struct zerocopy_ring zerocopy;
 
   fd_set readfds, masterfds; 
   int max_file_desc;
  
+  char request_storage[MAX_HEADER_LENGTH];
   struct header_data client_header;
+  client_header.header_storage = request_storage;
+  client_header.start = 0;
   client_header.amount_stored = 0;
   
   struct rate *rate_limit_ptr = NULL;
   // server to client timers
 
+  // Bodies and responses are spliced through this when it can be opened
+  struct splice_pipe relay_pipe;
+
 
   // Read in first header - keep reading until get a valid header field
   do { 
@@ -132,44 +177,67 @@ int relay(int client_socket,
     if(status <= 0 && status != BAD_REQUEST) return status;
   }while(status == BAD_REQUEST);
 
-  // Get the host name 
-  status = get_host(&(client_header.info), host_field, sizeof(host_field));
+  // A CONNECT gives the host and port on the request line
+  status = take_connect(&client_header, host_field, sizeof(host_field),
+                        connect_port, sizeof(connect_port));
+  if(status < 0) return status;
+  if(status == 0){
+    connect_port[0] = '\0';
+
+    // Get the host name 
+    status = get_host(&(client_header.info), host_field, sizeof(host_field));
+    if(status < 0) return status; // invalid host field
+  }
   printf("Host: %s\n", host_field);
-  if(status < 0) return status; // invalid host field
 
+  if(admit_host(host_field, ticket) < 0){
+    send_overloaded(client_socket);
+    return SERVICE_UNAVAILABLE;
+  }
 
-  // Get the rate limit from .conf file
-  struct rate rate_limit = { .period = {.tv_sec = 1, .tv_usec = 0}};
-  rate_limit.bin_max_amount =
-      convertToBpInterval(get_rate_limit(config_options, host_field));
-  rate_limit.bin_amount = rate_limit.bin_max_amount;
-  
 
-  if(gettimeofday(&(rate_limit.timestamp), NULL) <= -1){  // Fix this
-      printf("ERROR getting time");
-      return -1;
-    }
+  // Get the rate limit from .conf file
+  struct rate rate_limit;
+  rate_init(&rate_limit, config_options, host_field);
 
   // Check whether we are implementing rate limiting
   if(rate_limiting){
     rate_limit_ptr= &rate_limit;
+    rate_offload(&rate_limit, client_socket);
+    rate_limit_queue(&rate_limit, client_socket);
   }
   
-//  printf("Rate limiting %s to %dB/s\n", host_field, rate_limit.bin_max_amount );
+//  printf("Rate limiting %s to %dB/s\n", host_field, rate_limit.bytes_per_sec );
+
+  if(connect_port[0] != '\0'){
+    server_socket = setup_socket(connect_port, host_field, 0);
+    if(server_socket < 0){
+      send_connect_failed(client_socket);
+      return BAD_GATEWAY;
+    }
+    return relay_tunnel(client_socket, server_socket, &client_header,
+                        rate_limit_ptr);
+  }
     
-  // Get the content length of the body
-  client_msg_length = get_content_length(&(client_header.info));
-  if(client_msg_length < 0) return client_msg_length; 
+  // Find where the body ends
+  int chunked = request_framing(&(client_header.info), &client_msg_length);
+  if(chunked < 0) return chunked;
+  chunk_start(&chunks);
 
   // Set up server socket
-  server_socket = setup_socket(SERVER_PORT, host_field);
+  server_socket = setup_socket(SERVER_PORT, host_field, 0);
   if(server_socket < 0) return server_socket;
+  splice_pipe_open(&relay_pipe);
+  response_init(&responses, &relay_pool);
+  zerocopy_open(&zerocopy, client_socket);
 //   printf("Setup server socket\n");
 
+  response_expect(&responses, STORED_DATA(&client_header));
   status = send_msg(&client_header, client_msg_length, 
-		    client_socket, server_socket, NULL);
+		    client_socket, server_socket, NULL, &relay_pipe,
+		    chunked ? &chunks : NULL);
   if(status < 0){
-    close(server_socket);
+    close_server(server_socket, &relay_pipe, &responses, &zerocopy);
     return status;
   }
 
@@ -185,43 +253,66 @@ int relay(int client_socket,
     FD_ZERO(&readfds);
     memcpy(&readfds, &masterfds, sizeof(readfds));
 
+    /* A pipelined request already read in whole is sent on without waiting
+     * for the client, checking the server without blocking on it */
+    struct timeval no_wait = {0, 0};
+    int pending = client_header.amount_stored > 0 &&
+      resume_header(&(client_header.info), STORED_DATA(&client_header),
+                    client_header.amount_stored) > 0;
+
     // Find a socket which is not blocked 
-    if(select(max_file_desc+1, &readfds, NULL, NULL, &read_timeout) == -1)
+    if(select(max_file_desc+1, &readfds, NULL, NULL,
+              pending ? &no_wait : &read_timeout) == -1)
       {     
 	printf("\nError occured in select: %s", strerror(errno));
-	close(server_socket);
+	close_server(server_socket, &relay_pipe, &responses, &zerocopy);
 	return -1;
       }
+    if(pending) FD_SET(client_socket, &readfds);
     
     // Relay CLIENT -> SERVER
     if(FD_ISSET(client_socket, &readfds)){
       // Do not rate limit from client to server
-      status = relay_request(client_socket, server_socket, host_field, 
-			     &client_header, NULL);
+      int old_server = server_socket;
+      status = relay_request(client_socket, &server_socket, host_field, 
+			     &client_header, NULL, &relay_pipe, &responses);
+      if(server_socket != old_server && server_socket >= 0){
+	FD_SET(server_socket, &masterfds);
+	max_file_desc = max(server_socket, client_socket);
+      }
 
       // if the read connection is closed exit
       if(status == 0) {
-	close(server_socket);
+	close_server(server_socket, &relay_pipe, &responses, &zerocopy);
 	return 1;
       }
       else if(status == BAD_REQUEST) continue; // Yet to find header - try again
       else if(status < 0){
-	close(server_socket);
+	close_server(server_socket, &relay_pipe, &responses, &zerocopy);
 	return status;
       }
     }
 
     // Relay SERVER -> CLIENT
-    if(FD_ISSET(server_socket, &readfds)){
-      status = relay_response(server_socket, client_socket, rate_limit_ptr);
+    if(server_socket >= 0 && FD_ISSET(server_socket, &readfds)){
+      status = relay_response(server_socket, client_socket, rate_limit_ptr,
+                              &relay_pipe, &responses, &zerocopy);
 //    	status = relay_response(server_socket, client_socket, &rate_limit);
 
-      if(status == 0) {
+      /* The server closed with every request answered, keep the client and
+       * connect again for its next request */
+      if(status == 0 && response_server_closed(&responses)){
+	FD_CLR(server_socket, &masterfds);
 	close(server_socket);
+	server_socket = -1;
+	continue;
+      }
+      if(status == 0) {
+	close_server(server_socket, &relay_pipe, &responses, &zerocopy);
 	return 1; // if the read connection is closed exit
       }
       else if(status < 0){
-	close(server_socket);
+	close_server(server_socket, &relay_pipe, &responses, &zerocopy);
 	return status;
       }
     } 
@@ -230,37 +321,130 @@ int relay(int client_socket,
 
 
 
+/* Relays a CONNECT tunnel. The client is told the tunnel is open, anything it
+ * sent after the CONNECT goes to the server, then bytes are moved both ways
+ * without being looked at until either side closes or the tunnel is idle for
+ * the read timeout. The host's rate limit applies to SERVER -> CLIENT.
+ *
+ * Closes server_socket.
+ *
+ * Return:
+ *      1 Success
+ *     <=-1 if error occurred
+ */
+int relay_tunnel(int client_socket, int server_socket,
+                 struct header_data *client_header, struct rate *rate_limit)
+{
+  int status;
+  struct splice_pipe relay_pipe;
+  struct zerocopy_ring zerocopy;
+  fd_set readfds;
+  struct timeval timeout;
+
+  status = send_rate_limited(client_socket, CONNECT_ESTABLISHED,
+                             strlen(CONNECT_ESTABLISHED), NULL);
+  if(status > 0 && client_header -> amount_stored > 0){
+    status = send_rate_limited(server_socket, STORED_DATA(client_header),
+                               client_header -> amount_stored, NULL);
+  }
+  if(status <= 0){
+    close(server_socket);
+    return (status < 0) ? status : 1;
+  }
+
+  splice_pipe_open(&relay_pipe);
+  zerocopy_open(&zerocopy, client_socket);
+  int max_file_desc = max(server_socket, client_socket);
+
+  while(1){
+    FD_ZERO(&readfds);
+    FD_SET(server_socket, &readfds);
+    FD_SET(client_socket, &readfds);
+
+    timeout = read_timeout;
+    status = select(max_file_desc + 1, &readfds, NULL, NULL, &timeout);
+    if(status < 0){
+      if(errno == EINTR) continue;
+      printf("\nError occured in select: %s", strerror(errno));
+      break;
+    }
+    if(status == 0) break; // idle
+
+    // relay_response() only moves bytes, so it serves both directions
+    if(FD_ISSET(client_socket, &readfds)){
+      status = relay_response(client_socket, server_socket, NULL, &relay_pipe,
+                              NULL, NULL);
+      if(status <= 0) break;
+    }
+    if(FD_ISSET(server_socket, &readfds)){
+      status = relay_response(server_socket, client_socket, rate_limit,
+                              &relay_pipe, NULL, &zerocopy);
+      if(status <= 0) break;
+    }
+  }
+
+  close_server(server_socket, &relay_pipe, NULL, &zerocopy);
+  return (status < 0) ? status : 1;
+} // End relay_tunnel
+
+
+
 /* Relays the request header and the body (if it exists) to the server.
  * No rate rate limiting is applied for the client request
  *
+ * TX_socket -> if -1 (the server closed after answering every request) a new
+ *              connection to host_field is opened for the request
+ * responses -> told of the request, see response_expect()
+ *
  * Return:
  *      1 Success
  *      0 if connection either RX_socket or TX_socket have been closed
  *      <=0 if error occurred (see error_codes.h if <= -400)
  */
-int relay_request(int RX_socket, int TX_socket, char *host_field, 
-		  struct header_data *request_header, struct rate *rate_limit){
+int relay_request(int RX_socket, int *TX_socket, char *host_field, 
+		  struct header_data *request_header, struct rate *rate_limit,
+		  struct splice_pipe *relay_pipe,
+		  struct response_tracker *responses){
 
   assert(host_field != NULL);
   assert(request_header != NULL);
-  assert(RX_socket >= 0 && TX_socket >= 0);
+  assert(RX_socket >= 0);
  
   char requested_host[MAX_URL_SIZE];
 
-  int status = read_header(request_header, RX_socket, NULL);  
+  // Only read if a whole request is not already stored
+  int status = BAD_REQUEST;
+  if(request_header -> amount_stored > 0){
+    status = resume_header(&(request_header -> info),
+                           STORED_DATA(request_header),
+                           request_header -> amount_stored);
+  }
+  if(status == BAD_REQUEST) status = read_header(request_header, RX_socket, NULL);  
   if(status <= 0) return status;
 
-  status = get_host(&(request_header -> info), requested_host, sizeof(host_field));
+  status = get_host(&(request_header -> info), requested_host,
+		    sizeof(requested_host));
   if(status < 0) return status; // invalid host field
 
   // if the host field is different 
   if(strcmp(host_field, requested_host) != 0) return -1; // close the connection
     
-  int client_msg_length = get_content_length(&(request_header -> info));
-  if(client_msg_length < 0) return client_msg_length; 
+  // Not BAD_REQUEST, that is taken as the header not being complete
+  int client_msg_length;
+  int chunked = request_framing(&(request_header -> info), &client_msg_length);
+  if(chunked < 0) return -1;
+
+  if(*TX_socket < 0){
+    *TX_socket = setup_socket(SERVER_PORT, host_field, 0);
+    if(*TX_socket < 0) return -1;
+  }
 
+  struct chunk_tracker chunks;
+  chunk_start(&chunks);
+  response_expect(responses, STORED_DATA(request_header));
   status = send_msg(request_header, client_msg_length, 
-		    RX_socket, TX_socket, rate_limit);
+		    RX_socket, *TX_socket, rate_limit, relay_pipe,
+		    chunked ? &chunks : NULL);
   if(status <= 0) return status;
   return 1;
 } // End relay_request
@@ -270,24 +454,62 @@ int relay_request(int RX_socket, int TX_socket, char *host_field,
 /* Relays any information from the server back to the client
  * Applies rate limiting if bin_amount, init_time, max_amount and interval are
  * all set. Otherwise no rate limiting will be applied
+ *
+ * relay_pipe -> if open, body which responses does not need to look at is
+ *               spliced through it instead of being copied through a buffer
+ * responses -> follows where each response ends, NULL if what is relayed
+ *              is not http (a tunnel)
+ * zerocopy -> if open, unthrottled copies of at least the zero copy
+ *             threshold are sent from it with MSG_ZEROCOPY. May be NULL
  */
-int relay_response(int RX_socket, int TX_socket, struct rate *rate_limit){
+int relay_response(int RX_socket, int TX_socket, struct rate *rate_limit,
+                   struct splice_pipe *relay_pipe,
+                   struct response_tracker *responses,
+                   struct zerocopy_ring *zerocopy){
 
   int message_size = RELAY_BUF_SIZE;
  
-  if(rate_limit != NULL) message_size = rate_limit -> bin_max_amount;
+  if(rate_limit != NULL && !rate_limit -> kernel_paced){
+    message_size = rate_limit -> bin_max_amount;
+  }
 
-  char message[message_size];
-  memset(message, 0, message_size);
+  long skippable = LONG_MAX;
+  if(responses != NULL) skippable = response_skippable(responses);
+  if(relay_pipe != NULL && relay_pipe -> fds[0] >= 0 && skippable > 0){
+    if(message_size > RELAY_SPLICE_SIZE) message_size = RELAY_SPLICE_SIZE;
+    if(message_size > skippable) message_size = skippable;
+    int nsplice = splice_relay(RX_socket, TX_socket, message_size,
+                               relay_pipe, rate_limit);
+    if(nsplice > 0 && responses != NULL) response_skip(responses, nsplice);
+    return (nsplice > 0) ? 1 : nsplice;
+  }
 
-  int nread = read(RX_socket, message, message_size);
-  if (nread < 0){
-    printf("ERROR in reading:%s",strerror(errno)); 
-    return -1;
+  // Read more at a time so sends can reach the zero copy threshold
+  int use_zerocopy = (rate_limit == NULL && zerocopy != NULL &&
+                      zerocopy -> socket >= 0);
+  char *message;
+  if(use_zerocopy){
+    message_size = RELAY_SPLICE_SIZE;
+    message = zerocopy_buffer(zerocopy);
+  }
+  else {
+    if(message_size > BUF_CLASS_MAX) message_size = BUF_CLASS_MAX;
+    message = buffer_get(&relay_pool, message_size);
+  }
+  if(message == NULL) return -1;
+
+  int status = read(RX_socket, message, message_size);
+  if (status < 0) printf("ERROR in reading:%s",strerror(errno)); 
+  else if(status > 0){
+    if(responses != NULL) response_track(responses, message, status);
+    if(use_zerocopy && status >= zerocopy_threshold){
+      status = send_zerocopy(zerocopy, message, status);
+    }
+    else status = send_rate_limited(TX_socket, message, status, rate_limit);
   }
-  if(nread == 0) return 0;
 
-  return send_rate_limited(TX_socket, message, nread, rate_limit);
+  if(!use_zerocopy) buffer_put(&relay_pool, message, message_size);
+  return (status < 0) ? -1 : status;
 } // End relay_response
 
 
@@ -308,27 +530,43 @@ int time_limit_read(int RX_socket,  char *buffer, int buffer_size,
   assert(buffer_size > 0);
   assert(buffer != NULL);
   
-  if(timeout != NULL){
-    fd_set readfds;
-    FD_ZERO(&readfds); 
-    FD_SET(RX_socket, &readfds);
- 
-    if(select(RX_socket + 1, &readfds, NULL, 
-	      NULL, timeout) == -1)
-      {
-	printf("\nError occured in select: %s", strerror(errno));
-	return -1; 
-      }
-	
-    // if the header could not be read within timeout throw REQUEST_TIMEOUT error
-    if(FD_ISSET(RX_socket, &readfds) != 1) return REQUEST_TIMEOUT;
-  }
+  int status = wait_readable(RX_socket, timeout);
+  if(status <= 0) return status;
 
   return read(RX_socket, buffer, buffer_size);
 } // End time_limit_read
 
 
 
+/* Waits until RX_socket can be read from. If timeout is NULL it does not
+ * wait.
+ *
+ * Return 1 if the socket can be read from
+ *        REQUEST_TIMEOUT if it could not be read from within timeout
+ *        -1 select error
+ */
+int wait_readable(int RX_socket, struct timeval *timeout)
+{
+  if(timeout == NULL) return 1;
+
+  fd_set readfds;
+  FD_ZERO(&readfds); 
+  FD_SET(RX_socket, &readfds);
+ 
+  if(select(RX_socket + 1, &readfds, NULL, 
+            NULL, timeout) == -1)
+    {
+      printf("\nError occured in select: %s", strerror(errno));
+      return -1; 
+    }
+	
+  // if the header could not be read within timeout throw REQUEST_TIMEOUT error
+  if(FD_ISSET(RX_socket, &readfds) != 1) return REQUEST_TIMEOUT;
+  return 1;
+} // End wait_readable
+
+
+
 /* Read in the HTTP header.
  *
  * return REQUEST_ENT_TOO_LARGE if header is too large.
@@ -340,16 +578,12 @@ int time_limit_read(int RX_socket,  char *buffer, int buffer_size,
 */
 int read_in_header(struct header_data *header, int reading_socket, 
 		   struct timeval *timeout){
+  int read_in_amount = header_space(header);
+
   // if the header data is already full and has not found end of header
-  if(header -> amount_stored >= sizeof(header -> header_storage)){ 
-    return REQUEST_ENT_TOO_LARGE;
-  }
+  if(read_in_amount == 0) return REQUEST_ENT_TOO_LARGE;
 
-  int read_in_amount = 
-    sizeof(header -> header_storage) - (header -> amount_stored);
-  
-  char *read_location = 
-    (header -> header_storage) + (header -> amount_stored);
+  char *read_location = STORED_DATA(header) + (header -> amount_stored);
  
   int read_status = time_limit_read(reading_socket, read_location,
 				    read_in_amount, timeout);
@@ -383,9 +617,9 @@ int read_header(struct header_data *header, int reading_socket,
     read_in_header(header, reading_socket, timeout);	 
   if(read_status <= 0) return read_status;
 
-  parse_status = parse_header(&(header -> info), 
-			      header -> header_storage, 
-			      header -> amount_stored);
+  parse_status = resume_header(&(header -> info), 
+			       STORED_DATA(header), 
+			       header -> amount_stored);
   //}
 
   // check that the parsing was correct if not then return value
@@ -398,56 +632,104 @@ int read_header(struct header_data *header, int reading_socket,
 /* Send both header and body of the message. If the content-length is 0 or does
  * not exist then only the header will be sent. Can be rate-limited.
  *
+ * chunks -> if not NULL the body is chunked and msg_length is not used, the
+ *           tracker (started by the caller) finds where it ends
+ *
  * Return  1 on success
  *   0 if the send_socket was closed after sending.
- *   <=-1 an error occured sending or relaying message
+ *   <=-1 an error occured sending or relaying message, or the chunked body
+ *        is malformed
 */
 int send_msg(struct header_data *header, int msg_length, 
-	     int read_socket, int send_socket, struct rate *rate_limit)
+	     int read_socket, int send_socket, struct rate *rate_limit,
+	     struct splice_pipe *relay_pipe, struct chunk_tracker *chunks)
 {
 
   int header_length =
     header -> info.header_end - (header -> info.read_storage) + 1;
+
+  if(chunks != NULL){
+    // As much of the body as has been read in
+    long framed = chunk_frame(chunks, STORED_DATA(header) + header_length,
+                              header -> amount_stored - header_length);
+    if(framed < 0){
+      header -> amount_stored = 0;
+      return -1;
+    }
+    msg_length = framed;
+  }
   int amount2send = header_length + msg_length;
 
-  if(amount2send <= header -> amount_stored){
+  /* When some of the body is stored and more follows, what is stored is held
+   * back to go out with the rest instead of in a short segment of its own.
+   * Not for a header on its own, or one the server has to answer first
+   * (Expect: 100-continue). Rate limited sends are paced so not held. */
+  int cork = (rate_limit == NULL && header -> amount_stored > header_length &&
+              !expects_continue(&(header -> info)));
+
+  if(chunks != NULL && chunk_remaining(chunks) > 0){
+    // Everything stored is body, the rest is read in as its chunks allow
+    if(cork) set_cork(send_socket, 1);
+
+    int send_status = send_rate_limited(send_socket, STORED_DATA(header),
+                                        amount2send, rate_limit);
+    if(send_status <= 0) send_status = -1; // error in sending
+    else send_status = chunked_relay(read_socket, send_socket, chunks,
+                                     rate_limit);
+
+    if(cork) set_cork(send_socket, 0);
+
+    header -> amount_stored = 0;
+    if(send_status <= 0) return send_status;
+  }
+  else if(amount2send <= header -> amount_stored){
     // Send message
-    if( send_rate_limited(send_socket, header -> header_storage,
+    if( send_rate_limited(send_socket, STORED_DATA(header),
                           amount2send, rate_limit) < 0)
       {
 	header -> amount_stored = 0;
 	return -1; // error in sending
       }
 	
-    char *msg_end = header -> header_storage + amount2send-1;
+    char *msg_end = STORED_DATA(header) + amount2send-1;
     //remove old message
     remove_message(header, msg_end);
   }
   else{
+    if(cork) set_cork(send_socket, 1);
+
     //send Message
-    if(send_rate_limited(send_socket, header -> header_storage, 
-			 header -> amount_stored, rate_limit) <= 0)
-      {
-	header -> amount_stored = 0;
-	return -1; // error in sending
-      }
-	 
-    amount2send = amount2send - header -> amount_stored;
-	 
-    int send_status =
-        rate_limited_relay(read_socket, send_socket, amount2send, rate_limit);
-    if(send_status <= 0){
-      header -> amount_stored = 0;
-      return send_status; // error in sending
+    int send_status = send_rate_limited(send_socket, STORED_DATA(header),
+                                        header -> amount_stored, rate_limit);
+    if(send_status <= 0) send_status = -1; // error in sending
+    else {
+      amount2send = amount2send - header -> amount_stored;
+      send_status = rate_limited_relay(read_socket, send_socket, amount2send,
+                                       rate_limit, relay_pipe);
     }
+
+    // Sends whatever is still held back
+    if(cork) set_cork(send_socket, 0);
+
     // remove old message
     header -> amount_stored = 0;
+    if(send_status <= 0) return send_status; // error in sending
   }
   return 1;
 } // End send_msg
 
 
 
+/* Corks (cork = 1) or uncorks the TCP socket. While corked only full
+ * segments are sent, uncorking sends what is left. */
+void set_cork(int TX_socket, int cork)
+{
+  // Fails on sockets which are not TCP, they are sent as normal
+  setsockopt(TX_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+} // End set_cork
+
+
+
 /*Send at a limited rate 
   Return the amount of data that has been sent during this time interval
   as well as returning the start of the interval
@@ -465,24 +747,19 @@ int send_rate_limited(int TX_socket, char *message, int size_message,
   
   int rate_limited = 0; // is it rate limited
   if(rate_limit != NULL){
-      printf("Sending data rate limited to %dB/s\n", rate_limit -> bin_max_amount);
+      printf("Sending data rate limited to %dB/s\n", rate_limit -> bytes_per_sec);
       rate_limited = 1;
   }
 
   int nwrite = 0;
   int amount_written = 0;
   int amount2write = size_message ;
-  
+
   while(amount2write > 0){
     // Suspends if amount is empty
     if(rate_limited){
-      suspend(rate_limit);
-      if(rate_limit -> bin_amount < amount2write){
-        nwrite = write(TX_socket, message + amount_written, rate_limit -> bin_amount);
-      }
-      else{
-        nwrite = write(TX_socket, message + amount_written, amount2write);
-      }
+      nwrite = write(TX_socket, message + amount_written,
+                     suspend(rate_limit, amount2write));
       update_bin(nwrite, rate_limit);
     }
     else{
@@ -503,12 +780,170 @@ int send_rate_limited(int TX_socket, char *message, int size_message,
 
 
 
+/* Turns on SO_ZEROCOPY for TX_socket, if there is a threshold and the socket
+ * takes it. Otherwise zerocopy -> socket is -1 and sends are copied. */
+void zerocopy_open(struct zerocopy_ring *zerocopy, int TX_socket)
+{
+  int on = 1;
+
+  memset(zerocopy, 0, sizeof(*zerocopy));
+  zerocopy -> socket = -1;
+  if(zerocopy_threshold > 0 &&
+     setsockopt(TX_socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+    {
+      zerocopy -> socket = TX_socket;
+    }
+} // End zerocopy_open
+
+
+
+/* Waits for every send to complete and gives the buffers back. Must be called
+ * before the socket is closed, as the kernel may still be sending them. */
+void zerocopy_close(struct zerocopy_ring *zerocopy)
+{
+  int i;
+
+  if(zerocopy -> socket < 0) return;
+
+  // Buffers the kernel may still be reading are not put back in the pool
+  if(reap_zerocopy(zerocopy, zerocopy -> sent) > 0){
+    for(i = 0; i < ZEROCOPY_BUFS; i++){
+      if(zerocopy -> bufs[i] != NULL){
+        buffer_put(&relay_pool, zerocopy -> bufs[i], RELAY_SPLICE_SIZE);
+      }
+    }
+  }
+  zerocopy -> socket = -1;
+} // End zerocopy_close
+
+
+
+/* Return the buffer the next zero copy send goes from (RELAY_SPLICE_SIZE
+ * bytes), waiting only if the kernel is still sending from it. NULL on error
+ */
+char *zerocopy_buffer(struct zerocopy_ring *zerocopy)
+{
+  int next = zerocopy -> next;
+
+  if(zerocopy -> bufs[next] == NULL){
+    zerocopy -> bufs[next] = buffer_get(&relay_pool, RELAY_SPLICE_SIZE);
+  }
+  else if(reap_zerocopy(zerocopy, zerocopy -> done_at[next]) < 0){
+    return NULL;
+  }
+  return zerocopy -> bufs[next];
+} // End zerocopy_buffer
+
+
+
+/* Sends the whole message, which must be in zerocopy_buffer(), with
+ * MSG_ZEROCOPY. Does not wait for it to complete, the buffer is waited on
+ * when it next comes round.
+ *
+ * Return 1 on success, -1 error in sending
+ */
+int send_zerocopy(struct zerocopy_ring *zerocopy, char *message,
+                  int size_message)
+{
+  int amount_sent = 0;
+
+  while(amount_sent < size_message){
+    int nwrite = send(zerocopy -> socket, message + amount_sent,
+                      size_message - amount_sent, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if(nwrite < 0){
+      if(errno == EINTR) continue;
+      // Out of locked memory for pinning pages, copy the rest
+      if(errno == ENOBUFS) break;
+      printf("Error writing:%s", strerror(errno));
+      return -1;
+    }
+    amount_sent += nwrite;
+    zerocopy -> sent++;
+  }
+
+  if(amount_sent < size_message &&
+     write(zerocopy -> socket, message + amount_sent,
+           size_message - amount_sent) < size_message - amount_sent)
+    {
+      printf("Error writing:%s", strerror(errno));
+      return -1;
+    }
+
+  zerocopy -> done_at[zerocopy -> next] = zerocopy -> sent;
+  zerocopy -> next = (zerocopy -> next + 1) % ZEROCOPY_BUFS;
+
+  // Take in what has completed so far, so the error queue does not build up
+  return reap_zerocopy(zerocopy, zerocopy -> completed);
+} // End send_zerocopy
+
+
+
+/* Reads the completions off the socket's error queue, waiting until at least
+ * until of the sends have completed. The kernel may report several sends in
+ * one completion.
+ *
+ * Return 1 when they have completed, -1 on error or timeout
+ */
+int reap_zerocopy(struct zerocopy_ring *zerocopy, unsigned int until)
+{
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+
+  while(1){
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    // Reading the error queue never blocks
+    if(recvmsg(zerocopy -> socket, &msg, MSG_ERRQUEUE) < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        printf("ERROR reading zero copy completions: %s\n", strerror(errno));
+        return -1;
+      }
+      if((int) (until - zerocopy -> completed) <= 0) return 1;
+
+      // Error queue events are always reported, no need to ask for them
+      struct pollfd pfd = {.fd = zerocopy -> socket, .events = 0};
+      if(poll(&pfd, 1, READ_TIMEOUT_SEC * 1000) == 0){
+        printf("ERROR timed out waiting for zero copy completions\n");
+        return -1;
+      }
+      continue;
+    }
+
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+        struct sock_extended_err *err =
+          (struct sock_extended_err *) CMSG_DATA(cmsg);
+        if(err -> ee_errno != 0 || err -> ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+          continue;
+        }
+        // Sends ee_info to ee_data (inclusive) are done with
+        zerocopy -> completed += err -> ee_data - err -> ee_info + 1;
+      }
+  }
+} // End reap_zerocopy
+
+
+
+/* Sets the size at and above which unthrottled sends use MSG_ZEROCOPY. Below
+ * about 10KB pinning the pages costs more than copying them. 0 turns it off.
+ */
+void set_zerocopy_threshold(int threshold)
+{
+  zerocopy_threshold = (threshold > 0) ? threshold : 0;
+} // End set_zerocopy_threshold
+
+
+
 /* Relay an amount at a certain speed. If non of the rate limiting parameters
  * are given then no rate limiting will be applied.
  *
+ * relay_pipe -> if open the data is spliced through it instead of being
+ *               copied through a buffer
  */
 int rate_limited_relay(int RX_sock, int TX_sock, int amount2relay,
-		       struct rate *rate_limit)
+		       struct rate *rate_limit, struct splice_pipe *relay_pipe)
 {
   assert(amount2relay >= 0);
   assert(RX_sock >= 0);
@@ -521,50 +956,228 @@ int rate_limited_relay(int RX_sock, int TX_sock, int amount2relay,
   int nread = 0;
   int amount_read = 0;
   int message_size;
-  while(amount_read < amount2relay){
 
-    if(rate_limiting) message_size = rate_limit -> bin_amount;
-    else	message_size = RELAY_BUF_SIZE;
+  while(relay_pipe != NULL && relay_pipe -> fds[0] >= 0 &&
+        amount_read < amount2relay){
+    nread = wait_readable(RX_sock, &read_timeout);
+    if(nread == REQUEST_TIMEOUT) printf("ERROR Read timed out");
+    if(nread <= 0) return nread;
+
+    message_size = amount2relay - amount_read;
+    if(message_size > RELAY_SPLICE_SIZE) message_size = RELAY_SPLICE_SIZE;
+
+    nread = splice_relay(RX_sock, TX_sock, message_size, relay_pipe,
+                         rate_limit);
+    if(nread == 0) printf("ERROR connection closed before finished reading");
+    if(nread <= 0) return -1;
+    amount_read = nread + amount_read;
+  }
+
+  if(amount_read >= amount2relay) return 1;
+
+  // send_rate_limited() paces out whatever is read in
+  if(rate_limiting) message_size = rate_limit -> bin_max_amount;
+  else	message_size = RELAY_BUF_SIZE;
+  if(message_size > BUF_CLASS_MAX) message_size = BUF_CLASS_MAX;
+
+  char *message = buffer_get(&relay_pool, message_size);
+  if(message == NULL) return -1;
+  int status = 1;
 
-    char message[message_size];
-    memset(message, 0, sizeof(message));
-    nread = time_limit_read(RX_sock, message, 
-			    sizeof(message), &read_timeout);
+  while(amount_read < amount2relay){
+    // Nothing past the end, it belongs to the next message
+    int amount = amount2relay - amount_read;
+    if(amount > message_size) amount = message_size;
+
+    nread = time_limit_read(RX_sock, message, amount, &read_timeout);
 
     if (nread == REQUEST_TIMEOUT) {
       printf("ERROR Read timed out");
-      return nread;
+      status = nread;
+      break;
     }
     else if (nread <= -1) {
       printf("ERROR in reading:%s",strerror(errno)); 
-      return nread;
+      status = nread;
+      break;
     }
     else if( nread == 0){
       printf("ERROR connection closed before finished reading");
-      return -1;
+      status = -1;
+      break;
     }
 
     amount_read = nread + amount_read;
     int send_status = send_rate_limited(TX_sock, message, nread, rate_limit);
-    if(send_status < 0)return -1;
+    if(send_status < 0){
+      status = -1;
+      break;
+    }
     if((send_status == 0) && (amount_read < amount2relay)){
       printf("ERROR closed connection before could send every thing");
+      status = -1;
+      break;
+    }
+    else if(send_status == 0){
+      status = 0;
+      break;
+    }
+  }
+
+  buffer_put(&relay_pool, message, message_size);
+  return status;
+} // End rate_limited_relay
+
+
+
+/* Relays the rest of a chunked body, reading no more than chunk_remaining()
+ * at a time so nothing after the body is read in. Rate limited if
+ * rate_limit is not NULL.
+ *
+ * Return  1 on success
+ *         0 if TX_sock was closed once the body was sent
+ *        <=-1 if the body is malformed or on other errors
+ */
+int chunked_relay(int RX_sock, int TX_sock, struct chunk_tracker *chunks,
+                  struct rate *rate_limit)
+{
+  int message_size = RELAY_BUF_SIZE;
+  if(rate_limit != NULL) message_size = rate_limit -> bin_max_amount;
+  if(message_size > BUF_CLASS_MAX) message_size = BUF_CLASS_MAX;
+
+  char *message = buffer_get(&relay_pool, message_size);
+  if(message == NULL) return -1;
+  int status = 1;
+
+  while(chunk_remaining(chunks) > 0){
+    long amount = chunk_remaining(chunks);
+    if(amount > message_size) amount = message_size;
+
+    int nread = time_limit_read(RX_sock, message, amount, &read_timeout);
+    if(nread == REQUEST_TIMEOUT) printf("ERROR Read timed out");
+    else if(nread == 0) printf("ERROR connection closed before finished reading");
+    if(nread <= 0){
+      status = (nread == 0) ? -1 : nread;
+      break;
+    }
+
+    if(chunk_frame(chunks, message, nread) != nread){
+      printf("ERROR malformed chunked body\n");
+      status = -1;
+      break;
+    }
+
+    int send_status = send_rate_limited(TX_sock, message, nread, rate_limit);
+    if(send_status < 0 || (send_status == 0 && chunk_remaining(chunks) > 0)){
+      status = -1;
+      break;
+    }
+    if(send_status == 0) status = 0;
+  }
+
+  buffer_put(&relay_pool, message, message_size);
+  return status;
+} // End chunked_relay
+
+
+
+/* Moves up to amount bytes from RX_sock to TX_sock through relay_pipe with
+ * splice() so the data is never copied into user space. Blocks until RX_sock
+ * has something to read. When rate limited it waits for the bin to refill
+ * and moves no more than the bin holds.
+ *
+ * Return the number of bytes moved, 0 if RX_sock was closed, -1 on error
+ */
+int splice_relay(int RX_sock, int TX_sock, int amount,
+                 struct splice_pipe *relay_pipe, struct rate *rate_limit)
+{
+  assert(amount > 0 && amount <= RELAY_SPLICE_SIZE);
+
+  if(rate_limit != NULL) amount = suspend(rate_limit, amount);
+
+  int nread = splice(RX_sock, NULL, relay_pipe -> fds[1], NULL, amount,
+                     SPLICE_F_MOVE);
+  if(nread < 0){
+    printf("ERROR in splicing from socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if(nread == 0) return 0;
+
+  // Everything read in has to go out before the pipe can be used again
+  int amount_left = nread;
+  while(amount_left > 0){
+    int nwrite = splice(relay_pipe -> fds[0], NULL, TX_sock, NULL,
+                        amount_left, SPLICE_F_MOVE);
+    if(nwrite <= 0){
+      printf("ERROR in splicing to socket: %s\n", strerror(errno));
       return -1;
     }
-    else if(send_status == 0) return 0;
+    amount_left -= nwrite;
+  }
+
+  if(rate_limit != NULL) update_bin(nread, rate_limit);
+  return nread;
+} // End splice_relay
+
+
+
+/* Opens the pipe used by splice_relay(), big enough for RELAY_SPLICE_SIZE.
+ * If it can not be opened the fds are -1 and data is copied instead.
+ * Return 1 on success, -1 if the pipe could not be opened */
+int splice_pipe_open(struct splice_pipe *relay_pipe)
+{
+  if(pipe2(relay_pipe -> fds, O_CLOEXEC) < 0){
+    relay_pipe -> fds[0] = relay_pipe -> fds[1] = -1;
+    return -1;
   }
+  if(fcntl(relay_pipe -> fds[0], F_GETPIPE_SZ) < RELAY_SPLICE_SIZE &&
+     fcntl(relay_pipe -> fds[0], F_SETPIPE_SZ, RELAY_SPLICE_SIZE) < 0)
+    {
+      splice_pipe_close(relay_pipe);
+      return -1;
+    }
   return 1;
-} // End rate_limited_relay
+} // End splice_pipe_open
+
+
+
+void splice_pipe_close(struct splice_pipe *relay_pipe)
+{
+  if(relay_pipe -> fds[0] < 0) return;
+  close(relay_pipe -> fds[0]);
+  close(relay_pipe -> fds[1]);
+  relay_pipe -> fds[0] = relay_pipe -> fds[1] = -1;
+} // End splice_pipe_close
+
+
+
+/* Closes the server socket (if open) and the pipe which was opened along
+ * with it. responses (if not NULL) gives back what it holds, and the zero
+ * copy sends to the client are waited on */
+void close_server(int server_socket, struct splice_pipe *relay_pipe,
+                  struct response_tracker *responses,
+                  struct zerocopy_ring *zerocopy)
+{
+  if(server_socket >= 0) close(server_socket);
+  splice_pipe_close(relay_pipe);
+  if(responses != NULL) response_free(responses);
+  zerocopy_close(zerocopy);
+} // End close_server
 
 
 
 /* Sets up a listening connection if Host == NULL -> suitable for a server
    else sets up a direct connection suitable for a client
 
+   flags -> SOCK_NONBLOCKING returns a non-blocking socket. For a client
+            socket the connect may still be in progress on return.
+            SOCK_REUSEPORT lets several listening sockets share the port,
+            the kernel spreads new connections between them.
+
    Returns: Socket if successful
 			-1 if an error in creating the socket has occurred
  */
-int setup_socket(char * port, char * host){
+int setup_socket(char * port, char * host, int flags){
   int n, sock;//, sock_out;
   struct addrinfo hints, *res, *rp;
  
@@ -573,6 +1186,9 @@ int setup_socket(char * port, char * host){
   hints.ai_family = AF_UNSPEC;    // or AF_INET6 ... or  AF_UNSPEC
   hints.ai_socktype = SOCK_STREAM;      // for tcp 
 
+  int sock_type = SOCK_STREAM;
+  if(flags & SOCK_NONBLOCKING) sock_type |= SOCK_NONBLOCK;
+
   // Set port to listen if server
   if(host == NULL){
 //     fprintf(stdout, "Creating Client Socket\n");
@@ -592,12 +1208,18 @@ int setup_socket(char * port, char * host){
   if(host == NULL){
     for (rp = res; rp != NULL; rp = rp->ai_next) {
       // Setup socket 
-      sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+      sock = socket(rp->ai_family, sock_type, rp->ai_protocol);
       if (sock == -1) continue;
 
       // set so can reuse socket
       int yes = 1;
       setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(int));
+      if((flags & SOCK_REUSEPORT) &&
+         setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0){
+        printf("ERROR setting SO_REUSEPORT: %s\n", strerror(errno));
+        close(sock);
+        continue;
+      }
 
       // Bind the socket to listening socket
       if (bind(sock, rp->ai_addr, rp->ai_addrlen) == 0)	break;  // Success 
@@ -607,6 +1229,7 @@ int setup_socket(char * port, char * host){
 
     if (rp == NULL) { // No address succeeded 
       fprintf(stderr, "Could not bind\n");
+      freeaddrinfo(res);
       return -1;
     }
   
@@ -619,19 +1242,23 @@ int setup_socket(char * port, char * host){
   else {      
     for (rp = res; rp != NULL; rp = rp->ai_next) {
       // Setup socket 
-      sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+      sock = socket(rp->ai_family, sock_type, rp->ai_protocol);
       if (sock == -1) continue;
 
       // Bind the socket to listening socket
       if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1) break; // Success 
 
+      // Non-blocking connect finishes later, the caller waits for writable
+      if ((flags & SOCK_NONBLOCKING) && errno == EINPROGRESS) break;
+
       // Failed to find successful socket
       close(sock);
     }
 
     if (rp == NULL) {        // No address succeeded 
       fprintf(stderr, "Could not connect to host\n");
-      exit(EXIT_FAILURE);
+      freeaddrinfo(res);
+      return -1;
     }
   }
   freeaddrinfo(res); // free the link list
@@ -639,6 +1266,39 @@ int setup_socket(char * port, char * host){
 } // End setup_socket
 
 
+/* Attaches a classic BPF program to a SO_REUSEPORT group so a new
+ * connection goes to the listener whose index matches the CPU that received
+ * it (modulo the number of listeners). Listeners join the group in the order
+ * they are created.
+ *
+ * Return 1 on success, -1 on error
+ */
+int attach_cpu_steering(int lis_sock, int num_listeners){
+  assert(num_listeners > 0);
+
+  struct sock_filter code[] = {
+    // A = CPU the packet arrived on
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    // A = A % num_listeners
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_listeners },
+    // Index of the listener in the group
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+
+  if(setsockopt(lis_sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                &prog, sizeof(prog)) < 0){
+    printf("ERROR attaching CPU steering program: %s\n", strerror(errno));
+    return -1;
+  }
+  return 1;
+} // End attach_cpu_steering
+
+
+
 // Return the larger of two numbers
 int max(int number1, int number2){
   if(number1 > number2){
@@ -649,47 +1309,242 @@ int max(int number1, int number2){
 
 
 
+/* Takes the request at the front of the request storage. The header and as
+ * much of the body as has been read in are copied to out (which must be able
+ * to hold MAX_HEADER_LENGTH bytes) and removed from the storage.
+ *
+ * host_field -> set to the host the request is for
+ * body_remaining -> set to the amount of body still to be read from the
+ *                   client after what was copied. For a chunked body this
+ *                   is the least it still has, see track_body()
+ * chunks -> started if the body is chunked, otherwise set to CHUNK_OFF
+ * send_more -> set to 1 if out has some of the body and more of it follows,
+ *              so it can be held back to go out with the rest (MSG_MORE).
+ *              0 for a header on its own, and for "Expect: 100-continue"
+ *              as the server has to answer the header before the body comes
+ *
+ * Return: The number of bytes copied to out
+ *         BAD_REQUEST if the header is not complete, read in more
+ *         REQUEST_ENT_TOO_LARGE if the storage is full without a header
+ *        <=-1 other errors in the header, or where the body ends can not
+ *             be told
+ */
+int take_request(struct header_data *request, char *host_field,
+                 int sizeof_host_field, char *out, long *body_remaining,
+                 struct chunk_tracker *chunks, int *send_more)
+{
+  assert(request != NULL);
+  assert(request -> amount_stored > 0);
+
+  int status = resume_header(&(request -> info), STORED_DATA(request),
+                             request -> amount_stored);
+  if(status == BAD_REQUEST && request -> amount_stored >= MAX_HEADER_LENGTH){
+    return REQUEST_ENT_TOO_LARGE;
+  }
+  if(status < 0) return status;
+
+  status = get_host(&(request -> info), host_field, sizeof_host_field);
+  if(status <= 0) return -1; // no host or invalid host field
+
+  int content_length;
+  // Not BAD_REQUEST, that is taken as the header not being complete
+  int chunked = request_framing(&(request -> info), &content_length);
+  if(chunked < 0) return -1;
+
+  long header_length =
+    request -> info.header_end - request -> info.read_storage + 1;
+  long amount2send = header_length + content_length;
+  if(chunked){
+    chunk_start(chunks);
+    long framed = chunk_frame(chunks, STORED_DATA(request) + header_length,
+                              request -> amount_stored - header_length);
+    if(framed < 0) return -1;
+    amount2send = header_length + framed;
+  }
+  else chunks -> state = CHUNK_OFF;
+
+  int amount_copied = request -> amount_stored;
+  if(amount2send < amount_copied) amount_copied = amount2send;
+
+  memcpy(out, STORED_DATA(request), amount_copied);
+  if(chunked) *body_remaining = chunk_remaining(chunks);
+  else *body_remaining = amount2send - amount_copied;
+  *send_more = (amount_copied > header_length && *body_remaining > 0 &&
+                !expects_continue(&(request -> info)));
+
+  remove_message(request, STORED_DATA(request) + amount_copied - 1);
+  return amount_copied;
+} // End take_request
+
+
+
+/* Finds how the body of a request is framed (http spec 3.3.3). A request
+ * with both Transfer-Encoding and Content-Length, or a Transfer-Encoding
+ * which is not chunked last, is refused: a server could frame it
+ * differently and the bytes after it be taken as a request the proxy never
+ * saw.
+ *
+ * content_length -> set to the length of the body if it is not chunked
+ *
+ * Return: 1 the body is chunked
+ *         0 the body is content_length bytes
+ *         BAD_REQUEST if where the body ends can not be told
+ *        <=-1 other errors in the Content-Length
+ */
+int request_framing(struct http_header_info *info, int *content_length)
+{
+  int transfer = get_transfer_encoding(info);
+  *content_length = 0;
+
+  if(transfer == TRANSFER_OTHER) return BAD_REQUEST;
+  if(transfer == TRANSFER_CHUNKED){
+    if(has_known_field(info, FIELD_CONTENT_LENGTH)) return BAD_REQUEST;
+    return 1;
+  }
+
+  *content_length = get_content_length(info);
+  if(*content_length < 0) return *content_length;
+  return 0;
+} // End request_framing
+
+
+
+/* Counts n bytes of body, just read in to data, off body_remaining. For a
+ * chunked body (chunks not CHUNK_OFF) body_remaining is then the least the
+ * body still has, so reading no more than it never reads past the end.
+ *
+ * Return 1 on success, -1 if the chunked body is malformed or data holds
+ * more than the body
+ */
+int track_body(long *body_remaining, struct chunk_tracker *chunks,
+               const char *data, long n)
+{
+  if(chunks -> state == CHUNK_OFF){
+    *body_remaining -= n;
+    return 1;
+  }
+  if(chunk_frame(chunks, data, n) != n) return -1;
+  *body_remaining = chunk_remaining(chunks);
+  return 1;
+} // End track_body
+
+
+
+/* Checks whether the request at the front of the request storage is a
+ * CONNECT. If it is, the host and port it asks for are stored and the
+ * request is removed, leaving anything the client sent after it.
+ *
+ * Return: 1 it is a CONNECT
+ *         0 it is not, the request is left in the storage
+ *         BAD_REQUEST if the header is not complete, read in more
+ *         REQUEST_ENT_TOO_LARGE if the storage is full without a header
+ *        <=-1 other errors in the header
+ */
+int take_connect(struct header_data *request, char *host_field,
+                 int sizeof_host_field, char *port, int sizeof_port)
+{
+  assert(request != NULL);
+  assert(request -> amount_stored > 0);
+
+  int status = resume_header(&(request -> info), STORED_DATA(request),
+                             request -> amount_stored);
+  if(status == BAD_REQUEST && request -> amount_stored >= MAX_HEADER_LENGTH){
+    return REQUEST_ENT_TOO_LARGE;
+  }
+  if(status < 0) return status;
+
+  status = get_connect_target(&(request -> info), host_field,
+                              sizeof_host_field, port, sizeof_port);
+  if(status <= 0) return status;
+
+  remove_message(request, request -> info.header_end);
+  return 1;
+} // End take_connect
+
+
+
+/* Tells a CONNECT client the server could not be reached with a 502. Does
+ * not block and does not close the socket. */
+void send_connect_failed(int client_sock)
+{
+  send(client_sock, connect_failed_response,
+       sizeof(connect_failed_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+} // End send_connect_failed
+
+
+
 /* Remove the first message from the header. The end of the message is
- * determined by message_end
+ * determined by message_end. The messages after it stay where they are.
  */
 void remove_message(struct header_data *header, char *message_end){
 
   assert(header != NULL);
   if(header -> amount_stored == 0) return;
 
-  char *end_data = (header -> header_storage) + (header -> amount_stored) -1;
-  assert(message_end <= end_data); 
+  char *end_data = STORED_DATA(header) + (header -> amount_stored) -1;
+  assert(message_end >= STORED_DATA(header) - 1 && message_end <= end_data); 
+
+  // The next message is parsed from its start (see resume_header())
+  reset_header(&(header -> info));
 
   if(message_end == end_data){
+    header -> start = 0;
     header -> amount_stored = 0;
     return;
   }
 
-  char *next_message = message_end + 1;
-  int size_rest_data = end_data - message_end;
-
-  memmove(header -> header_storage, next_message, size_rest_data);
-  header -> amount_stored = size_rest_data;
+  int size_message = message_end - STORED_DATA(header) + 1;
+  header -> start += size_message;
+  header -> amount_stored -= size_message;
 } // End remove_message
 
 
 
+/* Room to read in more after what is stored in header, from
+ * STORED_DATA(header) + amount_stored. What is stored is moved to the front
+ * of the storage first if there is no room left at the end.
+ * Return the bytes that can be read in, 0 if the storage is full */
+int header_space(struct header_data *header)
+{
+  /* A header parsed from what was stored before has gone, the next one is
+   * parsed from its start (see resume_header()) */
+  if(header -> amount_stored == 0){
+    header -> start = 0;
+    reset_header(&(header -> info));
+  }
+
+  /* Requests are taken as soon as they are complete, so this only moves an
+   * unfinished one, and only once as it is then at the front. */
+  if(header -> start + header -> amount_stored >= MAX_HEADER_LENGTH &&
+     header -> start > 0){
+    memmove(header -> header_storage, STORED_DATA(header),
+            header -> amount_stored);
+    header -> start = 0;
+    reset_header(&(header -> info));
+  }
+  return MAX_HEADER_LENGTH - header -> start - header -> amount_stored;
+} // End header_space
+
+
+
 
 
 /***********************************TESTS *****************************/
 
 void relay_tests(void){
   // test_read_int_header();
-  // test_remove_message();
+  printf("\n\n*** Test consuming pipelined requests ***\n");
+  test_remove_message();
   // test_time_limit_read();
-  test_send_msg();
+  // test_send_msg();
 } // End relay_tests
 
 
 void test_send_msg(void){
   int read_status;
   
-  struct header_data header = {.amount_stored = 0};
+  char storage[MAX_HEADER_LENGTH];
+  struct header_data header = {.header_storage = storage};
 
   // Testing HTTP_request_short.txt
   // printf("\n\n **** Test HTTP_request_short.txt ***\n");
@@ -718,7 +1573,7 @@ void test_send_msg(void){
      content_length);
   */ 
   send_msg(&header, content_length, file_read, 
-			  file_write, NULL);
+			  file_write, NULL, NULL, NULL);
 
   close(file_read);
   close(file_write);
@@ -757,7 +1612,7 @@ void test_send_msg(void){
     else printf("\nFAIL : incorrect content length (282) got:%d",
     content_length);
   */
-  send_msg(&header, content_length, file_read,file_write, NULL);
+  send_msg(&header, content_length, file_read,file_write, NULL, NULL, NULL);
 
   close(file_read);
   close(file_write);
@@ -772,20 +1627,38 @@ void test_send_msg(void){
 
 
 void test_remove_message(void){
-  struct http_header_info header_info;
-
-  struct header_data header = {"hello world", 11, header_info};
-
-  remove_message(&header, header.header_storage + 6);
-  printf("\nExpect: orldo world");
-  printf("\nGot:    %s", header.header_storage);
-  printf("\namount(4):%d\n", header.amount_stored);
-
-  header = (struct header_data) {"hello world", 7, header_info};
-  remove_message(&header, header.header_storage + 6);
-  printf("\nExpect: hello world");
-  printf("\nGot:    %s", header.header_storage);
-  printf("\namount(0):%d\n", header.amount_stored);
+  char storage[MAX_HEADER_LENGTH];
+  struct header_data header = {.header_storage = storage};
+  int ok = 1;
+
+  // Messages are consumed in place, what follows is not moved
+  strcpy(storage, "hello world");
+  header.amount_stored = 11;
+  remove_message(&header, storage + 5);
+  if(header.start != 6 || header.amount_stored != 5 ||
+     strncmp(STORED_DATA(&header), "world", 5) != 0) ok = 0;
+
+  remove_message(&header, STORED_DATA(&header) + 4);
+  if(header.start != 0 || header.amount_stored != 0) ok = 0;
+  if(header_space(&header) != MAX_HEADER_LENGTH) ok = 0;
+
+  /* A message cut off at the end of the storage is moved to the front
+   * once there is no room left to read the rest of it in */
+  header.start = MAX_HEADER_LENGTH - 10;
+  header.amount_stored = 5;
+  memcpy(STORED_DATA(&header), "GET /", 5);
+  if(header_space(&header) != 5 || header.start != MAX_HEADER_LENGTH - 10) ok = 0;
+  header.amount_stored = 10;
+  memcpy(STORED_DATA(&header) + 5, " HTTP", 5);
+  if(header_space(&header) != MAX_HEADER_LENGTH - 10 || header.start != 0 ||
+     strncmp(STORED_DATA(&header), "GET / HTTP", 10) != 0) ok = 0;
+
+  // Full with one message
+  header.amount_stored = MAX_HEADER_LENGTH;
+  if(header_space(&header) != 0) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
 } // End test_remove_message
 
 
@@ -11,7 +11,58 @@
 
 *******************************************************************************/
 
+#ifndef RELAY_COMMS_H
+#define RELAY_COMMS_H
+
 #include "rate_lib.h"
+#include "header_parser.h"
+#include "chunked.h"
+#include "response.h"
+#include "admission.h"
+
+
+/* Flags for setup_socket() */
+#define SOCK_NONBLOCKING 0x1 // Do not block on accept/connect or reads
+#define SOCK_REUSEPORT   0x2 // Listen in a SO_REUSEPORT group on the port
+
+/* Sent to the client once the server of a CONNECT has been reached. From
+ * then on the connection is a tunnel, bytes are relayed without being parsed */
+#define CONNECT_ESTABLISHED "HTTP/1.1 200 Connection established\r\n\r\n"
+
+/* Pipe which relayed data is spliced through so it is not copied into user
+ * space. fds are -1 if it is not open. */
+struct splice_pipe {
+  int fds[2];
+};
+
+/* Buffers for MSG_ZEROCOPY sends to one socket. The kernel reads a buffer
+ * until the peer has acknowledged it, so each is only used again once the
+ * sends from it have been reported complete. socket is -1 if zero copy is
+ * not used. */
+struct zerocopy_ring {
+  int socket;
+  unsigned int sent, completed;  // zero copy sends made, and reported done
+  char *bufs[ZEROCOPY_BUFS];     // RELAY_SPLICE_SIZE each, NULL until used
+  unsigned int done_at[ZEROCOPY_BUFS]; // sent after the last send from each
+  int next;                      // buffer the next send goes from
+};
+
+/* Storage for a http header read in from a socket. Anything read in past the
+ * end of the header (body or a pipelined request) is kept after it. info
+ * keeps where the parse of the first message got to, so after each read only
+ * what is new is parsed (see resume_header()).
+ * Messages are consumed from the front by moving start past them, so the
+ * requests after them are not moved. What is left is only moved back to the
+ * front when a read needs the room at the end, see header_space(). */
+struct header_data {
+  char *header_storage; // MAX_HEADER_LENGTH bytes
+  int start;            // offset of the first message stored
+  int amount_stored;    // bytes stored from start
+  struct http_header_info info;
+};
+
+// First byte stored in a header_data
+#define STORED_DATA(header) ((header) -> header_storage + (header) -> start)
 
 
 /* Relays HTTP information between client and the host given by the client in
@@ -20,22 +71,159 @@
  *
  * client_socket -> The socket connection between client and proxy
  * config_options -> The options from the parsed .conf file. See config.h
+ * ticket -> counted against the host once it is known. The caller gives it
+ *           back with admission_release()
  *
  * Return:
  *       1 Success
  *      -1 Error has occurred
  *      -HTTP_STATUS_CODE - Error in parsing the http request
  */
-int relay(int client_socket,   struct config_sect * config_options, int rate_limiting);
+int relay(int client_socket,   struct config_sect * config_options, int rate_limiting,
+          struct admission_ticket *ticket);
 
 
 /* Sets up a listening connection if Host == NULL -> suitable for a server
  *  else sets up a direct connection suitable for a client
  *
+ *  flags -> SOCK_NONBLOCKING returns a non-blocking socket. For a client
+ *           socket the connect may still be in progress on return.
+ *           SOCK_REUSEPORT lets several listening sockets share the port,
+ *           the kernel spreads new connections between them.
+ *
  *  Returns: Socket if successful
  *			-1 if an error in creating the socket has occurred
  */
-int setup_socket(char * port, char * host);
+int setup_socket(char * port, char * host, int flags);
+
+/* Attaches a classic BPF program to a SO_REUSEPORT group so a new
+ * connection goes to the listener whose index matches the CPU that received
+ * it (modulo the number of listeners). Listeners join the group in the order
+ * they are created.
+ *
+ * Return 1 on success, -1 on error
+ */
+int attach_cpu_steering(int lis_sock, int num_listeners);
+
+/* Takes the request at the front of the request storage. The header and as
+ * much of the body as has been read in are copied to out (which must be able
+ * to hold MAX_HEADER_LENGTH bytes) and removed from the storage.
+ *
+ * host_field -> set to the host the request is for
+ * body_remaining -> set to the amount of body still to be read from the
+ *                   client after what was copied. For a chunked body this
+ *                   is the least it still has, see track_body()
+ * chunks -> started if the body is chunked, otherwise set to CHUNK_OFF
+ * send_more -> set to 1 if out has some of the body and more of it follows,
+ *              so it can be held back to go out with the rest (MSG_MORE).
+ *              0 for a header on its own, and for "Expect: 100-continue"
+ *              as the server has to answer the header before the body comes
+ *
+ * Return: The number of bytes copied to out
+ *         BAD_REQUEST if the header is not complete, read in more
+ *         REQUEST_ENT_TOO_LARGE if the storage is full without a header
+ *        <=-1 other errors in the header, or where the body ends can not
+ *             be told
+ */
+int take_request(struct header_data *request, char *host_field,
+                 int sizeof_host_field, char *out, long *body_remaining,
+                 struct chunk_tracker *chunks, int *send_more);
+
+/* Finds how the body of a request is framed (http spec 3.3.3). A request
+ * with both Transfer-Encoding and Content-Length, or a Transfer-Encoding
+ * which is not chunked last, is refused as it could be used to smuggle a
+ * request past the proxy.
+ *
+ * content_length -> set to the length of the body if it is not chunked
+ *
+ * Return: 1 the body is chunked
+ *         0 the body is content_length bytes
+ *         BAD_REQUEST if where the body ends can not be told
+ *        <=-1 other errors in the Content-Length
+ */
+int request_framing(struct http_header_info *info, int *content_length);
+
+/* Counts n bytes of body, just read in to data, off body_remaining. For a
+ * chunked body (chunks not CHUNK_OFF) body_remaining is then the least the
+ * body still has, so reading no more than it never reads past the end.
+ *
+ * Return 1 on success, -1 if the chunked body is malformed or data holds
+ * more than the body
+ */
+int track_body(long *body_remaining, struct chunk_tracker *chunks,
+               const char *data, long n);
+
+/* Checks whether the request at the front of the request storage is a
+ * CONNECT. If it is, the host and port it asks for are stored and the
+ * request is removed, leaving anything the client sent after it.
+ *
+ * Return: 1 it is a CONNECT
+ *         0 it is not, the request is left in the storage
+ *         BAD_REQUEST if the header is not complete, read in more
+ *         REQUEST_ENT_TOO_LARGE if the storage is full without a header
+ *        <=-1 other errors in the header
+ */
+int take_connect(struct header_data *request, char *host_field,
+                 int sizeof_host_field, char *port, int sizeof_port);
+
+/* Tells a CONNECT client the server could not be reached with a 502. Does
+ * not block and does not close the socket. */
+void send_connect_failed(int client_sock);
+
+/* Opens the pipe used by splice_relay(), big enough for RELAY_SPLICE_SIZE.
+ * If it can not be opened the fds are -1 and data is copied instead.
+ * Return 1 on success, -1 if the pipe could not be opened */
+int splice_pipe_open(struct splice_pipe *relay_pipe);
+
+void splice_pipe_close(struct splice_pipe *relay_pipe);
+
+/* Sends the whole message, rate limited if rate_limit is not NULL.
+ *
+ * Return  1 on success
+ *         0 if the connection was closed
+ *        -1 other sending errors
+ */
+int send_rate_limited(int TX_socket, char *message, int size_message,
+                      struct rate *rate_limit);
+
+/* Sets the size at and above which unthrottled sends use MSG_ZEROCOPY. Below
+ * about 10KB pinning the pages costs more than copying them. 0 turns it off.
+ */
+void set_zerocopy_threshold(int threshold);
+
+/* Turns on SO_ZEROCOPY for TX_socket, if there is a threshold and the socket
+ * takes it. Otherwise zerocopy -> socket is -1 and sends are copied. */
+void zerocopy_open(struct zerocopy_ring *zerocopy, int TX_socket);
+
+/* Waits for every send to complete and gives the buffers back. Must be called
+ * before the socket is closed, as the kernel may still be sending them. */
+void zerocopy_close(struct zerocopy_ring *zerocopy);
+
+/* Return the buffer the next zero copy send goes from (RELAY_SPLICE_SIZE
+ * bytes), waiting only if the kernel is still sending from it. NULL on error
+ */
+char *zerocopy_buffer(struct zerocopy_ring *zerocopy);
+
+/* Sends the whole message, which must be in zerocopy_buffer(), with
+ * MSG_ZEROCOPY. Does not wait for it to complete.
+ *
+ * Return 1 on success, -1 error in sending
+ */
+int send_zerocopy(struct zerocopy_ring *zerocopy, char *message,
+                  int size_message);
+
+/* Remove the first message from the header. The end of the message is
+ * determined by message_end
+ */
+void remove_message(struct header_data *header, char *message_end);
+
+/* Room to read in more after what is stored in header, from
+ * STORED_DATA(header) + amount_stored. What is stored is moved to the front
+ * of the storage first if there is no room left at the end.
+ * Return the bytes that can be read in, 0 if the storage is full */
+int header_space(struct header_data *header);
 
 // Testing functions
 void relay_tests(void);
+
+#endif
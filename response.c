@@ -0,0 +1,475 @@
+/******************************** response.c **********************************
+ Description:
+  Follows the responses a server sends back. See response.h.
+
+  A header is nearly always read in whole, so it is parsed where it was read
+  into. Only when it is split across reads is it copied into storage taken
+  from the pool, along with where its parse got to, so each piece added is
+  only looked at once (resume_header()). The storage is only held while a
+  header is split, rather than a parse being kept in every tracker. The
+  body of a Content-Length response is stepped over without being looked at,
+  a chunked one only has its size lines read.
+
+  Anything which can not be followed (a response nobody asked for, a header
+  too large for the storage, a malformed chunked body) stops the responses
+  being followed: they are relayed as before until the server closes, and
+  the client connection is closed with it.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "response.h"
+#include "header_parser.h"
+#include "error_codes.h"
+
+#if RESPONSES_IN_FLIGHT % 8 != 0
+#error "RESPONSES_IN_FLIGHT must be a multiple of 8"
+#endif
+
+// A header split across reads and where its parse got to
+struct response_storage {
+  struct http_header_info info;
+  char header[MAX_HEADER_LENGTH];
+};
+
+
+/**************************** Prototypes ********************************/
+long track_header(struct response_tracker *responses, const char *data,
+                  long len);
+void start_body(struct response_tracker *responses,
+                struct http_header_info *info);
+int next_request(struct response_tracker *responses);
+void untrack(struct response_tracker *responses);
+
+void test_response_pieces(void);
+void test_response_split_header(void);
+void test_response_untracked(void);
+/***********************************************************************/
+
+
+// Starts following the responses of a new server connection
+void response_init(struct response_tracker *responses,
+                   struct buffer_pool *pool)
+{
+  responses -> state = RESP_HEADER;
+  responses -> body_left = 0;
+  responses -> chunks.state = CHUNK_OFF;
+  responses -> in_flight = 0;
+  responses -> first = 0;
+  responses -> storage = NULL;
+  responses -> stored = 0;
+  responses -> pool = pool;
+} // End response_init
+
+
+
+// Gives back the storage of a header split across reads, if there is one
+void response_free(struct response_tracker *responses)
+{
+  if(responses -> storage == NULL) return;
+
+  buffer_put(responses -> pool, (char *) responses -> storage,
+             sizeof(struct response_storage));
+  responses -> storage = NULL;
+  responses -> stored = 0;
+} // End response_free
+
+
+
+/* Counts a request sent to the server, request being the start of it (at
+ * least as far as the method). Requests must be given in the order they are
+ * sent. */
+void response_expect(struct response_tracker *responses, const char *request)
+{
+  if(responses -> state == RESP_UNTRACKED) return;
+  if(responses -> in_flight == RESPONSES_IN_FLIGHT){
+    untrack(responses);
+    return;
+  }
+
+  // Empty lines before the request line are ignored (http spec 4.1)
+  while(*request == '\r' || *request == '\n') request++;
+
+  int slot = (responses -> first + responses -> in_flight) %
+    RESPONSES_IN_FLIGHT;
+  if(strncmp(request, "HEAD ", 5) == 0){
+    responses -> head[slot / 8] |= 1 << (slot % 8);
+  }
+  else responses -> head[slot / 8] &= ~(1 << (slot % 8));
+  responses -> in_flight++;
+} // End response_expect
+
+
+
+// Follows the next len bytes the server sent, at data
+void response_track(struct response_tracker *responses, const char *data,
+                    long len)
+{
+  long used;
+
+  while(len > 0){
+    switch(responses -> state){
+    case RESP_HEADER:
+      used = track_header(responses, data, len);
+      break;
+
+    case RESP_LENGTH:
+      used = (len < responses -> body_left) ? len : responses -> body_left;
+      response_skip(responses, used);
+      break;
+
+    case RESP_CHUNKED:
+      used = chunk_frame(&(responses -> chunks), data, len);
+      if(used == CHUNK_ERROR){
+        untrack(responses);
+        return;
+      }
+      if(chunk_remaining(&(responses -> chunks)) == 0){
+        responses -> state = RESP_HEADER;
+      }
+      break;
+
+    default:
+      return; // the rest goes until the server closes
+    }
+    data += used;
+    len -= used;
+  }
+} // End response_track
+
+
+
+/* Return how many of the next bytes from the server are body which does not
+ * need to be looked at */
+long response_skippable(struct response_tracker *responses)
+{
+  switch(responses -> state){
+  case RESP_LENGTH:
+    return responses -> body_left;
+  case RESP_CLOSE:
+  case RESP_UNTRACKED:
+    return LONG_MAX;
+  default:
+    return 0;
+  }
+} // End response_skippable
+
+
+
+// Steps over n bytes, no more than response_skippable()
+void response_skip(struct response_tracker *responses, long n)
+{
+  if(responses -> state != RESP_LENGTH) return;
+
+  responses -> body_left -= n;
+  if(responses -> body_left <= 0) responses -> state = RESP_HEADER;
+} // End response_skip
+
+
+
+/* The server has closed the connection. The tracker is started again for
+ * the next one.
+ * Return 1 if every request sent had its whole response, 0 if not */
+int response_server_closed(struct response_tracker *responses)
+{
+  int answered = responses -> state == RESP_HEADER &&
+    responses -> storage == NULL && responses -> in_flight == 0;
+
+  response_free(responses);
+  response_init(responses, responses -> pool);
+  return answered;
+} // End response_server_closed
+
+
+
+/* Follows the header of the next response from the start of data, or from
+ * where the part of it already read in stopped.
+ * Return how many bytes of data were used */
+long track_header(struct response_tracker *responses, const char *data,
+                  long len)
+{
+  struct http_header_info whole;
+  struct http_header_info *info = &whole;
+  char *header = (char *) data;
+  long length = len;
+  int status;
+
+  if(responses -> in_flight == 0){
+    untrack(responses); // nothing was asked for
+    return len;
+  }
+
+  if(responses -> storage != NULL){
+    // Add to what is stored and carry on from where its parse stopped
+    long space = MAX_HEADER_LENGTH - responses -> stored;
+    if(length > space) length = space;
+    memcpy(responses -> storage -> header + responses -> stored, data, length);
+
+    info = &(responses -> storage -> info);
+    header = responses -> storage -> header;
+    length += responses -> stored;
+    status = resume_header(info, header, length);
+  }
+  else {
+    if(length > INT_MAX) length = INT_MAX;
+    status = parse_header(info, header, length);
+  }
+
+  if(status == BAD_REQUEST){
+    // Not all there, keep what there is for the next read
+    if(length >= MAX_HEADER_LENGTH){
+      untrack(responses);
+      return len;
+    }
+    if(responses -> storage == NULL){
+      responses -> storage = (struct response_storage *)
+        buffer_get(responses -> pool, sizeof(struct response_storage));
+      if(responses -> storage == NULL){
+        untrack(responses);
+        return len;
+      }
+      memcpy(responses -> storage -> header, data, length);
+
+      // The parse so far was of data, so starts again in the storage
+      reset_header(&(responses -> storage -> info));
+      resume_header(&(responses -> storage -> info),
+                    responses -> storage -> header, length);
+    }
+    long used = length - responses -> stored;
+    responses -> stored = length;
+    return used;
+  }
+  if(status < 0){
+    untrack(responses);
+    return len;
+  }
+
+  long used = info -> header_end - header + 1 - responses -> stored;
+  start_body(responses, info);
+  if(responses -> state != RESP_UNTRACKED) response_free(responses);
+  return used;
+} // End track_header
+
+
+
+/* Works out how the body of the response whose header is in info is framed
+ * (http spec 3.3.3) and matches it to the request it answers */
+void start_body(struct response_tracker *responses,
+                struct http_header_info *info)
+{
+  int code = get_status_code(info);
+  if(code < 100){
+    untrack(responses);
+    return;
+  }
+
+  // An interim response, the one to the request follows it
+  responses -> state = RESP_HEADER;
+  if(code < 200 && code != 101) return;
+
+  int head = next_request(responses);
+  if(code == 101){
+    responses -> state = RESP_CLOSE; // what follows is not http
+    return;
+  }
+  if(head || code == 204 || code == 304) return; // no body
+
+  int transfer = get_transfer_encoding(info);
+  if(transfer == TRANSFER_CHUNKED){
+    chunk_start(&(responses -> chunks));
+    responses -> state = RESP_CHUNKED;
+  }
+  else if(transfer == TRANSFER_OTHER ||
+          !has_known_field(info, FIELD_CONTENT_LENGTH)){
+    responses -> state = RESP_CLOSE;
+  }
+  else {
+    int length = get_content_length(info);
+    if(length < 0) untrack(responses);
+    else if(length > 0){
+      responses -> body_left = length;
+      responses -> state = RESP_LENGTH;
+    }
+  }
+} // End start_body
+
+
+
+/* Takes the oldest request yet to be answered.
+ * Return 1 if it was a HEAD, 0 if not */
+int next_request(struct response_tracker *responses)
+{
+  int slot = responses -> first;
+  responses -> first = (slot + 1) % RESPONSES_IN_FLIGHT;
+  responses -> in_flight--;
+  return (responses -> head[slot / 8] >> (slot % 8)) & 1;
+} // End next_request
+
+
+
+// Stops following the responses
+void untrack(struct response_tracker *responses)
+{
+  responses -> state = RESP_UNTRACKED;
+  response_free(responses);
+} // End untrack
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void response_tests(void){
+
+  printf("\n\n*** Test following responses read in pieces ***\n");
+  test_response_pieces();
+
+  printf("\n\n*** Test a large response header read a byte at a time ***\n");
+  test_response_split_header();
+
+  printf("\n\n*** Test responses which can not be followed ***\n");
+  test_response_untracked();
+}
+
+char *tracked_requests[] = {
+  "GET / HTTP/1.1\r\n", "\r\nHEAD / HTTP/1.1\r\n", "POST / HTTP/1.1\r\n",
+  "GET / HTTP/1.1\r\n", "GET / HTTP/1.1\r\n", "GET / HTTP/1.1\r\n"
+};
+
+char tracked_responses[] =
+  "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello"
+  "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n"
+  "HTTP/1.1 100 Continue\r\n\r\n"
+  "HTTP/1.1 201 Created\r\nTransfer-Encoding: chunked\r\n\r\n"
+  "5\r\nhello\r\n0\r\n\r\n"
+  "HTTP/1.1 304 Not Modified\r\nContent-Length: 10\r\n\r\n"
+  "HTTP/1.1 204 No Content\r\n\r\n"
+  "HTTP/1.1 200 OK\r\nX-Big: 0123456789012345678901234567890123456789\r\n"
+  "Content-Length: 4\r\n\r\nbody";
+
+/* Read a byte at a time and in pieces of every size, stepping over what can
+ * be, every response is found to end. One byte short of the end they are
+ * not. */
+void test_response_pieces(void){
+  struct response_tracker responses;
+  struct buffer_pool pool;
+  int len = sizeof(tracked_responses) - 1;
+  int num_requests = sizeof(tracked_requests) / sizeof(tracked_requests[0]);
+  int piece, short_by, i, ok = 1;
+
+  buffer_pool_init(&pool);
+  response_init(&responses, &pool);
+
+  for(piece = 1; piece <= len && ok; piece++){
+    for(short_by = 0; short_by <= 1; short_by++){
+      for(i = 0; i < num_requests; i++){
+        response_expect(&responses, tracked_requests[i]);
+      }
+
+      long done = 0;
+      while(done < len - short_by){
+        long n = len - short_by - done;
+        if(n > piece) n = piece;
+
+        long skip = response_skippable(&responses);
+        if(skip > 0){
+          if(n > skip) n = skip;
+          response_skip(&responses, n);
+        }
+        else response_track(&responses, tracked_responses + done, n);
+        done += n;
+      }
+
+      if(response_server_closed(&responses) != !short_by) ok = 0;
+    }
+  }
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST in pieces of %d\n", piece - 1);
+  buffer_pool_destroy(&pool);
+}
+
+/* A header near the size of the storage, read a byte at a time, is framed
+ * the same as read in whole, each byte only being parsed once */
+void test_response_split_header(void){
+  struct response_tracker responses;
+  struct buffer_pool pool;
+  char header[MAX_HEADER_LENGTH];
+  int i, n, length, ok = 1;
+
+  length = snprintf(header, sizeof(header),
+                    "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n");
+  for(i = 0; length < sizeof(header) - 100; i++){
+    length += snprintf(header + length, sizeof(header) - length,
+                       "X-Field-%d: %060d\r\n", i, i);
+  }
+  length += snprintf(header + length, sizeof(header) - length, "\r\n");
+
+  buffer_pool_init(&pool);
+  response_init(&responses, &pool);
+
+  clock_t start = clock();
+  for(n = 0; n < 20 && ok; n++){
+    response_expect(&responses, "GET / HTTP/1.1\r\n");
+    for(i = 0; i < length; i++) response_track(&responses, header + i, 1);
+    if(response_skippable(&responses) != 3) ok = 0;
+    response_skip(&responses, 3);
+    if(response_server_closed(&responses) != 1) ok = 0;
+  }
+  printf("%d byte header read a byte at a time: %ldus\n", length,
+         (long) ((clock() - start) * 50000 / CLOCKS_PER_SEC));
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+  buffer_pool_destroy(&pool);
+}
+
+void test_response_untracked(void){
+  char *cases[] = {
+    "HTTP/1.0 200 OK\r\n\r\nuntil closed",        // ends when closed
+    "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nhiHTTP/1.1 200 OK\r\n",
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+    "HTTP/1.1 101 Switching Protocols\r\n\r\n",
+    "garbage\r\n\r\n"
+  };
+  struct response_tracker responses;
+  struct buffer_pool pool;
+  char big[MAX_HEADER_LENGTH + 100];
+  int i, ok = 1;
+
+  buffer_pool_init(&pool);
+  response_init(&responses, &pool);
+
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+    response_expect(&responses, "GET / HTTP/1.1\r\n");
+    response_track(&responses, cases[i], strlen(cases[i]));
+    if(response_server_closed(&responses) != 0){
+      printf("Kept the connection for %d\n", i);
+      ok = 0;
+    }
+  }
+
+  // A header bigger than the storage, read in two pieces
+  memset(big, 'a', sizeof(big));
+  memcpy(big, "HTTP/1.1 200 OK\r\nX: ", 20);
+  response_expect(&responses, "GET / HTTP/1.1\r\n");
+  response_track(&responses, big, 100);
+  response_track(&responses, big + 100, sizeof(big) - 100);
+  if(responses.state != RESP_UNTRACKED || responses.storage != NULL) ok = 0;
+  if(response_server_closed(&responses) != 0) ok = 0;
+
+  // Started again for the next server connection
+  response_expect(&responses, "GET / HTTP/1.1\r\n");
+  response_track(&responses, tracked_responses, 43);
+  if(response_server_closed(&responses) != 1) ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+  buffer_pool_destroy(&pool);
+}
@@ -0,0 +1,91 @@
+/******************************** response.h **********************************
+ Description:
+  Follows the responses a server sends back, as they stream through, to find
+  where each one ends (http spec 3.3.3). Each status line and header is parsed
+  with header_parser.c and the body framed by its Content-Length, its chunked
+  encoding (see chunked.h) or by the server closing the connection. The bytes
+  are not changed.
+
+  Responses are matched in order to the requests sent, which have to be given
+  to response_expect(): the response to a HEAD, a 1xx (other than 101), 204
+  or 304 has no body, and 1xx responses come before the real one.
+
+  Once every request sent has had its whole response the server connection
+  carries nothing, so if the server closes it the client connection can carry
+  on with a new one.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "chunked.h"
+#include "buffer_pool.h"
+#include "defaults.h"
+
+// A header split across reads and where its parse got to, see response.c
+struct response_storage;
+
+// Where a tracker is in the responses
+enum response_state {
+  RESP_HEADER,    // at or in the header of the next response
+  RESP_LENGTH,    // in a Content-Length body
+  RESP_CHUNKED,   // in a chunked body
+  RESP_CLOSE,     // in a body which ends when the server closes
+  RESP_UNTRACKED  // the responses could not be followed, nothing more is
+                  // looked at and the server connection is not reused
+};
+
+struct response_tracker {
+  enum response_state state;
+  long body_left;               // of a Content-Length body
+  struct chunk_tracker chunks;  // of a chunked body
+
+  // Requests sent which are yet to be answered, a bit each from first set
+  // for a HEAD
+  int in_flight, first;
+  unsigned char head[RESPONSES_IN_FLIGHT / 8];
+
+  // A header split across reads is kept here until it is whole, taken from
+  // pool, NULL otherwise
+  struct response_storage *storage;
+  int stored;
+  struct buffer_pool *pool;
+};
+
+// Starts following the responses of a new server connection
+void response_init(struct response_tracker *responses,
+                   struct buffer_pool *pool);
+
+// Gives back the storage of a header split across reads, if there is one
+void response_free(struct response_tracker *responses);
+
+/* Counts a request sent to the server, request being the start of it (at
+ * least as far as the method). Requests must be given in the order they are
+ * sent. */
+void response_expect(struct response_tracker *responses, const char *request);
+
+// Follows the next len bytes the server sent, at data
+void response_track(struct response_tracker *responses, const char *data,
+                    long len);
+
+/* Return how many of the next bytes from the server are body which does not
+ * need to be looked at (the rest of a Content-Length body, or everything
+ * once the responses are not being followed). They can be relayed without
+ * going through response_track(), but must be given to response_skip(). */
+long response_skippable(struct response_tracker *responses);
+
+// Steps over n bytes, no more than response_skippable()
+void response_skip(struct response_tracker *responses, long n);
+
+/* The server has closed the connection. The tracker is started again for
+ * the next one.
+ * Return 1 if every request sent had its whole response, so the client
+ * connection can be kept, 0 if it has to be closed */
+int response_server_closed(struct response_tracker *responses);
+
+void response_tests(void);
+
+#endif
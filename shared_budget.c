@@ -0,0 +1,257 @@
+/****************************** shared_budget.c *******************************
+ Description:
+  Bandwidth budgets shared by every connection to a domain across all the
+  workers. See shared_budget.h.
+
+  Each budget is a single word in shared memory, its theoretical arrival
+  time (TAT): the time in us at which the budget will be full again. Sending
+  n bytes pushes the TAT on by n / rate, starting from now if it is in the
+  past, and the budget allows whatever keeps the TAT within one burst of now.
+  Charging is one compare and swap, so any number of processes can take from
+  the same budget without a lock. Allowances are checked before the send and
+  charged after it, so flows checking at the same moment can overshoot a
+  burst; the TAT then runs ahead of now and every flow on the budget waits
+  until it has been paid back, which keeps the rate over time exact.
+
+  Rules are hashed into SHARED_BUDGET_SLOTS budgets by name, so a rule keeps
+  its budget over a reload. Two rules which share a slot share a budget and
+  can only be slowed by it, never let past their own rate.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "shared_budget.h"
+#include "rate_lib.h"
+#include "handoff_queue.h" // CACHE_LINE
+#include "defaults.h"
+
+// One per cache line, budgets of different rules are taken from at once
+struct budget_slot {
+  long long tat __attribute__((aligned(CACHE_LINE)));
+};
+
+struct budget_slot *budget_slots = NULL;
+
+
+/**************************** Prototypes ********************************/
+unsigned int budget_hash(char *rule);
+
+void test_budget_shared(void);
+void test_budget_processes(void);
+/***********************************************************************/
+
+
+/* Maps the shared budgets. Must be called before any workers are forked,
+ * without it no connection is given a shared budget.
+ * Return -1 on error, 1 on success */
+int shared_budget_init(void)
+{
+  if(budget_slots != NULL) return 1;
+
+  budget_slots = mmap(NULL, SHARED_BUDGET_SLOTS * sizeof(struct budget_slot),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                      -1, 0);
+  if(budget_slots == MAP_FAILED){
+    printf("ERROR mapping shared budgets: %s\n", strerror(errno));
+    budget_slots = NULL;
+    return -1;
+  }
+  return 1;
+} // End shared_budget_init
+
+
+
+/* Points budget at the shared budget of rule (the [shared_rates] token the
+ * host matched), filled at bytes_per_sec up to burst. */
+void shared_budget_attach(struct shared_budget *budget, char *rule,
+                          int bytes_per_sec, int burst)
+{
+  budget -> tat = NULL;
+  if(budget_slots == NULL || bytes_per_sec <= 0) return;
+
+  budget -> tat = &(budget_slots[budget_hash(rule)].tat);
+  budget -> bytes_per_sec = bytes_per_sec;
+  budget -> burst = (burst > 0) ? burst : 1;
+} // End shared_budget_attach
+
+
+
+/* How much of want the budget allows to be sent at now (monotonic ms). It is
+ * not taken out until shared_budget_charge().
+ *
+ * Return: the bytes of want which may be sent now
+ *         0 if nothing may be sent yet, next_send is set to the monotonic ms
+ *           at which the budget will allow RATE_MIN_SEND (or the whole burst
+ *           if that is smaller)
+ */
+int shared_budget_allowance(struct shared_budget *budget, int want,
+                            long long now, long long *next_send)
+{
+  long long now_us = now * 1000;
+  long long burst_us = (long long) budget -> burst * 1000000 /
+    budget -> bytes_per_sec;
+
+  long long tat = __atomic_load_n(budget -> tat, __ATOMIC_ACQUIRE);
+  if(tat < now_us) tat = now_us;
+
+  long long available = (now_us + burst_us - tat) *
+    budget -> bytes_per_sec / 1000000;
+
+  int enough = RATE_MIN_SEND;
+  if(budget -> burst < enough) enough = budget -> burst;
+
+  if(available < enough){
+    long long ready_us = tat - burst_us +
+      (long long) enough * 1000000 / budget -> bytes_per_sec;
+    *next_send = (ready_us + 999) / 1000;
+    if(*next_send <= now) *next_send = now + 1;
+    return 0;
+  }
+  return (available < want) ? available : want;
+} // End shared_budget_allowance
+
+
+
+// Takes amount sent out of the budget
+void shared_budget_charge(struct shared_budget *budget, int amount)
+{
+  long long cost = (long long) amount * 1000000 / budget -> bytes_per_sec;
+  long long now_us = monotonic_ms() * 1000;
+
+  long long tat = __atomic_load_n(budget -> tat, __ATOMIC_RELAXED);
+  long long new_tat;
+  do {
+    new_tat = ((tat > now_us) ? tat : now_us) + cost;
+  } while(!__atomic_compare_exchange_n(budget -> tat, &tat, new_tat, 1,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+} // End shared_budget_charge
+
+
+
+// FNV-1a hash of a rule name (not case sensitive), reduced to a slot
+unsigned int budget_hash(char *rule)
+{
+  unsigned int hash = 2166136261u;
+
+  for(; *rule != '\0'; rule++){
+    hash ^= tolower((unsigned char) *rule);
+    hash *= 16777619u;
+  }
+  return hash % SHARED_BUDGET_SLOTS;
+} // End budget_hash
+
+
+
+/*****************************TESTING FUNCTIONS**************************/
+
+void shared_budget_tests(void){
+
+  printf("\n\n*** Test budget shared between connections ***\n");
+  test_budget_shared();
+
+  printf("\n\n*** Test budget shared between processes ***\n");
+  test_budget_processes();
+}
+
+/* Six connections to one domain, each with a per connection limit of the
+ * whole budget, get the budget between them and not six times it */
+void test_budget_shared(void){
+  struct rate flows[6];
+  long long sent = 0, start = monotonic_ms();
+  int i, ok = 1;
+
+  shared_budget_init();
+  for(i = 0; i < 6; i++){
+    flows[i] = (struct rate) {.bytes_per_sec = 20480, .bin_max_amount = 2048,
+                              .bin_amount = 2048, .timestamp = start};
+    shared_budget_attach(&(flows[i].shared), "test.shared.example", 20480,
+                         2048);
+  }
+  // Start from a full budget
+  __atomic_store_n(flows[0].shared.tat, 0, __ATOMIC_RELEASE);
+
+  while(monotonic_ms() - start < 500){
+    long long next_send, wake = LLONG_MAX, now = monotonic_ms();
+    for(i = 0; i < 6; i++){
+      int amount = rate_allowance(&(flows[i]), INT_MAX, now, &next_send);
+      if(amount > 0){
+        update_bin(amount, &(flows[i]));
+        sent += amount;
+      }
+      else if(next_send < wake) wake = next_send;
+    }
+    if(wake != LLONG_MAX && wake > now) usleep((wake - now) * 1000);
+  }
+  long long elapsed = monotonic_ms() - start;
+  long long expect = 20480 * elapsed / 1000;
+
+  printf("6 connections sent %lld bytes in %lldms, budget allows %lld + %d\n",
+         sent, elapsed, expect, 2048);
+  if(sent > expect + 2048 + RATE_MIN_SEND || sent < expect - RATE_MIN_SEND)
+    ok = 0;
+
+  if(ok) printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
+
+// Two processes sending to one domain share its budget
+void test_budget_processes(void){
+  int pipe_fds[2], i;
+  long long sent = 0, start = monotonic_ms();
+
+  shared_budget_init();
+  if(pipe(pipe_fds) < 0) return;
+  fflush(stdout); // or the children print it again
+
+  for(i = 0; i < 2; i++){
+    if(fork() != 0) continue;
+
+    struct rate flow = {.bytes_per_sec = 40960, .bin_max_amount = 4096,
+                        .bin_amount = 4096, .timestamp = start};
+    long long child_sent = 0, next_send;
+    shared_budget_attach(&(flow.shared), "test.processes.example", 20480,
+                         2048);
+    while(monotonic_ms() - start < 500){
+      long long now = monotonic_ms();
+      int amount = rate_allowance(&flow, INT_MAX, now, &next_send);
+      if(amount > 0){
+        update_bin(amount, &flow);
+        child_sent += amount;
+      }
+      else usleep((next_send - now) * 1000);
+    }
+    if(write(pipe_fds[1], &child_sent, sizeof(child_sent)) < 0) _exit(1);
+    _exit(0);
+  }
+
+  for(i = 0; i < 2; i++){
+    long long child_sent = 0;
+    if(read(pipe_fds[0], &child_sent, sizeof(child_sent)) > 0){
+      sent += child_sent;
+    }
+    wait(NULL);
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  long long elapsed = monotonic_ms() - start;
+  long long expect = 20480 * elapsed / 1000;
+  printf("2 processes sent %lld bytes in %lldms, budget allows %lld + %d\n",
+         sent, elapsed, expect, 2048);
+  if(sent <= expect + 2048 + 2 * RATE_MIN_SEND &&
+     sent >= expect - 2 * RATE_MIN_SEND)
+    printf("PASSED TEST\n");
+  else printf("FAILED TEST\n");
+}
@@ -0,0 +1,56 @@
+/****************************** shared_budget.h *******************************
+ Description:
+  Bandwidth budgets shared by every connection to a domain, across all the
+  processes and threads of the proxy. Rules go in their own section of the
+  conf file, in the same form as [rates]:
+
+   [shared_rates]
+   www.google.com 100:16  # 100kbytes/sec for all of google together,
+                          # in bursts of at most 16kbytes
+
+  A connection to a host which matches a [shared_rates] rule is held to both
+  its own [rates] limit and the rule's budget. Budgets are kept in memory
+  shared by every worker and taken from with atomic operations, no lock.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef SHARED_BUDGET_H
+#define SHARED_BUDGET_H
+
+// A connection's handle on the budget of the rule its host matched
+struct shared_budget {
+  long long *tat;    // in shared memory, NULL if no rule applies
+  int bytes_per_sec;
+  int burst;         // bytes
+};
+
+
+/* Maps the shared budgets. Must be called before any workers are forked,
+ * without it no connection is given a shared budget.
+ * Return -1 on error, 1 on success */
+int shared_budget_init(void);
+
+/* Points budget at the shared budget of rule (the [shared_rates] token the
+ * host matched), filled at bytes_per_sec up to burst. */
+void shared_budget_attach(struct shared_budget *budget, char *rule,
+                          int bytes_per_sec, int burst);
+
+/* How much of want the budget allows to be sent at now (monotonic ms). It is
+ * not taken out until shared_budget_charge().
+ *
+ * Return: the bytes of want which may be sent now
+ *         0 if nothing may be sent yet, next_send is set to the monotonic ms
+ *           at which the budget will allow RATE_MIN_SEND (or the whole burst
+ *           if that is smaller)
+ */
+int shared_budget_allowance(struct shared_budget *budget, int want,
+                            long long now, long long *next_send);
+
+// Takes amount sent out of the budget
+void shared_budget_charge(struct shared_budget *budget, int amount);
+
+void shared_budget_tests(void);
+
+#endif
@@ -20,6 +20,17 @@
 #include <errno.h>
 
 #include "header_parser.h"
+#include "handoff_queue.h"
+#include "admission.h"
+#include "buffer_pool.h"
+#include "relay_comms.h"
+#include "rate_lib.h"
+#include "shared_budget.h"
+#include "fair_queue.h"
+#include "domain_trie.h"
+#include "chunked.h"
+#include "response.h"
+#include "header_scan.h"
 
 
 void test1_read(void);
@@ -28,7 +39,18 @@ void test1_read(void);
 // Test Suit
 int main(void){
   //  test1_read();
+  scan_select(NULL);
   header_parser_tests();
+  handoff_queue_tests();
+  admission_tests();
+  buffer_pool_tests();
+  relay_tests();
+  rate_lib_tests();
+  shared_budget_tests();
+  fair_queue_tests();
+  domain_trie_tests();
+  chunked_tests();
+  response_tests();
   return 0;
 }
 
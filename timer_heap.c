@@ -0,0 +1,137 @@
+/******************************** timer_heap.c ********************************
+ Description:
+  Binary min heap of timers used by the event loops for idle timeouts and
+  for waking connections parked by the rate limiter.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "timer_heap.h"
+#include "rate_lib.h"
+
+/**************************** Prototypes ********************************/
+void timer_sift_up(struct timer_heap *heap, int index);
+void timer_sift_down(struct timer_heap *heap, int index);
+/***********************************************************************/
+
+
+/* Adds a timer to the heap
+ * Return -1 if out of memory, 1 on success */
+int timer_add(struct timer_heap *heap, struct timer *timer)
+{
+  if(heap -> num_timers == heap -> max_timers){
+    int new_max = heap -> max_timers ? heap -> max_timers * 2 : 64;
+    struct timer **timers =
+      realloc(heap -> timers, new_max * sizeof(struct timer *));
+    if(timers == NULL) return -1;
+    heap -> timers = timers;
+    heap -> max_timers = new_max;
+  }
+
+  timer -> index = heap -> num_timers;
+  heap -> timers[heap -> num_timers++] = timer;
+  timer_sift_up(heap, timer -> index);
+  return 1;
+} // End timer_add
+
+
+
+// Removes a timer from the heap
+void timer_remove(struct timer_heap *heap, struct timer *timer)
+{
+  int index = timer -> index;
+  assert(heap -> timers[index] == timer);
+
+  heap -> num_timers--;
+  if(index == heap -> num_timers) return;
+
+  heap -> timers[index] = heap -> timers[heap -> num_timers];
+  heap -> timers[index] -> index = index;
+  timer_update(heap, heap -> timers[index]);
+} // End timer_remove
+
+
+
+// Restores the heap after the expiry time of a timer has changed
+void timer_update(struct timer_heap *heap, struct timer *timer)
+{
+  timer_sift_up(heap, timer -> index);
+  timer_sift_down(heap, timer -> index);
+} // End timer_update
+
+
+
+// Returns the timer which expires first, NULL if the heap is empty
+struct timer *timer_first(struct timer_heap *heap)
+{
+  if(heap -> num_timers == 0) return NULL;
+  return heap -> timers[0];
+} // End timer_first
+
+
+
+/* Returns the number of ms until the first timer expires (0 if it already
+ * has) or -1 if the heap is empty. Suitable as a poll/epoll timeout. */
+int timer_wait_ms(struct timer_heap *heap)
+{
+  if(heap -> num_timers == 0) return -1;
+
+  long long wait = heap -> timers[0] -> expires - monotonic_ms();
+  return (wait > 0) ? (int) wait : 0;
+} // End timer_wait_ms
+
+
+
+// Frees the storage of the heap (not the timers)
+void timer_heap_free(struct timer_heap *heap)
+{
+  free(heap -> timers);
+  heap -> timers = NULL;
+  heap -> num_timers = heap -> max_timers = 0;
+} // End timer_heap_free
+
+
+
+void timer_sift_up(struct timer_heap *heap, int index)
+{
+  struct timer *timer = heap -> timers[index];
+
+  while(index > 0){
+    int parent = (index - 1) / 2;
+    if(heap -> timers[parent] -> expires <= timer -> expires) break;
+
+    heap -> timers[index] = heap -> timers[parent];
+    heap -> timers[index] -> index = index;
+    index = parent;
+  }
+  heap -> timers[index] = timer;
+  timer -> index = index;
+} // End timer_sift_up
+
+
+
+void timer_sift_down(struct timer_heap *heap, int index)
+{
+  struct timer *timer = heap -> timers[index];
+
+  while(1){
+    int child = 2 * index + 1;
+    if(child >= heap -> num_timers) break;
+    if(child + 1 < heap -> num_timers &&
+       heap -> timers[child + 1] -> expires < heap -> timers[child] -> expires)
+      {
+        child++;
+      }
+    if(timer -> expires <= heap -> timers[child] -> expires) break;
+
+    heap -> timers[index] = heap -> timers[child];
+    heap -> timers[index] -> index = index;
+    index = child;
+  }
+  heap -> timers[index] = timer;
+  timer -> index = index;
+} // End timer_sift_down
@@ -0,0 +1,46 @@
+/******************************** timer_heap.h ********************************
+ Description:
+  Binary min heap of timers used by the event loops for idle timeouts and
+  for waking connections parked by the rate limiter.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef TIMER_HEAP_H
+#define TIMER_HEAP_H
+
+/* Embedded in whatever owns the timer. expires must only be changed while
+ * the timer is not in the heap or followed by timer_update(). */
+struct timer {
+  long long expires; // monotonic ms, see monotonic_ms()
+  int index;         // position in the heap
+};
+
+struct timer_heap {
+  struct timer **timers;
+  int num_timers, max_timers;
+};
+
+
+/* Adds a timer to the heap
+ * Return -1 if out of memory, 1 on success */
+int timer_add(struct timer_heap *heap, struct timer *timer);
+
+// Removes a timer from the heap
+void timer_remove(struct timer_heap *heap, struct timer *timer);
+
+// Restores the heap after the expiry time of a timer has changed
+void timer_update(struct timer_heap *heap, struct timer *timer);
+
+// Returns the timer which expires first, NULL if the heap is empty
+struct timer *timer_first(struct timer_heap *heap);
+
+/* Returns the number of ms until the first timer expires (0 if it already
+ * has) or -1 if the heap is empty. Suitable as a poll/epoll timeout. */
+int timer_wait_ms(struct timer_heap *heap);
+
+// Frees the storage of the heap (not the timers)
+void timer_heap_free(struct timer_heap *heap);
+
+#endif
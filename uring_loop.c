@@ -0,0 +1,1291 @@
+/******************************** uring_loop.c ********************************
+ Description:
+  Single process relay engine using io_uring instead of epoll. Accepts are
+  multishot, reads land in a ring of provided buffers and request bodies are
+  relayed with linked recv -> send requests, so one io_uring_enter() submits
+  and reaps the I/O of every connection.
+
+  The ring is driven through the raw system calls, liburing is not needed.
+
+  A connection has at most one request in flight in each direction:
+   CLIENT -> SERVER  recv header -> send header (and buffered body) ->
+                     linked recv body -> send body ... -> recv next header
+   SERVER -> CLIENT  recv into a provided buffer -> send that buffer ->
+                     recv ... Rate limiting caps the size of each recv and
+                     parks the connection on a timer when the bin is empty.
+  Response bodies are not linked as the amount a recv returns is not known
+  until it completes. A request body's length is, so its recv uses
+  MSG_WAITALL and the send of the same bytes is linked behind it.
+
+  A CONNECT turns the connection into a tunnel once a poll says the connect
+  to the server has finished. Each direction is then a recv into a provided
+  buffer and a send of that buffer, nothing is parsed.
+
+  Buffers of provided data are registered with the kernel, so idle
+  connections hold none. Requests being sent to the server are copied into a
+  buffer from the loop's buffer pool which is given back once the client is
+  read from again.
+
+  Closing a connection shuts its sockets down so everything in flight
+  completes. It is reused once the last of those completions is reaped.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <poll.h>
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "uring_loop.h"
+#include "timer_heap.h"
+#include "buffer_pool.h"
+#include "admission.h"
+#include "config_snapshot.h"
+#include "error_codes.h"
+#include "defaults.h"
+
+#if RELAY_BUF_SIZE < MAX_HEADER_LENGTH
+#error "RELAY_BUF_SIZE must be able to hold a whole header"
+#endif
+
+// Submission queue size, the completion queue is CQ_SCALE times bigger
+#define RING_ENTRIES 4096
+#define CQ_SCALE 4
+
+// Provided buffers for recvs. Must be a power of 2
+#define NUM_BUFS 2048
+#define BUF_GROUP 0
+
+// How long to wait before trying again when the provided buffers run out
+#define NO_BUFS_RETRY_MS 1
+
+// What a completion is for, kept in the low bits of user_data
+#define OP_ACCEPT      0
+#define OP_CLIENT_RECV 1 // request header from the client
+#define OP_SEND_SERVER 2 // request header (and buffered body) to the server
+#define OP_BODY_RECV   3 // linked: request body from the client ...
+#define OP_BODY_SEND   4 // ... and on to the server
+#define OP_SERVER_RECV 5 // response from the server
+#define OP_SEND_CLIENT 6 // response to the client
+#define OP_CONNECTED   7 // poll for the connect of a tunnel finishing
+#define OP_MASK        7
+#define OP_CANCEL      8 // with OP_ACCEPT: the accept being cancelled
+
+#define UCONN_READ_HEADER    0
+#define UCONN_RELAYING       1
+#define UCONN_TUNNEL_CONNECT 2 // see event_loop.c
+#define UCONN_TUNNEL         3
+#define UCONN_CLOSED         4
+
+#define UCONN_OF_TIMER(t) \
+  ((struct uring_conn *) ((char *) (t) - offsetof(struct uring_conn, timer)))
+
+
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_local_tail;   // sqes prepared, published at submit
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *ring_ptr;
+  size_t ring_size, sqes_size;
+};
+
+struct uring_conn {
+  int state;
+  int client_fd, server_fd;
+
+  struct header_data request;     // requests read in from the client, holds
+                                  // storage from the pool while any are
+  char host_field[MAX_URL_SIZE];
+  char *to_server;                // request (or body chunk) being sent,
+                                  // RELAY_BUF_SIZE from the pool or NULL
+  long body_remaining;            // request body still to go to the server
+  struct chunk_tracker body_chunks; // where a chunked request body ends
+  int body_chunk;                 // size of the linked body recv/send
+  int body_received;              // result of the linked body recv
+
+  int send_bid;                   // provided buffer being sent to the client
+                                  // (-1 for CONNECT_ESTABLISHED)
+  int tunnel_bid;                 // provided buffer being sent to the server
+                                  // in a tunnel, -1 if none
+  struct response_tracker responses; // where each response from the server
+                                     // ends, to know if it can be reconnected
+
+  struct rate rate_limit;
+  struct rate *rate_limit_ptr;    // NULL if no rate limiting is applied
+  int parked;                     // waiting on the rate limit or buffers
+  int client_parked;              // recv from the client waiting on buffers
+
+  long long wake_time;            // when a parked connection can recv again
+  long long client_wake_time;     // when a parked client recv is tried again
+  long long idle_deadline;        // closed if nothing is read before this
+  struct timer timer;             // expires at the earliest of these
+
+  struct admission_ticket admission;
+  struct config_snapshot *config; // rules the connection started with
+
+  int in_flight;                  // submitted requests yet to complete
+  struct uring_conn *next;        // free list
+  struct uring_conn *all_next;    // every connection allocated
+};
+
+struct uring_loop {
+  struct uring ring;
+  int lis_sock;
+  int accept_armed;
+  int accept_paused;              // multishot accept cancelled, see
+                                  // admission_paused()
+  struct config_sect *config_options; // start up options, connections use
+                                      // the snapshot they started with
+  int rate_limiting;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned buf_tail;
+
+  struct timer_heap timers;       // holds the timer of every open connection
+  struct buffer_pool pool;        // to_server buffers
+  struct uring_conn *free_list;
+  struct uring_conn *all_conns;
+};
+
+
+/**************************** Prototypes ********************************/
+
+int uring_setup(struct uring *ring, unsigned entries);
+void uring_teardown(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_reserve(struct uring *ring, unsigned count);
+int uring_submit(struct uring *ring, int wait, int wait_ms);
+
+int setup_buffers(struct uring_loop *loop);
+void recycle_buffer(struct uring_loop *loop, int bid);
+
+int arm_accept(struct uring_loop *loop);
+int cancel_accept(struct uring_loop *loop);
+void handle_completion(struct uring_loop *loop, struct io_uring_cqe *cqe);
+void handle_accept(struct uring_loop *loop, struct io_uring_cqe *cqe);
+void handle_client_recv(struct uring_loop *loop, struct uring_conn *conn,
+                        struct io_uring_cqe *cqe);
+void handle_server_recv(struct uring_loop *loop, struct uring_conn *conn,
+                        struct io_uring_cqe *cqe);
+
+void process_request(struct uring_loop *loop, struct uring_conn *conn);
+void request_sent(struct uring_loop *loop, struct uring_conn *conn);
+int start_uring_server(struct uring_loop *loop, struct uring_conn *conn,
+                       char *port);
+void open_uring_tunnel(struct uring_loop *loop, struct uring_conn *conn,
+                       char *port);
+void uring_tunnel_connected(struct uring_loop *loop, struct uring_conn *conn);
+void tunnel_from_client(struct uring_loop *loop, struct uring_conn *conn);
+
+void submit_recv(struct uring_loop *loop, struct uring_conn *conn, int fd,
+                 int len, int op);
+void submit_send(struct uring_loop *loop, struct uring_conn *conn, int fd,
+                 char *data, int len, int op, int flags);
+void submit_body(struct uring_loop *loop, struct uring_conn *conn);
+void submit_server_recv(struct uring_loop *loop, struct uring_conn *conn);
+
+void park_uconn(struct uring_loop *loop, struct uring_conn *conn,
+                long long wait);
+void park_client_recv(struct uring_loop *loop, struct uring_conn *conn);
+void uconn_timer_update(struct uring_loop *loop, struct uring_conn *conn);
+void run_uring_timers(struct uring_loop *loop);
+void close_uconn(struct uring_loop *loop, struct uring_conn *conn);
+void free_uconn(struct uring_loop *loop, struct uring_conn *conn);
+int take_to_server(struct uring_loop *loop, struct uring_conn *conn);
+void release_to_server(struct uring_loop *loop, struct uring_conn *conn);
+int take_request_storage(struct uring_loop *loop, struct uring_conn *conn);
+void release_request_storage(struct uring_loop *loop, struct uring_conn *conn);
+
+/***********************************************************************/
+
+
+/* Creates an io_uring loop which accepts connections from lis_sock.
+ *
+ * Return: The loop
+ *         NULL if io_uring (with multishot accept and provided buffer rings)
+ *         is not available, the caller should fall back to event_loop.h
+ */
+struct uring_loop *uring_loop_create(int lis_sock,
+                                     struct config_sect *config_options,
+                                     int rate_limiting)
+{
+  assert(lis_sock >= 0);
+
+  struct uring_loop *loop = calloc(1, sizeof(struct uring_loop));
+  if(loop == NULL) return NULL;
+
+  loop -> lis_sock = lis_sock;
+  loop -> config_options = config_options;
+  loop -> rate_limiting = rate_limiting;
+  buffer_pool_init(&(loop -> pool));
+
+  if(uring_setup(&(loop -> ring), RING_ENTRIES) < 0){
+    free(loop);
+    return NULL;
+  }
+
+  // Provided buffer rings came in the same kernel as multishot accept
+  if(setup_buffers(loop) < 0){
+    uring_teardown(&(loop -> ring));
+    free(loop);
+    return NULL;
+  }
+  return loop;
+} // End uring_loop_create
+
+
+
+/* Accepts and relays connections until a fatal error occurs.
+ *
+ * Return -1 on error
+ */
+int uring_loop_run(struct uring_loop *loop)
+{
+  assert(loop != NULL);
+  struct uring *ring = &(loop -> ring);
+
+  int timeout;
+
+  while(1){
+    if(loop -> accept_paused && !admission_paused()) loop -> accept_paused = 0;
+    if(!loop -> accept_armed && !loop -> accept_paused &&
+       arm_accept(loop) < 0)
+      return -1;
+
+    // Submit everything queued and sleep no longer than the first timer
+    timeout = timer_wait_ms(&(loop -> timers));
+    if(loop -> accept_paused && (timeout < 0 || timeout > ADMISSION_POLL_MS)){
+      timeout = ADMISSION_POLL_MS;
+    }
+    if(uring_submit(ring, 1, timeout) < 0) return -1;
+
+    // Before accepting so new connections get a new config straight away
+    config_reload_check();
+
+    unsigned head = *(ring -> cq_head);
+    unsigned tail = __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail){
+      struct io_uring_cqe cqe = ring -> cqes[head & *(ring -> cq_mask)];
+      head++;
+      __atomic_store_n(ring -> cq_head, head, __ATOMIC_RELEASE);
+
+      handle_completion(loop, &cqe);
+    }
+
+    run_uring_timers(loop);
+  }
+  return -1;
+} // End uring_loop_run
+
+
+
+/* Closes every connection owned by the loop and frees it. The listening
+ * socket is left open. */
+void uring_loop_destroy(struct uring_loop *loop)
+{
+  if(loop == NULL) return;
+
+  struct timer *timer;
+  while((timer = timer_first(&(loop -> timers))) != NULL){
+    close_uconn(loop, UCONN_OF_TIMER(timer));
+  }
+
+  // Tearing down the ring cancels anything still in flight
+  uring_teardown(&(loop -> ring));
+
+  while(loop -> all_conns != NULL){
+    struct uring_conn *next = loop -> all_conns -> all_next;
+    if(loop -> all_conns -> in_flight > 0){
+      close(loop -> all_conns -> client_fd);
+      if(loop -> all_conns -> server_fd >= 0){
+        close(loop -> all_conns -> server_fd);
+      }
+    }
+    free(loop -> all_conns);
+    loop -> all_conns = next;
+  }
+
+  munmap(loop -> buf_ring, NUM_BUFS * sizeof(struct io_uring_buf));
+  buffer_unmap(loop -> bufs, (size_t) NUM_BUFS * RELAY_BUF_SIZE);
+  buffer_pool_destroy(&(loop -> pool));
+  timer_heap_free(&(loop -> timers));
+  free(loop);
+} // End uring_loop_destroy
+
+
+
+/***************************** RING ************************************/
+
+/* Sets up the ring and maps the submission and completion queues.
+ * Return -1 if io_uring can not be used */
+int uring_setup(struct uring *ring, unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  params.cq_entries = entries * CQ_SCALE;
+
+  ring -> fd = syscall(__NR_io_uring_setup, entries, &params);
+  if(ring -> fd < 0){
+    printf("io_uring not available: %s\n", strerror(errno));
+    return -1;
+  }
+
+  unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+    IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+  if((params.features & needed) != needed){
+    printf("io_uring is missing needed features\n");
+    close(ring -> fd);
+    return -1;
+  }
+
+  // With IORING_FEAT_SINGLE_MMAP both queues share one mapping
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring -> ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+  ring -> ring_ptr = mmap(NULL, ring -> ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring -> fd,
+                          IORING_OFF_SQ_RING);
+  if(ring -> ring_ptr == MAP_FAILED){
+    printf("ERROR mapping io_uring: %s\n", strerror(errno));
+    close(ring -> fd);
+    return -1;
+  }
+
+  ring -> sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring -> sqes = mmap(NULL, ring -> sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQES);
+  if(ring -> sqes == MAP_FAILED){
+    printf("ERROR mapping io_uring sqes: %s\n", strerror(errno));
+    munmap(ring -> ring_ptr, ring -> ring_size);
+    close(ring -> fd);
+    return -1;
+  }
+
+  char *ptr = ring -> ring_ptr;
+  ring -> sq_entries = params.sq_entries;
+  ring -> sq_head = (unsigned *) (ptr + params.sq_off.head);
+  ring -> sq_tail = (unsigned *) (ptr + params.sq_off.tail);
+  ring -> sq_mask = (unsigned *) (ptr + params.sq_off.ring_mask);
+  ring -> sq_array = (unsigned *) (ptr + params.sq_off.array);
+  ring -> cq_head = (unsigned *) (ptr + params.cq_off.head);
+  ring -> cq_tail = (unsigned *) (ptr + params.cq_off.tail);
+  ring -> cq_mask = (unsigned *) (ptr + params.cq_off.ring_mask);
+  ring -> cqes = (struct io_uring_cqe *) (ptr + params.cq_off.cqes);
+  ring -> sq_local_tail = *(ring -> sq_tail);
+
+  // sqes are always used in ring order
+  unsigned i;
+  for(i = 0; i < ring -> sq_entries; i++) ring -> sq_array[i] = i;
+  return 1;
+} // End uring_setup
+
+
+
+void uring_teardown(struct uring *ring)
+{
+  munmap(ring -> sqes, ring -> sqes_size);
+  munmap(ring -> ring_ptr, ring -> ring_size);
+  close(ring -> fd);
+} // End uring_teardown
+
+
+
+/* Returns the next free sqe, zeroed. If the queue is full what is queued is
+ * submitted first.
+ * Return NULL if no sqe could be made free */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  if(uring_reserve(ring, 1) < 0) return NULL;
+
+  struct io_uring_sqe *sqe =
+    &(ring -> sqes[ring -> sq_local_tail & *(ring -> sq_mask)]);
+  ring -> sq_local_tail++;
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+} // End uring_get_sqe
+
+
+
+/* Makes sure count sqes can be taken without a submit in between, so
+ * linked requests are submitted together.
+ * Return -1 if the space could not be made */
+int uring_reserve(struct uring *ring, unsigned count)
+{
+  unsigned head = __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE);
+  if(ring -> sq_local_tail - head + count <= ring -> sq_entries) return 1;
+
+  if(uring_submit(ring, 0, 0) < 0) return -1;
+
+  head = __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE);
+  if(ring -> sq_local_tail - head + count <= ring -> sq_entries) return 1;
+
+  printf("ERROR io_uring submission queue full\n");
+  return -1;
+} // End uring_reserve
+
+
+
+/* Submits every queued sqe. If wait is set it also waits for a completion,
+ * for at most wait_ms (-1 waits until one arrives).
+ *
+ * Return -1 on error
+ */
+int uring_submit(struct uring *ring, int wait, int wait_ms)
+{
+  unsigned head = __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE);
+  unsigned to_submit = ring -> sq_local_tail - head;
+  __atomic_store_n(ring -> sq_tail, ring -> sq_local_tail, __ATOMIC_RELEASE);
+
+  struct __kernel_timespec timeout = {
+    .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000L
+  };
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if(wait_ms >= 0) arg.ts = (unsigned long) &timeout;
+
+  unsigned flags = IORING_ENTER_EXT_ARG, min_complete = 0;
+  if(wait){
+    flags |= IORING_ENTER_GETEVENTS;
+    min_complete = 1;
+  }
+
+  int status = syscall(__NR_io_uring_enter, ring -> fd, to_submit,
+                       min_complete, flags, &arg, sizeof(arg));
+  if(status < 0 && errno != EINTR && errno != ETIME &&
+     errno != EBUSY && errno != EAGAIN)
+    {
+      printf("ERROR in io_uring_enter: %s\n", strerror(errno));
+      return -1;
+    }
+  return 1;
+} // End uring_submit
+
+
+
+/* Registers the provided buffer ring which recvs pick their buffer from.
+ * Return -1 if provided buffer rings are not supported */
+int setup_buffers(struct uring_loop *loop)
+{
+  size_t ring_size = NUM_BUFS * sizeof(struct io_uring_buf);
+
+  loop -> buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(loop -> buf_ring == MAP_FAILED) return -1;
+
+  loop -> bufs = buffer_map((size_t) NUM_BUFS * RELAY_BUF_SIZE);
+  if(loop -> bufs == NULL){
+    munmap(loop -> buf_ring, ring_size);
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) loop -> buf_ring;
+  reg.ring_entries = NUM_BUFS;
+  reg.bgid = BUF_GROUP;
+
+  if(syscall(__NR_io_uring_register, loop -> ring.fd,
+             IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+    printf("io_uring provided buffer rings not available: %s\n",
+           strerror(errno));
+    munmap(loop -> buf_ring, ring_size);
+    buffer_unmap(loop -> bufs, (size_t) NUM_BUFS * RELAY_BUF_SIZE);
+    return -1;
+  }
+
+  int bid;
+  for(bid = 0; bid < NUM_BUFS; bid++) recycle_buffer(loop, bid);
+  return 1;
+} // End setup_buffers
+
+
+
+// Gives a provided buffer back to the kernel once its data has been used
+void recycle_buffer(struct uring_loop *loop, int bid)
+{
+  // Only set the fields, the ring tail shares memory with the first entry
+  struct io_uring_buf *buf =
+    &(loop -> buf_ring -> bufs[loop -> buf_tail & (NUM_BUFS - 1)]);
+  buf -> addr = (unsigned long) (loop -> bufs + (size_t) bid * RELAY_BUF_SIZE);
+  buf -> len = RELAY_BUF_SIZE;
+  buf -> bid = bid;
+
+  loop -> buf_tail++;
+  __atomic_store_n(&(loop -> buf_ring -> tail), loop -> buf_tail,
+                   __ATOMIC_RELEASE);
+} // End recycle_buffer
+
+
+
+/***************************** COMPLETIONS *****************************/
+
+// Starts a multishot accept on the listening socket
+int arm_accept(struct uring_loop *loop)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&(loop -> ring));
+  if(sqe == NULL) return -1;
+
+  sqe -> opcode = IORING_OP_ACCEPT;
+  sqe -> fd = loop -> lis_sock;
+  sqe -> ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe -> accept_flags = SOCK_NONBLOCK;
+  sqe -> user_data = OP_ACCEPT;
+
+  loop -> accept_armed = 1;
+  return 1;
+} // End arm_accept
+
+
+
+/* Cancels the multishot accept while the proxy is at max_connections.
+ * Clients wait in the listen backlog meanwhile. */
+int cancel_accept(struct uring_loop *loop)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&(loop -> ring));
+  if(sqe == NULL) return -1;
+
+  sqe -> opcode = IORING_OP_ASYNC_CANCEL;
+  sqe -> addr = OP_ACCEPT; // the user_data of the accept
+  sqe -> user_data = OP_ACCEPT | OP_CANCEL;
+
+  loop -> accept_paused = 1;
+  return 1;
+} // End cancel_accept
+
+
+
+void handle_completion(struct uring_loop *loop, struct io_uring_cqe *cqe)
+{
+  int op = cqe -> user_data & OP_MASK;
+  struct uring_conn *conn =
+    (struct uring_conn *) (unsigned long) (cqe -> user_data & ~OP_MASK);
+
+  if(cqe -> user_data == (OP_ACCEPT | OP_CANCEL)) return;
+  if(op == OP_ACCEPT){
+    handle_accept(loop, cqe);
+    return;
+  }
+
+  conn -> in_flight--;
+
+  if(conn -> state == UCONN_CLOSED){
+    if(cqe -> flags & IORING_CQE_F_BUFFER){
+      recycle_buffer(loop, cqe -> flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if(op == OP_SEND_CLIENT && conn -> send_bid >= 0){
+      recycle_buffer(loop, conn -> send_bid);
+    }
+    if(op == OP_SEND_SERVER && conn -> tunnel_bid >= 0){
+      recycle_buffer(loop, conn -> tunnel_bid);
+      conn -> tunnel_bid = -1;
+    }
+
+    // Nothing else refers to the connection so it can be reused
+    if(conn -> in_flight == 0) free_uconn(loop, conn);
+    return;
+  }
+
+  switch(op){
+  case OP_CLIENT_RECV:
+    handle_client_recv(loop, conn, cqe);
+    break;
+
+  case OP_SEND_SERVER:
+    if(conn -> tunnel_bid >= 0){
+      recycle_buffer(loop, conn -> tunnel_bid);
+      conn -> tunnel_bid = -1;
+    }
+    if(cqe -> res < 0) close_uconn(loop, conn);
+    else if(conn -> state == UCONN_TUNNEL) tunnel_from_client(loop, conn);
+    else request_sent(loop, conn);
+    break;
+
+  case OP_BODY_RECV:
+    conn -> body_received = cqe -> res;
+    // A short recv cancels the linked send, see OP_BODY_SEND
+    if(cqe -> res <= 0) close_uconn(loop, conn);
+    else conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+    break;
+
+  case OP_BODY_SEND:
+    if(cqe -> res == -ECANCELED && conn -> body_received > 0){
+      /* Send what the short recv did get. The rest has not arrived, so it
+       * is not held back waiting for it */
+      conn -> body_chunk = conn -> body_received;
+      submit_send(loop, conn, conn -> server_fd, conn -> to_server,
+                  conn -> body_chunk, OP_BODY_SEND, 0);
+    }
+    else if(cqe -> res < 0) close_uconn(loop, conn);
+    else if(track_body(&(conn -> body_remaining), &(conn -> body_chunks),
+                       conn -> to_server, cqe -> res) < 0){
+      close_uconn(loop, conn);
+    }
+    else request_sent(loop, conn);
+    break;
+
+  case OP_SERVER_RECV:
+    handle_server_recv(loop, conn, cqe);
+    break;
+
+  case OP_SEND_CLIENT:
+    if(conn -> send_bid >= 0) recycle_buffer(loop, conn -> send_bid);
+    if(cqe -> res < 0) close_uconn(loop, conn);
+    else submit_server_recv(loop, conn);
+    break;
+
+  case OP_CONNECTED:
+    uring_tunnel_connected(loop, conn);
+    break;
+  }
+} // End handle_completion
+
+
+
+// Sets up a connection for a client from the multishot accept
+void handle_accept(struct uring_loop *loop, struct io_uring_cqe *cqe)
+{
+  if(!(cqe -> flags & IORING_CQE_F_MORE)) loop -> accept_armed = 0;
+
+  if(cqe -> res < 0){
+    if(cqe -> res != -ECONNABORTED && cqe -> res != -EINTR &&
+       cqe -> res != -ECANCELED)
+      {
+        printf("ERROR in accepting connection: %s\n", strerror(-cqe -> res));
+      }
+    return;
+  }
+
+  struct admission_ticket ticket;
+  admission_ticket_init(&ticket);
+  if(admit_client(cqe -> res, &ticket) < 0){
+    send_overloaded(cqe -> res);
+    close(cqe -> res);
+    return;
+  }
+
+  // Stop the multishot accept before it takes a client over the limit
+  if(loop -> accept_armed && !loop -> accept_paused && admission_paused()){
+    cancel_accept(loop);
+  }
+
+  struct uring_conn *conn = loop -> free_list;
+  if(conn != NULL) loop -> free_list = conn -> next;
+  else {
+    conn = malloc(sizeof(struct uring_conn));
+    if(conn == NULL){
+      printf("ERROR out of memory for connection\n");
+      admission_release(&ticket);
+      close(cqe -> res);
+      return;
+    }
+    conn -> all_next = loop -> all_conns;
+    loop -> all_conns = conn;
+  }
+
+  conn -> state = UCONN_READ_HEADER;
+  conn -> client_fd = cqe -> res;
+  conn -> server_fd = -1;
+  conn -> request = (struct header_data) {.header_storage = NULL};
+  conn -> body_remaining = 0;
+  conn -> body_chunks.state = CHUNK_OFF;
+  conn -> to_server = NULL;
+  conn -> tunnel_bid = -1;
+  response_init(&(conn -> responses), &(loop -> pool));
+  conn -> rate_limit_ptr = NULL;
+  conn -> parked = 0;
+  conn -> client_parked = 0;
+  conn -> in_flight = 0;
+  conn -> admission = ticket;
+  conn -> config = config_snapshot_get();
+  conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+  conn -> timer.expires = conn -> idle_deadline;
+
+  if(timer_add(&(loop -> timers), &(conn -> timer)) < 0){
+    printf("ERROR out of memory for connection\n");
+    admission_release(&(conn -> admission));
+    config_snapshot_put(conn -> config);
+    close(conn -> client_fd);
+    conn -> next = loop -> free_list;
+    loop -> free_list = conn;
+    return;
+  }
+
+  submit_recv(loop, conn, conn -> client_fd, RELAY_BUF_SIZE, OP_CLIENT_RECV);
+} // End handle_accept
+
+
+
+// Adds what the client sent to the request storage and tries to parse it
+void handle_client_recv(struct uring_loop *loop, struct uring_conn *conn,
+                        struct io_uring_cqe *cqe)
+{
+  if(cqe -> res == -ENOBUFS){
+    park_client_recv(loop, conn);
+    return;
+  }
+  if(cqe -> res <= 0){
+    close_uconn(loop, conn); // client closed or error
+    return;
+  }
+
+  int bid = cqe -> flags >> IORING_CQE_BUFFER_SHIFT;
+  struct header_data *request = &(conn -> request);
+  conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+
+  // Nothing in a tunnel is a request, send it on straight from the buffer
+  if(conn -> state == UCONN_TUNNEL){
+    conn -> tunnel_bid = bid;
+    submit_send(loop, conn, conn -> server_fd,
+                loop -> bufs + (size_t) bid * RELAY_BUF_SIZE, cqe -> res,
+                OP_SEND_SERVER, 0);
+    return;
+  }
+
+  if(take_request_storage(loop, conn) < 0){
+    recycle_buffer(loop, bid);
+    close_uconn(loop, conn);
+    return;
+  }
+
+  // The recv was no bigger than header_space() when it was submitted
+  memcpy(STORED_DATA(request) + request -> amount_stored,
+         loop -> bufs + (size_t) bid * RELAY_BUF_SIZE, cqe -> res);
+  request -> amount_stored += cqe -> res;
+  recycle_buffer(loop, bid);
+
+  process_request(loop, conn);
+} // End handle_client_recv
+
+
+
+// Relays what the server sent on to the client straight from the buffer
+void handle_server_recv(struct uring_loop *loop, struct uring_conn *conn,
+                        struct io_uring_cqe *cqe)
+{
+  if(cqe -> res == -ENOBUFS){
+    park_uconn(loop, conn, NO_BUFS_RETRY_MS);
+    return;
+  }
+  // The server closed after answering every request sent, the client can
+  // carry on and the next request goes to a new server connection
+  if(cqe -> res == 0 && conn -> state == UCONN_RELAYING &&
+     conn -> to_server == NULL &&
+     response_server_closed(&(conn -> responses)))
+    {
+      close(conn -> server_fd);
+      conn -> server_fd = -1;
+      return;
+    }
+  if(cqe -> res <= 0){
+    if(cqe -> res < 0) printf("ERROR in reading:%s\n", strerror(-cqe -> res));
+    close_uconn(loop, conn); // server closed or error
+    return;
+  }
+
+  if(conn -> rate_limit_ptr != NULL) update_bin(cqe -> res, conn -> rate_limit_ptr);
+  conn -> idle_deadline = monotonic_ms() + READ_TIMEOUT_SEC * 1000;
+
+  conn -> send_bid = cqe -> flags >> IORING_CQE_BUFFER_SHIFT;
+  if(conn -> state == UCONN_RELAYING){
+    response_track(&(conn -> responses),
+                   loop -> bufs + (size_t) conn -> send_bid * RELAY_BUF_SIZE,
+                   cqe -> res);
+  }
+  submit_send(loop, conn, conn -> client_fd,
+              loop -> bufs + (size_t) conn -> send_bid * RELAY_BUF_SIZE,
+              cqe -> res, OP_SEND_CLIENT, 0);
+} // End handle_server_recv
+
+
+
+/* Sends the request at the front of the request storage to the server, or
+ * reads more from the client if it is not complete. The first request sets
+ * the host and connects to the server.
+ */
+void process_request(struct uring_loop *loop, struct uring_conn *conn)
+{
+  char requested_host[MAX_URL_SIZE];
+  char connect_port[MAX_PORT_SIZE];
+  struct header_data *request = &(conn -> request);
+  int send_more;
+
+  if(take_to_server(loop, conn) < 0){
+    close_uconn(loop, conn);
+    return;
+  }
+
+  if(conn -> state == UCONN_READ_HEADER){
+    int status = take_connect(request, conn -> host_field,
+                              sizeof(conn -> host_field), connect_port,
+                              sizeof(connect_port));
+    if(status == 1){
+      open_uring_tunnel(loop, conn, connect_port);
+      return;
+    }
+    if(status < 0 && status != BAD_REQUEST){
+      close_uconn(loop, conn);
+      return;
+    }
+  }
+
+  int amount_copied = take_request(request, requested_host,
+                                   sizeof(requested_host), conn -> to_server,
+                                   &(conn -> body_remaining),
+                                   &(conn -> body_chunks), &send_more);
+  if(amount_copied == BAD_REQUEST){
+    // Yet to find the end of the header - read more
+    release_to_server(loop, conn);
+    submit_recv(loop, conn, conn -> client_fd, header_space(request),
+                OP_CLIENT_RECV);
+    return;
+  }
+  if(amount_copied < 0){
+    close_uconn(loop, conn);
+    return;
+  }
+  release_request_storage(loop, conn);
+
+  if(conn -> state == UCONN_READ_HEADER){
+    strcpy(conn -> host_field, requested_host);
+    if(start_uring_server(loop, conn, SERVER_PORT) < 0){
+      close_uconn(loop, conn);
+      return;
+    }
+    conn -> state = UCONN_RELAYING;
+    submit_server_recv(loop, conn);
+  }
+  // if the host field is different close the connection
+  else if(strcmp(conn -> host_field, requested_host) != 0){
+    close_uconn(loop, conn);
+    return;
+  }
+  // the server closed after answering every request, connect again
+  else if(conn -> server_fd < 0){
+    conn -> server_fd = setup_socket(SERVER_PORT, conn -> host_field,
+                                     SOCK_NONBLOCKING);
+    if(conn -> server_fd < 0){
+      close_uconn(loop, conn);
+      return;
+    }
+    submit_server_recv(loop, conn);
+  }
+
+  response_expect(&(conn -> responses), conn -> to_server);
+
+  // The rest of the body follows, do not send a short segment before it
+  submit_send(loop, conn, conn -> server_fd, conn -> to_server,
+              amount_copied, OP_SEND_SERVER, send_more ? MSG_MORE : 0);
+} // End process_request
+
+
+
+// Carries on with the request once what was queued has reached the server
+void request_sent(struct uring_loop *loop, struct uring_conn *conn)
+{
+  if(conn -> body_remaining > 0) submit_body(loop, conn);
+  else if(conn -> request.amount_stored > 0) process_request(loop, conn);
+  else {
+    release_to_server(loop, conn);
+    submit_recv(loop, conn, conn -> client_fd, RELAY_BUF_SIZE,
+                OP_CLIENT_RECV);
+  }
+} // End request_sent
+
+
+
+/* Starts relaying a CONNECT to host_field:port. The client is only told the
+ * tunnel is open once a poll on the server says the connect has finished.
+ */
+void open_uring_tunnel(struct uring_loop *loop, struct uring_conn *conn,
+                       char *port)
+{
+  int status = start_uring_server(loop, conn, port);
+  if(status == -1) send_connect_failed(conn -> client_fd);
+  if(status < 0){
+    close_uconn(loop, conn);
+    return;
+  }
+
+  struct io_uring_sqe *sqe = uring_get_sqe(&(loop -> ring));
+  if(sqe == NULL){
+    close_uconn(loop, conn);
+    return;
+  }
+
+  sqe -> opcode = IORING_OP_POLL_ADD;
+  sqe -> fd = conn -> server_fd;
+  sqe -> poll32_events = POLLOUT;
+  sqe -> user_data = (unsigned long) conn | OP_CONNECTED;
+  conn -> in_flight++;
+  conn -> state = UCONN_TUNNEL_CONNECT;
+} // End open_uring_tunnel
+
+
+
+/* Tells the client the tunnel is open (or sends a 502 if the connect
+ * failed) and starts relaying both ways. */
+void uring_tunnel_connected(struct uring_loop *loop, struct uring_conn *conn)
+{
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+
+  if(getsockopt(conn -> server_fd, SOL_SOCKET, SO_ERROR, &error,
+                &error_len) < 0 || error != 0)
+    {
+      send_connect_failed(conn -> client_fd);
+      close_uconn(loop, conn);
+      return;
+    }
+
+  // Taken by SERVER -> CLIENT, which carries on once it has been sent
+  conn -> state = UCONN_TUNNEL;
+  conn -> send_bid = -1;
+  submit_send(loop, conn, conn -> client_fd, CONNECT_ESTABLISHED,
+              strlen(CONNECT_ESTABLISHED), OP_SEND_CLIENT, 0);
+
+  tunnel_from_client(loop, conn);
+} // End uring_tunnel_connected
+
+
+
+/* Sends on anything left in the request storage (sent by the client after
+ * the CONNECT), otherwise recvs more from the client */
+void tunnel_from_client(struct uring_loop *loop, struct uring_conn *conn)
+{
+  struct header_data *request = &(conn -> request);
+
+  if(request -> amount_stored > 0){
+    memcpy(conn -> to_server, STORED_DATA(request),
+           request -> amount_stored);
+    submit_send(loop, conn, conn -> server_fd, conn -> to_server,
+                request -> amount_stored, OP_SEND_SERVER, 0);
+    request -> amount_stored = 0;
+    release_request_storage(loop, conn);
+    return;
+  }
+  release_to_server(loop, conn);
+  submit_recv(loop, conn, conn -> client_fd, RELAY_BUF_SIZE, OP_CLIENT_RECV);
+} // End tunnel_from_client
+
+
+
+/* Sets up the rate limit for the host and starts a non-blocking connect to
+ * port on the server. Sends and recvs queued on it wait for the connect to
+ * finish.
+ *
+ * Return 1 on success
+ *        SERVICE_UNAVAILABLE if the host is at its connection limit, the
+ *        client has been sent a 503
+ *        -1 if the server could not be reached
+ */
+int start_uring_server(struct uring_loop *loop, struct uring_conn *conn,
+                       char *port)
+{
+  struct rate *rate_limit = &(conn -> rate_limit);
+
+  if(admit_host(conn -> host_field, &(conn -> admission)) < 0){
+    send_overloaded(conn -> client_fd);
+    return SERVICE_UNAVAILABLE;
+  }
+
+  rate_init(rate_limit, conn -> config -> config_options, conn -> host_field);
+
+  if(loop -> rate_limiting){
+    conn -> rate_limit_ptr = rate_limit;
+    rate_offload(rate_limit, conn -> client_fd);
+    rate_limit_queue(rate_limit, conn -> client_fd);
+  }
+
+  conn -> server_fd = setup_socket(port, conn -> host_field, SOCK_NONBLOCKING);
+  if(conn -> server_fd < 0) return -1;
+  return 1;
+} // End start_uring_server
+
+
+
+/***************************** SUBMISSIONS *****************************/
+
+// Queues a recv of up to len bytes into a provided buffer
+void submit_recv(struct uring_loop *loop, struct uring_conn *conn, int fd,
+                 int len, int op)
+{
+  if(len > RELAY_BUF_SIZE) len = RELAY_BUF_SIZE;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(&(loop -> ring));
+  if(sqe == NULL){
+    close_uconn(loop, conn);
+    return;
+  }
+
+  sqe -> opcode = IORING_OP_RECV;
+  sqe -> fd = fd;
+  sqe -> len = len;
+  sqe -> flags = IOSQE_BUFFER_SELECT;
+  sqe -> buf_group = BUF_GROUP;
+  sqe -> user_data = (unsigned long) conn | op;
+  conn -> in_flight++;
+} // End submit_recv
+
+
+
+/* Queues a send of all of data. flags are added to the send flags, MSG_MORE
+ * when more of the same message follows */
+void submit_send(struct uring_loop *loop, struct uring_conn *conn, int fd,
+                 char *data, int len, int op, int flags)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&(loop -> ring));
+  if(sqe == NULL){
+    close_uconn(loop, conn);
+    return;
+  }
+
+  sqe -> opcode = IORING_OP_SEND;
+  sqe -> fd = fd;
+  sqe -> addr = (unsigned long) data;
+  sqe -> len = len;
+  sqe -> msg_flags = MSG_WAITALL | MSG_NOSIGNAL | flags;
+  sqe -> user_data = (unsigned long) conn | op;
+  conn -> in_flight++;
+} // End submit_send
+
+
+
+/* Queues the next chunk of the request body as a recv from the client with
+ * the send to the server linked behind it */
+void submit_body(struct uring_loop *loop, struct uring_conn *conn)
+{
+  if(uring_reserve(&(loop -> ring), 2) < 0){
+    close_uconn(loop, conn);
+    return;
+  }
+
+  conn -> body_chunk = RELAY_BUF_SIZE;
+  if(conn -> body_remaining < conn -> body_chunk){
+    conn -> body_chunk = conn -> body_remaining;
+  }
+  conn -> body_received = 0;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(&(loop -> ring));
+  sqe -> opcode = IORING_OP_RECV;
+  sqe -> fd = conn -> client_fd;
+  sqe -> addr = (unsigned long) conn -> to_server;
+  sqe -> len = conn -> body_chunk;
+  sqe -> msg_flags = MSG_WAITALL;
+  sqe -> flags = IOSQE_IO_LINK;
+  sqe -> user_data = (unsigned long) conn | OP_BODY_RECV;
+  conn -> in_flight++;
+
+  submit_send(loop, conn, conn -> server_fd, conn -> to_server,
+              conn -> body_chunk, OP_BODY_SEND,
+              (conn -> body_remaining > conn -> body_chunk) ? MSG_MORE : 0);
+} // End submit_body
+
+
+
+/* Queues the next recv from the server, no bigger than the rate limit
+ * allows. Parks the connection if the bin is empty. */
+void submit_server_recv(struct uring_loop *loop, struct uring_conn *conn)
+{
+  int len = RELAY_BUF_SIZE;
+
+  if(conn -> rate_limit_ptr != NULL){
+    long long now = monotonic_ms(), next_send;
+    len = rate_allowance(conn -> rate_limit_ptr, len, now, &next_send);
+    if(len == 0){
+      park_uconn(loop, conn, next_send - now);
+      return;
+    }
+  }
+  submit_recv(loop, conn, conn -> server_fd, len, OP_SERVER_RECV);
+} // End submit_server_recv
+
+
+
+/***************************** TIMERS ***********************************/
+
+// Stops recving from the server for wait ms
+void park_uconn(struct uring_loop *loop, struct uring_conn *conn,
+                long long wait)
+{
+  conn -> parked = 1;
+  conn -> wake_time = monotonic_ms() + wait;
+  uconn_timer_update(loop, conn);
+} // End park_uconn
+
+
+
+/* Stops recving from the client until the provided buffers have had time to
+ * come back from the sends holding them */
+void park_client_recv(struct uring_loop *loop, struct uring_conn *conn)
+{
+  conn -> client_parked = 1;
+  conn -> client_wake_time = monotonic_ms() + NO_BUFS_RETRY_MS;
+  uconn_timer_update(loop, conn);
+} // End park_client_recv
+
+
+
+// Sets the timer to the time the connection next needs attention
+void uconn_timer_update(struct uring_loop *loop, struct uring_conn *conn)
+{
+  conn -> timer.expires = conn -> idle_deadline;
+  if(conn -> parked && conn -> wake_time < conn -> timer.expires){
+    conn -> timer.expires = conn -> wake_time;
+  }
+  if(conn -> client_parked && conn -> client_wake_time < conn -> timer.expires){
+    conn -> timer.expires = conn -> client_wake_time;
+  }
+  timer_update(&(loop -> timers), &(conn -> timer));
+} // End uconn_timer_update
+
+
+
+// Handles every connection whose timer has expired
+void run_uring_timers(struct uring_loop *loop)
+{
+  long long now = monotonic_ms();
+  struct timer *timer;
+
+  while((timer = timer_first(&(loop -> timers))) != NULL &&
+        timer -> expires <= now){
+    struct uring_conn *conn = UCONN_OF_TIMER(timer);
+
+    if(conn -> idle_deadline <= now){
+      close_uconn(loop, conn);
+      continue;
+    }
+
+    int wake = conn -> parked && conn -> wake_time <= now;
+    int wake_client = conn -> client_parked && conn -> client_wake_time <= now;
+    if(wake) conn -> parked = 0;
+    if(wake_client) conn -> client_parked = 0;
+    uconn_timer_update(loop, conn);
+    if(wake) submit_server_recv(loop, conn);
+
+    // The same recv again, a request header must still fit in the storage
+    if(wake_client && conn -> state != UCONN_CLOSED){
+      int len = RELAY_BUF_SIZE;
+      if(conn -> state != UCONN_TUNNEL) len = header_space(&(conn -> request));
+      submit_recv(loop, conn, conn -> client_fd, len, OP_CLIENT_RECV);
+    }
+  }
+} // End run_uring_timers
+
+
+
+/* Shuts down both sockets so whatever is in flight completes. They are only
+ * closed in free_uconn() once the last completion has been reaped, as an SQE
+ * still waiting in the ring would otherwise act on whichever socket is given
+ * the same fd next. */
+void close_uconn(struct uring_loop *loop, struct uring_conn *conn)
+{
+  if(conn -> state == UCONN_CLOSED) return;
+
+  shutdown(conn -> client_fd, SHUT_RDWR);
+  if(conn -> server_fd >= 0) shutdown(conn -> server_fd, SHUT_RDWR);
+
+  timer_remove(&(loop -> timers), &(conn -> timer));
+  admission_release(&(conn -> admission));
+  config_snapshot_put(conn -> config);
+  conn -> state = UCONN_CLOSED;
+
+  if(conn -> in_flight == 0) free_uconn(loop, conn);
+} // End close_uconn
+
+
+
+// Closes the sockets of a closed connection with nothing in flight and puts
+// it on the free list
+void free_uconn(struct uring_loop *loop, struct uring_conn *conn)
+{
+  close(conn -> client_fd);
+  if(conn -> server_fd >= 0) close(conn -> server_fd);
+  conn -> server_fd = -1;
+  release_to_server(loop, conn);
+  conn -> request.amount_stored = 0;
+  release_request_storage(loop, conn);
+  response_free(&(conn -> responses));
+  conn -> next = loop -> free_list;
+  loop -> free_list = conn;
+} // End free_uconn
+
+
+
+/* Makes sure the connection has a to_server buffer.
+ * Return -1 if out of memory, 1 otherwise */
+int take_to_server(struct uring_loop *loop, struct uring_conn *conn)
+{
+  if(conn -> to_server != NULL) return 1;
+
+  conn -> to_server = buffer_get(&(loop -> pool), RELAY_BUF_SIZE);
+  if(conn -> to_server == NULL){
+    printf("ERROR out of memory for relay buffers\n");
+    return -1;
+  }
+  return 1;
+} // End take_to_server
+
+
+
+void release_to_server(struct uring_loop *loop, struct uring_conn *conn)
+{
+  buffer_put(&(loop -> pool), conn -> to_server, RELAY_BUF_SIZE);
+  conn -> to_server = NULL;
+} // End release_to_server
+
+
+
+/* Makes sure the connection has request storage to copy what the client
+ * sends into.
+ * Return -1 if out of memory, 1 otherwise */
+int take_request_storage(struct uring_loop *loop, struct uring_conn *conn)
+{
+  struct header_data *request = &(conn -> request);
+  if(request -> header_storage != NULL) return 1;
+
+  request -> header_storage = buffer_get(&(loop -> pool), MAX_HEADER_LENGTH);
+  if(request -> header_storage == NULL){
+    printf("ERROR out of memory for request storage\n");
+    return -1;
+  }
+  request -> start = request -> amount_stored = 0;
+  reset_header(&(request -> info));
+  return 1;
+} // End take_request_storage
+
+
+
+// Gives the request storage back to the pool if nothing is stored in it
+void release_request_storage(struct uring_loop *loop, struct uring_conn *conn)
+{
+  struct header_data *request = &(conn -> request);
+  if(request -> amount_stored > 0) return;
+
+  buffer_put(&(loop -> pool), request -> header_storage, MAX_HEADER_LENGTH);
+  request -> header_storage = NULL;
+} // End release_request_storage
@@ -0,0 +1,40 @@
+/******************************** uring_loop.h ********************************
+ Description:
+  Single process relay engine using io_uring instead of epoll. Accepts are
+  multishot, reads land in a ring of provided buffers and request bodies are
+  relayed with linked recv -> send requests, so one io_uring_enter() submits
+  and reaps the I/O of every connection.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "relay_comms.h"
+
+struct uring_loop;
+
+
+/* Creates an io_uring loop which accepts connections from lis_sock.
+ *
+ * Return: The loop
+ *         NULL if io_uring (with multishot accept and provided buffer rings)
+ *         is not available, the caller should fall back to event_loop.h
+ */
+struct uring_loop *uring_loop_create(int lis_sock,
+                                     struct config_sect *config_options,
+                                     int rate_limiting);
+
+/* Accepts and relays connections until a fatal error occurs.
+ *
+ * Return -1 on error
+ */
+int uring_loop_run(struct uring_loop *loop);
+
+/* Closes every connection owned by the loop and frees it. The listening
+ * socket is left open. */
+void uring_loop_destroy(struct uring_loop *loop);
+
+#endif
@@ -13,13 +13,13 @@
  * DESCR : Acts as a HTTP rate limiting proxy.
  *         Fulfils requirements 1-3 of Assign2 COMP3310, sem 1 2012
  *
- * TODO:
- *  8 May 12: Implement functionality to keep track of how many connections
- *            are running
+ * Connections running are counted (and limited) by admission.c
  *
  ******************************************************************************/
 
 
+#define _GNU_SOURCE // sched_setaffinity()
+
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <strings.h>
@@ -30,54 +30,140 @@
 #include <netdb.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
 #include <assert.h>
 
 
 #include "relay_comms.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "handoff_queue.h"
+#include "admission.h"
+#include "shared_budget.h"
+#include "buffer_pool.h"
+#include "config_snapshot.h"
 #include "defaults.h"
 #include "config.h"
+#include "header_scan.h"
 
 void fork_proc(int lis_sock,  struct config_sect *config_options, int rate_limiting);
 void no_fork_proc(int lis_sock,  struct config_sect *config_options, int rate_limiting);
+void epoll_proc(int lis_sock,  struct config_sect *config_options, int rate_limiting);
+void uring_proc(int lis_sock,  struct config_sect *config_options, int rate_limiting);
+void loop_proc(int lis_sock,  struct config_sect *config_options, int rate_limiting);
+void prefork_proc(int lis_sock, char *lis_port, struct config_sect *config_options,
+                  int rate_limiting);
+pid_t start_worker(int worker, int *worker_socks, int num_workers,
+                   struct config_sect *config_options, int rate_limiting,
+                   int cpu_steering);
+void threads_proc(int lis_sock, char *lis_port, struct config_sect *config_options,
+                  int rate_limiting);
+void *worker_thread(void *arg);
+void acceptor_proc(int lis_sock, struct config_sect *config_options,
+                   int rate_limiting);
+void handoff_client(struct handoff_queue *queues, int num_queues, int *next,
+                    int client_sock);
+void stats_signal(int sig);
+int accept_admitted(int lis_sock, struct admission_ticket *ticket);
+int *open_listeners(int lis_sock, char *lis_port,
+                    struct config_sect *config_options, int *num_listeners,
+                    int *cpu_steering);
+
+// A thread of the threads engine and the listener it owns
+struct worker_thread_info {
+  pthread_t thread;
+  int lis_sock;
+  int cpu;  // CPU to pin the thread to, -1 if not pinned
+  struct config_sect *config_options;
+  int rate_limiting;
+
+  // Acceptor engine: the thread relays what is put on queues[worker]
+  struct handoff_queue *queues;  // NULL for the threads engine
+  int num_queues, worker;
+};
+
+// Set by SIGUSR1, the acceptor engine then prints its queue counters
+volatile sig_atomic_t print_stats = 0;
 
 
 /* MAIN METHOD */
 int main(int argc, char *argv[] )
 {
-  int sock_lis, debug_mode = 0, rate_limiting = 0;
+  int sock_lis, debug_mode = 0, rate_limiting = 0, lis_flags = 0;
+  char *engine = DEF_ENGINE;
+  char *lis_port = DEF_LIS_PORT;
   struct config_sect * config_options;
 
   // Check for config file and switch
-  char *configFile = parseArgs(argc, argv, &rate_limiting);
-
-  char * lis_port = malloc(10*sizeof(char));
-
-  // Error occurred.
-  if(lis_port == NULL){
-      //handle this error properly
-  }
+  char *configFile = parseArgs(argc, argv, &rate_limiting, &engine);
 
   if(configFile != NULL){
     config_options = config_load(configFile);
-    lis_port = extractListPort(config_options);
+    if(extractListPort(config_options) != NULL){
+      lis_port = extractListPort(config_options);
+    }
     debug_mode = extractDebugLevel(config_options);
   } else {
 //     printf("No config file given\n");
-    strcpy(lis_port, DEF_LIS_PORT);
     config_options = NULL;
   }
+
+  // The header scanner is picked once, before any worker or thread starts
+  scan_select(NULL);
+
+  set_zerocopy_threshold(extractIntOption(config_options, "zerocopy_threshold",
+                                          0));
+  buffer_pool_hugepages(extractIntOption(config_options, "hugepages", 0));
+  rate_kernel_pacing(extractIntOption(config_options, "kernel_pacing", 0));
+
+  // Counters are shared by every worker so must be set up before forking
+  if(admission_init(config_options) < 0) return -1;
+  if(shared_budget_init() < 0) return -1;
+
+  /* Connections use the current snapshot, reloaded on SIGHUP. main keeps a
+   * reference to the first so the start up options stay valid. */
+  if(config_snapshot_init(configFile, config_options) < 0) return -1;
+  config_snapshot_get();
+
+  // Workers each get their own listener on the port
+  if(strcmp(engine, "prefork") == 0 || strcmp(engine, "threads") == 0){
+    lis_flags = SOCK_REUSEPORT;
+  }
       
   // Start listening for incoming connections
-  sock_lis = setup_socket(lis_port, NULL);
-  
-  free(lis_port);
+  sock_lis = setup_socket(lis_port, NULL, lis_flags);
   
   if(sock_lis < 0){
     printf("ERROR Could not set up listening socket");
     return -1;
   } 
 
- fork_proc(sock_lis, config_options, rate_limiting);
+  if(strcmp(engine, "fork") == 0){
+    fork_proc(sock_lis, config_options, rate_limiting);
+  }
+  else if(strcmp(engine, "epoll") == 0){
+    epoll_proc(sock_lis, config_options, rate_limiting);
+  }
+  else if(strcmp(engine, "uring") == 0){
+    uring_proc(sock_lis, config_options, rate_limiting);
+  }
+  else if(strcmp(engine, "prefork") == 0){
+    prefork_proc(sock_lis, lis_port, config_options, rate_limiting);
+  }
+  else if(strcmp(engine, "threads") == 0){
+    threads_proc(sock_lis, lis_port, config_options, rate_limiting);
+  }
+  else if(strcmp(engine, "acceptor") == 0){
+    acceptor_proc(sock_lis, config_options, rate_limiting);
+  }
+  else {
+    printf("ERROR Unknown engine: %s\n", engine);
+  }
 //   no_fork_proc(sock_lis, config_options, rate_limiting); //(Testing)
 
   close(sock_lis);
@@ -90,13 +176,15 @@ void no_fork_proc(int sock_lis,
 		struct config_sect *config_options,
 		int rate_limiting){
   int client_sock;
+  struct admission_ticket ticket;
 
-  if ( (client_sock = accept(sock_lis, NULL, NULL)) < 0){
+  if ( (client_sock = accept_admitted(sock_lis, &ticket)) < 0){
       printf("ERROR in creating socket: %s", strerror(errno));
       return ;
   }
 
-  relay(client_sock, config_options,rate_limiting );
+  relay(client_sock, config_options,rate_limiting, &ticket);
+  admission_release(&ticket);
   close(client_sock);
 } // End no_fork_proc
 
@@ -107,6 +195,11 @@ void fork_proc(int sock_lis,
 
   int client_sock;
   pid_t fork_pid;
+  struct admission_ticket ticket;
+  struct config_snapshot *config;
+
+  // Children are reaped by the kernel so they do not become defunct
+  signal(SIGCHLD, SIG_IGN);
 
   // Enter infinite loop to respond to connections
   while(1){
@@ -114,25 +207,503 @@ void fork_proc(int sock_lis,
       fprintf(stdout, "\nWaiting For connection\n");
 
       // wait till a connection can be accepted
-      if ( (client_sock = accept(sock_lis, NULL, NULL)) < 0){
+      client_sock = accept_admitted(sock_lis, &ticket);
+      config_reload_check();
+      if (client_sock < 0){
+          if(errno == EINTR) continue;
           printf("ERROR in creating socket: %s", strerror(errno));
           continue; // Go to the next loop and accept a new connection
       }
 
+      // The child relays with the rules current when it was accepted
+      config = config_snapshot_get();
+
 //       fprintf(stdout, "Connection Made: Forking child\n");
       fork_pid = fork();
       /* Code executed by child */
       if(fork_pid == 0){
 //           fprintf(stdout, "IC: In child process\n");
+          close(sock_lis);
+          signal(SIGHUP, SIG_IGN);
 
-          relay(client_sock, config_options, rate_limiting);
+          relay(client_sock, config -> config_options, rate_limiting, &ticket);
+          admission_release(&ticket);
 
 //           fprintf(stdout, "IC: Leaving child process\n");
+          close(client_sock);
+          exit(0);
       }
       else if(fork_pid < 0){
          printf("ERROR in creating fork");
+         admission_release(&ticket);
       }
+      config_snapshot_put(config);
       close(client_sock);
   }
 } // End fork_proc
 
+
+
+/* Accepts the next client which is within the connection limits, see
+ * admission.h. Clients over the limits are sent a 503 and closed. While
+ * the proxy is paused at max_connections nothing is accepted.
+ *
+ * Return the client socket (counted against ticket) or -1 on error
+ */
+int accept_admitted(int sock_lis, struct admission_ticket *ticket){
+  int client_sock;
+
+  admission_ticket_init(ticket);
+  while(1){
+    while(admission_paused()) usleep(ADMISSION_POLL_MS * 1000);
+
+    client_sock = accept(sock_lis, NULL, NULL);
+    if(client_sock < 0) return -1;
+
+    if(admit_client(client_sock, ticket) == 1) return client_sock;
+
+    send_overloaded(client_sock);
+    close(client_sock);
+  }
+} // End accept_admitted
+
+
+
+// Relay every connection from this process using the epoll event loop
+void epoll_proc(int sock_lis,
+		struct config_sect *config_options,
+		int rate_limiting){
+
+  struct event_loop *loop =
+    event_loop_create(sock_lis, config_options, rate_limiting);
+  if(loop == NULL){
+    printf("ERROR could not create the event loop\n");
+    return;
+  }
+
+  event_loop_run(loop);
+  event_loop_destroy(loop);
+} // End epoll_proc
+
+
+
+/* Relay every connection from this process using io_uring. Falls back to
+ * epoll if the kernel does not support what the io_uring loop needs. */
+void uring_proc(int sock_lis,
+		struct config_sect *config_options,
+		int rate_limiting){
+
+  struct uring_loop *loop =
+    uring_loop_create(sock_lis, config_options, rate_limiting);
+  if(loop == NULL){
+    printf("Falling back to epoll\n");
+    epoll_proc(sock_lis, config_options, rate_limiting);
+    return;
+  }
+
+  uring_loop_run(loop);
+  uring_loop_destroy(loop);
+} // End uring_proc
+
+
+
+// Runs the event loop of a prefork/threads worker, see the io_backend token
+void loop_proc(int sock_lis,
+	       struct config_sect *config_options,
+	       int rate_limiting){
+
+  char *backend = config_get_value(config_options, "default", "io_backend", 0);
+
+  if(backend != NULL && strcmp(backend, "uring") == 0){
+    uring_proc(sock_lis, config_options, rate_limiting);
+  }
+  else {
+    epoll_proc(sock_lis, config_options, rate_limiting);
+  }
+} // End loop_proc
+
+
+
+/* Opens a SO_REUSEPORT listener for every worker, one per CPU unless
+ * "workers" is set in the conf file. lis_sock is used as the first listener.
+ * With "cpu_steering = 1" the CPU steering program is attached to the group.
+ * The listeners are opened in worker order so listener i is index i in the
+ * group.
+ *
+ * Return the listening sockets (num_listeners of them), NULL if out of memory
+ */
+int *open_listeners(int lis_sock, char *lis_port,
+                    struct config_sect *config_options, int *num_listeners,
+                    int *cpu_steering){
+
+  int i;
+  int num_workers = extractIntOption(config_options, "workers",
+                                     sysconf(_SC_NPROCESSORS_ONLN));
+  if(num_workers < 1) num_workers = 1;
+
+  int *worker_socks = malloc(num_workers * sizeof(int));
+  if(worker_socks == NULL) return NULL;
+
+  worker_socks[0] = lis_sock;
+  for(i = 1; i < num_workers; i++){
+    worker_socks[i] = setup_socket(lis_port, NULL, SOCK_REUSEPORT);
+    if(worker_socks[i] < 0){
+      printf("ERROR only %d listeners could be opened\n", i);
+      num_workers = i;
+      break;
+    }
+  }
+
+  *cpu_steering = extractIntOption(config_options, "cpu_steering", 0);
+  if(*cpu_steering && attach_cpu_steering(lis_sock, num_workers) < 0){
+    *cpu_steering = 0;
+  }
+
+  *num_listeners = num_workers;
+  return worker_socks;
+} // End open_listeners
+
+
+
+/* Pre-forks a pool of workers, one per CPU unless "workers" is set in the
+ * conf file. Every worker has its own SO_REUSEPORT listener and runs its own
+ * epoll loop so nothing is forked per connection and the kernel spreads new
+ * connections between the workers. With "cpu_steering = 1" each worker is
+ * pinned to a CPU and a connection goes to the worker on the CPU it arrived.
+ *
+ * The listeners are all opened here, in worker order, and stay open in the
+ * parent so a worker which dies, or could not be forked, is restarted on the
+ * same listener.
+ */
+void prefork_proc(int sock_lis, char *lis_port,
+		  struct config_sect *config_options,
+		  int rate_limiting){
+
+  int num_workers, cpu_steering, pending, i;
+  pid_t pid;
+
+  int *worker_socks = open_listeners(sock_lis, lis_port, config_options,
+                                     &num_workers, &cpu_steering);
+  if(worker_socks == NULL){
+    printf("ERROR out of memory for workers\n");
+    return;
+  }
+  pid_t *worker_pids = malloc(num_workers * sizeof(pid_t));
+  if(worker_pids == NULL){
+    printf("ERROR out of memory for workers\n");
+    free(worker_socks);
+    return;
+  }
+
+  for(i = 0; i < num_workers; i++){
+    worker_pids[i] = start_worker(i, worker_socks, num_workers,
+                                  config_options, rate_limiting, cpu_steering);
+  }
+  printf("Started %d workers\n", num_workers);
+
+  // Restart any worker which exits. A worker which could not be forked is
+  // retried every second, its listener is still in the group and the
+  // connections hashed to it would hang until then.
+  while(1){
+    pending = 0;
+    for(i = 0; i < num_workers; i++){
+      if(worker_pids[i] > 0) continue;
+      worker_pids[i] = start_worker(i, worker_socks, num_workers,
+                                    config_options, rate_limiting,
+                                    cpu_steering);
+      if(worker_pids[i] < 0) pending = 1;
+    }
+
+    pid = waitpid(-1, NULL, pending ? WNOHANG : 0);
+
+    // Each worker has its own copy of the config, pass the reload on
+    if(config_reload_check()){
+      for(i = 0; i < num_workers; i++){
+        if(worker_pids[i] > 0) kill(worker_pids[i], SIGHUP);
+      }
+    }
+
+    if(pid < 0){
+      if(errno == EINTR) continue;
+      if(errno == ECHILD && pending){
+        sleep(1);
+        continue;
+      }
+      printf("ERROR waiting for workers: %s\n", strerror(errno));
+      break;
+    }
+    if(pid == 0){
+      sleep(1); // no worker exited, wait before retrying the failed ones
+      continue;
+    }
+
+    for(i = 0; i < num_workers; i++){
+      if(worker_pids[i] != pid) continue;
+      printf("Worker %d exited, restarting\n", i);
+      sleep(1); // do not spin if the worker keeps failing
+      worker_pids[i] = start_worker(i, worker_socks, num_workers,
+                                    config_options, rate_limiting,
+                                    cpu_steering);
+    }
+  }
+
+  for(i = 1; i < num_workers; i++) close(worker_socks[i]);
+  free(worker_socks);
+  free(worker_pids);
+} // End prefork_proc
+
+
+
+/* Forks a worker which relays connections from its own listener. The worker
+ * is killed when the parent exits.
+ *
+ * Return the pid of the worker, -1 if it could not be forked
+ */
+pid_t start_worker(int worker, int *worker_socks, int num_workers,
+                   struct config_sect *config_options, int rate_limiting,
+                   int cpu_steering){
+
+  int i;
+  pid_t pid = fork();
+  if(pid < 0){
+    printf("ERROR in creating fork");
+    return -1;
+  }
+  if(pid > 0) return pid;
+
+  /* Code executed by the worker */
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+  for(i = 0; i < num_workers; i++){
+    if(i != worker) close(worker_socks[i]);
+  }
+
+  if(cpu_steering){
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    if(sched_setaffinity(0, sizeof(cpus), &cpus) < 0){
+      printf("ERROR pinning worker %d: %s\n", worker, strerror(errno));
+    }
+  }
+
+  loop_proc(worker_socks[worker], config_options, rate_limiting);
+  exit(EXIT_FAILURE);
+} // End start_worker
+
+
+
+/* Runs one epoll loop per thread, one thread per CPU unless "workers" is set
+ * in the conf file. Each thread owns its own SO_REUSEPORT listener, event
+ * loop and connections, so a connection is relayed start to finish on the
+ * thread which accepted it and the hot path takes no locks. The config is
+ * loaded once and shared read-only between the threads.
+ */
+void threads_proc(int sock_lis, char *lis_port,
+		  struct config_sect *config_options,
+		  int rate_limiting){
+
+  int num_threads, started, cpu_steering, i;
+
+  int *thread_socks = open_listeners(sock_lis, lis_port, config_options,
+                                     &num_threads, &cpu_steering);
+  if(thread_socks == NULL){
+    printf("ERROR out of memory for threads\n");
+    return;
+  }
+  struct worker_thread_info *threads =
+    malloc(num_threads * sizeof(struct worker_thread_info));
+  if(threads == NULL){
+    printf("ERROR out of memory for threads\n");
+    free(thread_socks);
+    return;
+  }
+
+  for(i = 0; i < num_threads; i++){
+    threads[i].lis_sock = thread_socks[i];
+    threads[i].cpu = cpu_steering ? i % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+    threads[i].config_options = config_options;
+    threads[i].rate_limiting = rate_limiting;
+    threads[i].queues = NULL;
+
+    if(pthread_create(&(threads[i].thread), NULL, worker_thread,
+                      &threads[i]) != 0){
+      printf("ERROR creating thread %d\n", i);
+      break;
+    }
+  }
+  started = i;
+  printf("Started %d threads\n", started);
+
+  // Nobody accepts on the listeners of threads which did not start, take
+  // them out of the group so no connections are hashed to them
+  for(i = (started > 1 ? started : 1); i < num_threads; i++){
+    close(thread_socks[i]);
+  }
+
+  for(i = 0; i < started; i++){
+    pthread_join(threads[i].thread, NULL);
+  }
+
+  for(i = 1; i < started; i++) close(thread_socks[i]);
+  free(thread_socks);
+  free(threads);
+} // End threads_proc
+
+
+
+// Body of a threads engine thread. Relays connections from its listener.
+void *worker_thread(void *arg){
+  struct worker_thread_info *info = arg;
+
+  if(info -> cpu >= 0){
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(info -> cpu, &cpus);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0){
+      printf("ERROR pinning thread to CPU %d\n", info -> cpu);
+    }
+  }
+
+  if(info -> queues == NULL){
+    loop_proc(info -> lis_sock, info -> config_options, info -> rate_limiting);
+    return NULL;
+  }
+
+  struct event_loop *loop =
+    event_loop_create_worker(info -> queues, info -> num_queues,
+                             info -> worker, info -> config_options,
+                             info -> rate_limiting);
+  if(loop == NULL){
+    printf("ERROR could not create the event loop\n");
+    return NULL;
+  }
+  event_loop_run(loop);
+  event_loop_destroy(loop);
+  return NULL;
+} // End worker_thread
+
+
+
+/* One thread accepts every connection and hands it to a pool of worker
+ * threads (one per CPU unless "workers" is set in the conf file) through a
+ * lock-free queue per worker. Connections are dealt out round robin and a
+ * worker with nothing left on its own queue steals from the others, so
+ * connections do not back up behind a worker stuck on a slow origin.
+ *
+ * Send SIGUSR1 to print the depth and steal counters of each queue.
+ */
+void acceptor_proc(int sock_lis,
+		   struct config_sect *config_options,
+		   int rate_limiting){
+
+  int num_workers, i, client_sock, next = 0;
+
+  num_workers = extractIntOption(config_options, "workers",
+                                 sysconf(_SC_NPROCESSORS_ONLN));
+  if(num_workers < 1) num_workers = 1;
+
+  struct handoff_queue *queues =
+    aligned_alloc(CACHE_LINE, num_workers * sizeof(struct handoff_queue));
+  struct worker_thread_info *threads =
+    malloc(num_workers * sizeof(struct worker_thread_info));
+  if(queues == NULL || threads == NULL){
+    printf("ERROR out of memory for workers\n");
+    free(queues);
+    free(threads);
+    return;
+  }
+
+  for(i = 0; i < num_workers; i++){
+    if(handoff_queue_init(&queues[i], HANDOFF_QUEUE_SIZE) < 0){
+      printf("ERROR only %d handoff queues could be made\n", i);
+      num_workers = i;
+      break;
+    }
+  }
+  if(num_workers == 0){
+    free(queues);
+    free(threads);
+    return;
+  }
+
+  for(i = 0; i < num_workers; i++){
+    threads[i] = (struct worker_thread_info) {
+      .lis_sock = -1, .cpu = -1, .config_options = config_options,
+      .rate_limiting = rate_limiting, .queues = queues,
+      .num_queues = num_workers, .worker = i
+    };
+    if(pthread_create(&(threads[i].thread), NULL, worker_thread,
+                      &threads[i]) != 0){
+      printf("ERROR creating thread %d\n", i);
+      exit(EXIT_FAILURE); // the other workers already steal from its queue
+    }
+  }
+  printf("Started %d workers\n", num_workers);
+
+  // Not SA_RESTART so accept() returns and the counters get printed
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stats_signal;
+  sigaction(SIGUSR1, &action, NULL);
+
+  while(1){
+    if(print_stats){
+      print_stats = 0;
+      handoff_print_stats(queues, num_workers);
+      admission_print_stats();
+    }
+    config_reload_check();
+
+    /* Workers count the clients, so the acceptor waits for a client with
+     * poll() rather than in accept() to see a pause as soon as it starts */
+    if(admission_paused()){
+      usleep(ADMISSION_POLL_MS * 1000);
+      continue;
+    }
+    struct pollfd listener = {.fd = sock_lis, .events = POLLIN};
+    if(poll(&listener, 1, ADMISSION_POLL_MS) <= 0) continue;
+    if(admission_paused()) continue;
+
+    client_sock = accept4(sock_lis, NULL, NULL, SOCK_NONBLOCK);
+    if(client_sock < 0){
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      printf("ERROR in accepting connection: %s\n", strerror(errno));
+      if(errno == EMFILE || errno == ENFILE) sleep(1);
+      continue;
+    }
+
+    handoff_client(queues, num_workers, &next, client_sock);
+  }
+} // End acceptor_proc
+
+
+
+/* Pushes a client onto the next worker's queue, or the one after if that is
+ * full, and wakes the worker. If the worker has not taken what it was given
+ * last time it is busy, so the worker after it is woken too to steal.
+ */
+void handoff_client(struct handoff_queue *queues, int num_queues, int *next,
+                    int client_sock){
+
+  int i, worker;
+
+  for(i = 0; i < num_queues; i++){
+    worker = (*next + i) % num_queues;
+    if(handoff_push(&queues[worker], client_sock) < 0) continue;
+
+    *next = (worker + 1) % num_queues;
+    handoff_notify(&queues[worker]);
+    if(handoff_depth(&queues[worker]) > 1) handoff_notify(&queues[*next]);
+    return;
+  }
+
+  printf("ERROR every worker queue is full, dropping connection\n");
+  close(client_sock);
+} // End handoff_client
+
+
+
+void stats_signal(int sig){
+  print_stats = 1;
+} // End stats_signal
@@ -0,0 +1,215 @@
+/****************************** zerocopy_bench.c ******************************
+ Description:
+  Compares the CPU cost of relaying a response to the client with plain
+  write() against MSG_ZEROCOPY (see set_zerocopy_threshold()). Both send
+  the same way relay_response() does, through send_rate_limited() or from
+  a zerocopy_ring.
+
+  Usage: zerocopy_bench [MB to send] [send size] [host port]
+
+  The cost is counted in CPU cycles of the sending thread (user and kernel)
+  with perf_event_open(), or in CPU time if the cycle counter can not be
+  opened (e.g. perf_event_paranoid > 1 or in a VM).
+
+  Without host and port it sends to a receiver thread over loopback. The
+  kernel has to copy zero copy sends which are delivered locally, so loopback
+  only shows the cost of the completion handling. Send to a remote discard
+  server (e.g. "nc -l 9000 > /dev/null") to see the saving.
+
+ Author(s): Sebastian Carroll (u4395897), Geoffrey Goldstraw (u4528129)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#include "relay_comms.h"
+
+#define DEF_BENCH_MB 1024
+#define DEF_SEND_SIZE 65536
+
+/**************************** Prototypes ********************************/
+int open_cycle_counter(void);
+long long thread_cpu_ns(void);
+int connect_loopback(pthread_t *receiver);
+void *receive_all(void *arg);
+void run_bench(char *name, int sock, char *buf, int send_size,
+               long long total, int cycles_fd);
+/***********************************************************************/
+
+
+int main(int argc, char *argv[])
+{
+  long long total = (long long) DEF_BENCH_MB * 1024 * 1024;
+  int send_size = DEF_SEND_SIZE;
+  pthread_t receiver;
+  int sock;
+
+  if(argc > 1) total = atoll(argv[1]) * 1024 * 1024;
+  if(argc > 2) send_size = atoi(argv[2]);
+  if(total <= 0 || send_size <= 0 || send_size > RELAY_SPLICE_SIZE){
+    printf("Usage: %s [MB to send] [send size] [host port]\n", argv[0]);
+    return 1;
+  }
+
+  if(argc > 4) sock = setup_socket(argv[4], argv[3], 0);
+  else sock = connect_loopback(&receiver);
+  if(sock < 0){
+    printf("ERROR could not connect\n");
+    return 1;
+  }
+
+  char *buf = malloc(send_size);
+  if(buf == NULL) return 1;
+  memset(buf, 'x', send_size);
+
+  int cycles_fd = open_cycle_counter();
+  printf("Sending %lld MB in %d byte sends, cost per byte in %s\n",
+         total / (1024 * 1024), send_size,
+         (cycles_fd >= 0) ? "CPU cycles" : "CPU ns (no cycle counter)");
+
+  set_zerocopy_threshold(0);
+  run_bench("write", sock, buf, send_size, total, cycles_fd);
+
+  set_zerocopy_threshold(send_size);
+  run_bench("MSG_ZEROCOPY", sock, buf, send_size, total, cycles_fd);
+  set_zerocopy_threshold(0);
+
+  shutdown(sock, SHUT_WR);
+  if(argc <= 4) pthread_join(receiver, NULL);
+  close(sock);
+  free(buf);
+  return 0;
+} // End main
+
+
+
+/* Sends total bytes with send_rate_limited(), or from a zerocopy_ring if
+ * the zero copy threshold is set, and prints the cost per byte */
+void run_bench(char *name, int sock, char *buf, int send_size,
+               long long total, int cycles_fd)
+{
+  long long sent = 0, cycles = 0;
+  struct zerocopy_ring zerocopy;
+
+  zerocopy_open(&zerocopy, sock);
+
+  if(cycles_fd >= 0){
+    ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  long long start_ns = thread_cpu_ns();
+
+  while(sent < total){
+    int status;
+    if(zerocopy.socket >= 0){
+      char *message = zerocopy_buffer(&zerocopy);
+      status = (message == NULL) ? -1 :
+        send_zerocopy(&zerocopy, message, send_size);
+    }
+    else status = send_rate_limited(sock, buf, send_size, NULL);
+
+    if(status <= 0){
+      printf("ERROR sending: %s\n", strerror(errno));
+      zerocopy_close(&zerocopy);
+      return;
+    }
+    sent += send_size;
+  }
+  zerocopy_close(&zerocopy);
+
+  long long cpu_ns = thread_cpu_ns() - start_ns;
+  if(cycles_fd >= 0){
+    ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles)) cycles = 0;
+  }
+
+  printf("%-14s %8.3f %s/byte  %8.1f MB/s of CPU time\n", name,
+         (double) ((cycles_fd >= 0) ? cycles : cpu_ns) / sent,
+         (cycles_fd >= 0) ? "cycles" : "ns",
+         (sent / (1024.0 * 1024.0)) / (cpu_ns / 1e9));
+} // End run_bench
+
+
+
+/* Opens a counter of the CPU cycles used by this thread, in the kernel too
+ * as that is where the copy happens.
+ * Return the counter or -1 if it is not available */
+int open_cycle_counter(void)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+} // End open_cycle_counter
+
+
+
+long long thread_cpu_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+} // End thread_cpu_ns
+
+
+
+/* Connects to a receiver thread over loopback which reads and throws away
+ * everything sent.
+ * Return the socket to send on or -1 on error */
+int connect_loopback(pthread_t *receiver)
+{
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t addr_len = sizeof(addr);
+
+  int lis_sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(lis_sock < 0 || bind(lis_sock, (struct sockaddr *) &addr, addr_len) < 0
+     || listen(lis_sock, 1) < 0
+     || getsockname(lis_sock, (struct sockaddr *) &addr, &addr_len) < 0)
+    return -1;
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(sock < 0 || connect(sock, (struct sockaddr *) &addr, addr_len) < 0){
+    return -1;
+  }
+
+  long recv_sock = accept(lis_sock, NULL, NULL);
+  close(lis_sock);
+  if(recv_sock < 0) return -1;
+
+  if(pthread_create(receiver, NULL, receive_all, (void *) recv_sock) != 0){
+    return -1;
+  }
+  return sock;
+} // End connect_loopback
+
+
+
+void *receive_all(void *arg)
+{
+  int sock = (long) arg;
+  char buf[DEF_SEND_SIZE];
+
+  while(read(sock, buf, sizeof(buf)) > 0);
+  close(sock);
+  return NULL;
+} // End receive_all